@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Asynchronous access log: per-thread rings of binary records, formatted and written by a background thread.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "access_log.h"
+#include "config.h"
+#include "file_transfer.h"
+
+// Records per thread ring (a power of two)
+#define RING_RECORDS    2048
+
+// Longest request line kept in a record ("METHOD PATH PROTOCOL"; longer paths are cut)
+#define REQUEST_BYTES   192
+
+// The flusher wakes up this often, or earlier when a ring is half full
+#define FLUSH_INTERVAL  (100 * 1000 * 1000)
+
+// Formatted records are written in batches of up to this many bytes
+#define OUTPUT_BYTES    (64 * 1024)
+
+#define RECORD_REQUEST      0
+#define RECORD_CONNECTED    1
+#define RECORD_CLOSED       2
+
+/**
+ * What a thread logs: only copies, no formatting.
+ */
+struct log_record {
+    struct timespec time;
+    struct sockaddr_in6 peer;   // Also holds IPv4 addresses
+
+    unsigned long long bytes;
+    short status;
+    unsigned char kind;
+
+    unsigned short request_length;
+    char request[REQUEST_BYTES];
+};
+
+/**
+ * Single-producer, single-consumer ring: the owning thread fills records at tail, the flusher takes them from head.
+ */
+struct log_ring {
+    _Alignas(64) atomic_ulong head;
+    _Alignas(64) atomic_ulong tail;
+
+    atomic_ulong dropped;       // Records lost because the ring was full
+
+    struct log_ring *next;      // Rings of all threads, newest first
+
+    struct log_record records[RING_RECORDS];
+};
+
+static _Thread_local struct log_ring *thread_ring;
+static _Thread_local unsigned long sampled;
+
+static _Atomic(struct log_ring *) rings;
+
+static pthread_t flusher;
+static int running;
+static atomic_int stopping;
+
+static pthread_mutex_t wakeup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+
+static struct log_ring *ring_of_thread(void) {
+    if(thread_ring == NULL) {
+        struct log_ring *ring = (struct log_ring *) aligned_alloc(64, sizeof(struct log_ring));
+
+        if(ring == NULL) {
+            return NULL;
+        }
+
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->dropped, 0);
+
+        // Rings are never removed, so publishing one is a single compare-and-swap
+        ring->next = atomic_load(&rings);
+
+        while(!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+        }
+
+        thread_ring = ring;
+    }
+
+    return thread_ring;
+}
+
+/**
+ * @return Whether a record of \p level is wanted; records below LOG_ERROR are kept one in config.log_sample.
+ */
+static int wanted(int level) {
+    if(level > config.log_level) {
+        return 0;
+    }
+
+    return level == LOG_ERROR || config.log_sample <= 1 || sampled++ % config.log_sample == 0;
+}
+
+/**
+ * @return The next free record of the calling thread's ring, or NULL if it is full. The record is published by commit().
+ */
+static struct log_record *reserve(void) {
+    struct log_ring *ring = ring_of_thread();
+
+    if(ring == NULL) {
+        return NULL;
+    }
+
+    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if(tail - atomic_load_explicit(&ring->head, memory_order_acquire) >= RING_RECORDS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    struct log_record *record = &ring->records[tail % RING_RECORDS];
+
+    // time(2) and the coarse clocks are served by the vDSO, without entering the kernel
+    clock_gettime(CLOCK_REALTIME_COARSE, &record->time);
+
+    return record;
+}
+
+static void commit(void) {
+    struct log_ring *ring = thread_ring;
+    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed) + 1;
+
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    // Half full: do not wait for the next period
+    if(tail - atomic_load_explicit(&ring->head, memory_order_relaxed) == RING_RECORDS / 2) {
+        pthread_cond_signal(&wakeup);
+    }
+}
+
+/**
+ * Copies the address of the other end of \p client into \p record, asking the kernel only once per connection.
+ */
+static void copy_peer(struct client *client, struct log_record *record) {
+    if(client->peer.sin6_family == 0 && client->socket != -1) {
+        socklen_t length = sizeof(struct sockaddr_in6);
+
+        if(getpeername(client->socket, (struct sockaddr *) &client->peer, &length) == -1) {
+            client->peer.sin6_family = AF_UNSPEC;
+        }
+    }
+
+    record->peer = client->peer;
+}
+
+/**
+ * Appends \p length bytes of \p data to the request line of \p record, as far as they fit.
+ */
+static void append(struct log_record *record, const char *data, int length) {
+    int room = REQUEST_BYTES - record->request_length;
+
+    if(length > room) {
+        length = room;
+    }
+
+    memcpy(record->request + record->request_length, data, length);
+    record->request_length += length;
+}
+
+/**
+ * Copies the request line of \p client, if it was parsed, into \p record.
+ */
+static void copy_request(struct client *client, struct log_record *record) {
+    struct http_parser *parser = &client->parser;
+
+    record->request_length = 0;
+
+    if(parser->method.data == NULL || client->buffer == NULL) {
+        return;
+    }
+
+    append(record, parser->method.data, parser->method.length);
+    append(record, " ", 1);
+    append(record, parser->path.data, strnlen(parser->path.data, parser->path.length));
+    append(record, " ", 1);
+    append(record, parser->protocol.data, parser->protocol.length);
+}
+
+static void log_request(struct client *client, int status, unsigned long long bytes) {
+    struct log_record *record = reserve();
+
+    if(record == NULL) {
+        return;
+    }
+
+    record->kind = RECORD_REQUEST;
+    record->status = status;
+    record->bytes = bytes;
+
+    copy_peer(client, record);
+    copy_request(client, record);
+
+    commit();
+}
+
+void log_reply(struct client *client) {
+    if(!wanted(LOG_INFO)) {
+        return;
+    }
+
+    int status = (client->status == STATUS_404) ? 404 : (client->status == STATUS_403) ? 403 : (client->status == STATUS_503) ? 503 : (client->reply_code != 0) ? client->reply_code : 200;
+
+    log_request(client, status, reply_length(client));
+}
+
+void log_rejection(struct client *client, int code) {
+    if(!wanted(LOG_ERROR)) {
+        return;
+    }
+
+    log_request(client, code, 0);
+}
+
+void log_connection(struct client *client, int opened) {
+    if(!wanted(LOG_DEBUG)) {
+        return;
+    }
+
+    struct log_record *record = reserve();
+
+    if(record == NULL) {
+        return;
+    }
+
+    record->kind = opened ? RECORD_CONNECTED : RECORD_CLOSED;
+    record->status = 0;
+    record->bytes = 0;
+    record->request_length = 0;
+
+    copy_peer(client, record);
+
+    commit();
+}
+
+/**
+ * Formats \p record as one line at \p output (which has room for it).
+ *
+ * @return Length of the line.
+ */
+static int format_record(struct log_record *record, char *output) {
+    // Records mostly share their second, so the date is only formatted again when it changes
+    static time_t last_second = -1;
+    static char date[32];
+
+    if(record->time.tv_sec != last_second) {
+        struct tm broken_down;
+
+        gmtime_r(&record->time.tv_sec, &broken_down);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &broken_down);
+
+        last_second = record->time.tv_sec;
+    }
+
+    char address[INET6_ADDRSTRLEN] = "-";
+    int port = 0;
+
+    if(record->peer.sin6_family == AF_INET) {
+        struct sockaddr_in *peer = (struct sockaddr_in *) &record->peer;
+
+        inet_ntop(AF_INET, &peer->sin_addr, address, sizeof(address));
+        port = ntohs(peer->sin_port);
+    }
+    else if(record->peer.sin6_family == AF_INET6) {
+        inet_ntop(AF_INET6, &record->peer.sin6_addr, address, sizeof(address));
+        port = ntohs(record->peer.sin6_port);
+    }
+
+    int length = sprintf(output, "%s.%03ldZ %s:%d ", date, record->time.tv_nsec / 1000000, address, port);
+
+    switch(record->kind) {
+    case RECORD_CONNECTED:
+        length += sprintf(output + length, "connected\n");
+        break;
+    case RECORD_CLOSED:
+        length += sprintf(output + length, "closed\n");
+        break;
+    default:
+        length += sprintf(output + length, "\"%.*s\" %d %llu\n", record->request_length, record->request, record->status, record->bytes);
+        break;
+    }
+
+    return length;
+}
+
+static void write_all(const char *data, size_t length) {
+    while(length > 0) {
+        ssize_t result = write(STDOUT_FILENO, data, length);
+
+        if(result == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            return;
+        }
+
+        data += result;
+        length -= result;
+    }
+}
+
+// Room for the longest formatted record
+#define RECORD_LINE (REQUEST_BYTES + 128)
+
+/**
+ * Formats and writes the records of every ring.
+ */
+static void flush_rings(char *output, unsigned long *reported) {
+    size_t length = 0;
+    unsigned long dropped = 0;
+
+    for(struct log_ring *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        for(; head != tail; head++) {
+            if(length + RECORD_LINE > OUTPUT_BYTES) {
+                write_all(output, length);
+                length = 0;
+            }
+
+            length += format_record(&ring->records[head % RING_RECORDS], output + length);
+
+            // Give the record back as soon as it has been copied out
+            atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        }
+
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+
+    if(dropped != *reported) {
+        length += sprintf(output + length, "access log: %lu records dropped\n", dropped - *reported);
+        *reported = dropped;
+    }
+
+    if(length > 0) {
+        write_all(output, length);
+    }
+}
+
+static void *flush_loop(void *argument) {
+    char *output = (char *) argument;
+    unsigned long reported = 0;
+
+    while(!atomic_load(&stopping)) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+
+        deadline.tv_nsec += FLUSH_INTERVAL;
+
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&wakeup_mutex);
+
+        if(!atomic_load(&stopping)) {
+            pthread_cond_timedwait(&wakeup, &wakeup_mutex, &deadline);
+        }
+
+        pthread_mutex_unlock(&wakeup_mutex);
+
+        flush_rings(output, &reported);
+    }
+
+    // The threads that log have finished by now
+    flush_rings(output, &reported);
+
+    free(output);
+
+    return NULL;
+}
+
+int access_log_start(void) {
+    if(running || config.log_level == LOG_OFF) {
+        return 0;
+    }
+
+    char *output = (char *) malloc(OUTPUT_BYTES);
+
+    if(output == NULL) {
+        return -1;
+    }
+
+    atomic_store(&stopping, 0);
+
+    if(pthread_create(&flusher, NULL, flush_loop, output) != 0) {
+        free(output);
+        return -1;
+    }
+
+    running = 1;
+
+    return 0;
+}
+
+void access_log_stop(void) {
+    if(!running) {
+        return;
+    }
+
+    pthread_mutex_lock(&wakeup_mutex);
+    atomic_store(&stopping, 1);
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&wakeup_mutex);
+
+    pthread_join(flusher, NULL);
+
+    running = 0;
+}
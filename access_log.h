@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include "clients_common.h"
+
+// Log levels (see config.log_level): each one includes the ones before
+#define LOG_OFF     0
+#define LOG_ERROR   1   // Rejected requests
+#define LOG_INFO    2   // Replies sent
+#define LOG_DEBUG   3   // Connections opened and closed
+
+/**
+ * Starts the thread that writes the log to the standard output. Threads log by filling compact records in a ring
+ * of their own, without locks or system calls; the flusher formats the records of all rings and writes them in
+ * batches. When a ring is full, its records are dropped (and counted) rather than making the thread wait.
+ *
+ * Must be called in every process that logs (after fork(), in fork mode). Does nothing if it is running already,
+ * or if the log is disabled.
+ *
+ * @return 0 on success; -1 if the thread could not be started.
+ */
+int access_log_start(void);
+
+/**
+ * Writes what is left in the rings and stops the flusher.
+ */
+void access_log_stop(void);
+
+/**
+ * Logs the reply just sent to \p client (LOG_INFO, sampled).
+ */
+void log_reply(struct client *client);
+
+/**
+ * Logs the request of \p client rejected with \p code (LOG_ERROR).
+ */
+void log_rejection(struct client *client, int code);
+
+/**
+ * Logs that the connection of \p client has been opened (\p opened is 1) or closed by the other end (LOG_DEBUG, sampled).
+ */
+void log_connection(struct client *client, int opened);
+
+#endif /* ACCESS_LOG_H */
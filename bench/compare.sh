@@ -0,0 +1,64 @@
+#!/bin/bash
+#
+# Copyright (c) 2017, Hammurabi Mendes.
+# Licence: BSD 2-clause
+#
+#
+# Runs the same workload against every server mode on localhost, and prints a comparison table.
+#
+# Usage: bench/compare.sh [loadgen options]    (e.g. --connections=128 --duration=20 --rate=20000)
+#
+# Environment:
+#   MODES        server modes to compare (default "select fork epoll uring")
+#   PORT         first port used; each mode gets the next one (default 8090)
+#   SERVER_OPTS  options given to every server (e.g. "--threads=4")
+#   MIX          files requested, with their weights (default: mostly small pages, some images, a few large files)
+#   WEBSERVER, LOADGEN  binaries to use (default: built here with make)
+
+cd "$(dirname "$0")/.." || exit 1
+
+MODES=${MODES:-"select fork epoll uring"}
+PORT=${PORT:-8090}
+MIX=${MIX:-"/small.html:70,/medium.bin:25,/large.bin:5"}
+
+if [ -z "$WEBSERVER" ] || [ -z "$LOADGEN" ]; then
+    make webserver bench/loadgen >/dev/null || exit 1
+fi
+
+WEBSERVER=$(realpath "${WEBSERVER:-./webserver}")
+LOADGEN=$(realpath "${LOADGEN:-./bench/loadgen}")
+
+# The files of the default mix: 1 KB, 64 KB and 1 MB
+DOCROOT=$(mktemp -d)
+trap 'rm -rf "$DOCROOT"' EXIT
+
+head -c 1024 /dev/urandom > "$DOCROOT/small.html"
+head -c 65536 /dev/urandom > "$DOCROOT/medium.bin"
+head -c 1048576 /dev/urandom > "$DOCROOT/large.bin"
+
+printf "%-8s %12s %10s %10s %10s %10s %10s %10s %8s\n" mode "requests/s" "MB/s" "p50 us" "p90 us" "p99 us" "p99.9 us" "max us" errors
+
+for mode in $MODES; do
+    # The servers serve files from their working directory, and log nothing (logging is measured apart)
+    (cd "$DOCROOT" && exec "$WEBSERVER" --log-level=off $SERVER_OPTS "$PORT" "$mode") >/dev/null 2>&1 &
+    server=$!
+
+    # Wait until it accepts connections
+    for attempt in $(seq 50); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+        sleep 0.1
+    done
+
+    result=$("$LOADGEN" --tsv --mix="$MIX" "$@" 127.0.0.1 "$PORT")
+
+    kill -TERM "$server" 2>/dev/null
+    wait "$server" 2>/dev/null
+
+    if [ -z "$result" ]; then
+        printf "%-8s %12s\n" "$mode" "failed"
+    else
+        echo "$result" | awk -v mode="$mode" -F '\t' '{ printf "%-8s %12s %10s %10s %10s %10s %10s %10s %8s\n", mode, $1, $2, $3, $4, $5, $6, $7, $8 }'
+    fi
+
+    PORT=$((PORT + 1))
+done
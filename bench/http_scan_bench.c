@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Microbenchmark of the header scanning kernels (see http_scan.h): bytes scanned per cycle by each version.
+ *
+ * Usage: http_scan_bench [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define UNIT "cycle"
+static unsigned long long now(void) {
+    return __rdtsc();
+}
+#else
+#define UNIT "ns"
+static unsigned long long now(void) {
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+#endif
+
+// A typical browser request, and one with a long path and many cookies
+static const char *requests[] = {
+    "GET /images/monsters_inc.jpeg HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://localhost:8080/index.html\r\n"
+    "\r\n",
+
+    "GET /static/assets/javascript/vendor/framework/components/navigation/menu/dropdown/bundle.min.js?version=20171105 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_13_1) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/62.0.3202.89 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,pt;q=0.8\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; preferences=theme%3Ddark%26language%3Den; tracking=a87ff679a2f3e71d9181a67b7542122c; "
+    "cart=1679091c5a880faf6fb5e6087eb1b2dc; recently_viewed=45c48cce2e2d7fbdea1afc51c7c6ad26,d3d9446802a44259755d38e6d163e820\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n",
+};
+
+// Paths every version must judge alike before being measured (padded paths reach the vector loops)
+static const struct {
+    const char *path;
+    int valid;
+} paths[] = {
+    {"/index.html", 1},
+    {"/images/monsters_inc.jpeg?from=//cdn/images", 1},
+    {"/static/assets/javascript/vendor/framework/components/bundle.min.js", 1},
+    {"//etc/passwd", 0},
+    {"/a//../../x", 0},
+    {"/../etc/passwd", 0},
+    {"/static/assets/javascript/vendor/framework/components//etc/passwd", 0},
+    {"/static/assets/javascript/vendor/framework/components/../../../../../x", 0},
+};
+
+/**
+ * @return 1 if \p scanner validates every path of paths[] as expected; 0 otherwise (with the paths reported).
+ */
+static int check_paths(const struct http_scanner *scanner) {
+    int correct = 1;
+
+    for(int i = 0; i < (int) (sizeof(paths) / sizeof(paths[0])); i++) {
+        if(scanner->path_valid(paths[i].path, strlen(paths[i].path)) != paths[i].valid) {
+            fprintf(stderr, "%s: path_valid(\"%s\") should be %d\n", scanner->name, paths[i].path, paths[i].valid);
+            correct = 0;
+        }
+    }
+
+    return correct;
+}
+
+typedef unsigned long long (*kernel_run)(const struct http_scanner *scanner, const char *request, int length, long iterations);
+
+// The results are accumulated so that the calls cannot be optimized away
+static volatile int sink;
+
+static unsigned long long run_find_header_end(const struct http_scanner *scanner, const char *request, int length, long iterations) {
+    int total = 0;
+
+    for(long i = 0; i < iterations; i++) {
+        total += scanner->find_header_end(request, 0, length);
+    }
+
+    sink = total;
+
+    return (unsigned long long) length * iterations;
+}
+
+static unsigned long long run_split_request_line(const struct http_scanner *scanner, const char *request, int length, long iterations) {
+    int line_length = strchr(request, '\r') - request;
+    int total = 0;
+
+    for(long i = 0; i < iterations; i++) {
+        int first;
+        int second;
+
+        scanner->split_request_line(request, line_length, &first, &second);
+        total += second;
+    }
+
+    sink = total;
+
+    return (unsigned long long) line_length * iterations;
+}
+
+static unsigned long long run_path_valid(const struct http_scanner *scanner, const char *request, int length, long iterations) {
+    const char *path = strchr(request, ' ') + 1;
+    int path_length = strchr(path, ' ') - path;
+    int total = 0;
+
+    for(long i = 0; i < iterations; i++) {
+        total += scanner->path_valid(path, path_length);
+    }
+
+    sink = total;
+
+    return (unsigned long long) path_length * iterations;
+}
+
+int main(int argc, char **argv) {
+    long iterations = (argc > 1) ? atol(argv[1]) : 1000000;
+
+    const struct http_scanner *scanners[] = {
+        &http_scalar_scanner,
+#if defined(__x86_64__)
+        &http_sse2_scanner,
+        &http_avx2_scanner,
+#endif
+    };
+
+    struct {
+        const char *name;
+        kernel_run run;
+    } kernels[] = {
+        {"find_header_end", run_find_header_end},
+        {"split_request_line", run_split_request_line},
+        {"path_valid", run_path_valid},
+    };
+
+    int nscanners = sizeof(scanners) / sizeof(scanners[0]);
+    int nkernels = sizeof(kernels) / sizeof(kernels[0]);
+    int nrequests = sizeof(requests) / sizeof(requests[0]);
+
+    for(int s = 0; s < nscanners; s++) {
+        if(http_scanner_supported(scanners[s]) && !check_paths(scanners[s])) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%-20s %-8s %-8s %12s %10s\n", "kernel", "request", "version", "bytes/" UNIT, "speedup");
+
+    for(int k = 0; k < nkernels; k++) {
+        for(int r = 0; r < nrequests; r++) {
+            double baseline = 0;
+
+            for(int s = 0; s < nscanners; s++) {
+                if(!http_scanner_supported(scanners[s])) {
+                    continue;
+                }
+
+                int length = strlen(requests[r]);
+
+                // Warm up, then measure
+                kernels[k].run(scanners[s], requests[r], length, iterations / 10 + 1);
+
+                unsigned long long start = now();
+                unsigned long long bytes = kernels[k].run(scanners[s], requests[r], length, iterations);
+                unsigned long long elapsed = now() - start;
+
+                double rate = (double) bytes / (elapsed ? elapsed : 1);
+
+                if(s == 0) {
+                    baseline = rate;
+                }
+
+                printf("%-20s %-8d %-8s %12.2f %9.2fx\n", kernels[k].name, r, scanners[s]->name, rate, rate / baseline);
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,794 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Load generator: keeps connections busy with GET requests for a mix of files, and reports throughput and latency.
+ *
+ * In a closed loop (the default), each connection sends its next request as soon as the previous reply is complete,
+ * so the load follows the server. In an open loop (--rate=N), requests are due on a fixed schedule whatever the
+ * server does, and their latency counts from when they were due: waiting for a free connection is not hidden.
+ *
+ * Usage: loadgen [options] <host> <port>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "networking.h"
+
+// Longest reply header kept while waiting for its end
+#define HEADER_BYTES    4096
+
+// Bytes received per recv() call (the body is counted, not kept)
+#define RECEIVE_BYTES   (64 * 1024)
+
+// Requests due in an open loop that can wait for a free connection, per thread (a power of two)
+#define BACKLOG         65536
+
+// Latencies are kept in log-linear buckets, as in metrics.h: each within 1/16 of its value
+#define SUB_BITS        4
+#define BUCKETS         ((64 - SUB_BITS + 1) << SUB_BITS)
+
+#define MAX_TARGETS     64
+
+#define STATE_IDLE      0
+#define STATE_HEADER    1
+#define STATE_BODY      2
+
+struct target {
+    char *path;
+    int weight;
+
+    char *request;
+    int request_length;
+};
+
+struct connection {
+    int socket;                 // -1 while not connected
+    int state;
+    int reused;                 // Whether a request was already answered on this socket
+
+    unsigned long long started; // When the current request was sent (closed loop) or due (open loop)
+    struct target *target;
+
+    char header[HEADER_BYTES];
+    int nheader;
+
+    int status;                 // Of the reply being received, once its header is complete
+    long long remaining;        // Body bytes still expected; -1 if the reply ends with the connection
+    int close_after;            // Whether the server closes the connection after this reply
+};
+
+struct worker {
+    pthread_t thread;
+
+    int epoll;
+    struct connection *connections;
+    int nconnections;
+
+    struct connection **idle;   // Connections without a request in flight
+    int nidle;
+
+    unsigned long long *backlog;    // Due times of requests waiting for a connection (open loop)
+    unsigned long backlog_head;
+    unsigned long backlog_tail;
+    unsigned long skipped;          // Requests that were due when the backlog was full
+
+    double interval;            // Nanoseconds between requests of this thread (open loop)
+    unsigned long long random;
+
+    int measuring;              // Whether the warm-up is over
+
+    // Results, only counted after the warm-up
+    unsigned long latency[BUCKETS];
+    unsigned long requests;
+    unsigned long failed_replies;   // Replies other than 2xx
+    unsigned long errors;           // Connections refused, reset or cut short
+    unsigned long missed;           // Requests due in an open loop that did not fit in the backlog
+    unsigned long long bytes;
+};
+
+static struct {
+    char *host;
+    char *port;
+
+    int connections;
+    int threads;
+    int duration;
+    int warmup;
+    int rate;
+    int keep_alive;
+    int tsv;
+
+    struct target targets[MAX_TARGETS];
+    int ntargets;
+    int total_weight;
+} options = {
+    .connections = 64,
+    .threads = 1,
+    .duration = 10,
+    .warmup = 1,
+    .rate = 0,
+    .keep_alive = 1,
+    .tsv = 0,
+};
+
+static unsigned long long start_time;
+static unsigned long long measure_time;
+static unsigned long long end_time;
+
+static unsigned long long now(void) {
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+static int bucket_of(unsigned long long value) {
+    if(value < (1 << SUB_BITS)) {
+        return (int) value;
+    }
+
+    int exponent = 63 - __builtin_clzll(value);
+    int sub_bucket = (int) (value >> (exponent - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+
+    return ((exponent - SUB_BITS + 1) << SUB_BITS) + sub_bucket;
+}
+
+/**
+ * @return The largest value counted in \p bucket.
+ */
+static unsigned long long bucket_limit(int bucket) {
+    if(bucket < (1 << SUB_BITS)) {
+        return bucket;
+    }
+
+    int exponent = (bucket >> SUB_BITS) + SUB_BITS - 1;
+    unsigned long long sub_bucket = bucket & ((1 << SUB_BITS) - 1);
+    unsigned long long width = 1ULL << (exponent - SUB_BITS);
+
+    return ((1ULL << SUB_BITS) + sub_bucket) * width + (width - 1);
+}
+
+/**
+ * @return The target of the next request, drawn according to the weights of the mix.
+ */
+static struct target *pick_target(struct worker *worker) {
+    // xorshift64
+    worker->random ^= worker->random << 13;
+    worker->random ^= worker->random >> 7;
+    worker->random ^= worker->random << 17;
+
+    int draw = (int) (worker->random % options.total_weight);
+
+    for(int i = 0; i < options.ntargets; i++) {
+        if((draw -= options.targets[i].weight) < 0) {
+            return &options.targets[i];
+        }
+    }
+
+    return &options.targets[0];
+}
+
+static void disconnect(struct connection *connection) {
+    if(connection->socket != -1) {
+        close(connection->socket);
+        connection->socket = -1;
+    }
+}
+
+static void make_idle(struct worker *worker, struct connection *connection) {
+    connection->state = STATE_IDLE;
+    worker->idle[worker->nidle++] = connection;
+}
+
+/**
+ * Sends the request of \p connection, connecting first if needed.
+ *
+ * @return 1 on success; 0 if the request could not be sent (the connection is then closed).
+ */
+static int send_request(struct worker *worker, struct connection *connection) {
+    if(connection->socket == -1) {
+        if((connection->socket = create_client(options.host, options.port)) == -1) {
+            return 0;
+        }
+
+        make_nonblocking(connection->socket, 1);
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = connection};
+
+        if(epoll_ctl(worker->epoll, EPOLL_CTL_ADD, connection->socket, &event) == -1) {
+            disconnect(connection);
+            return 0;
+        }
+
+        connection->reused = 0;
+    }
+
+    // Requests are small enough to always fit in the socket buffer
+    struct target *target = connection->target;
+
+    if(send(connection->socket, target->request, target->request_length, MSG_NOSIGNAL) != target->request_length) {
+        int reused = connection->reused;
+
+        disconnect(connection);
+
+        // The server may have closed a persistent connection just before: try once more on a new one
+        return reused ? send_request(worker, connection) : 0;
+    }
+
+    connection->state = STATE_HEADER;
+    connection->nheader = 0;
+    connection->remaining = -1;
+    connection->close_after = !options.keep_alive;
+
+    return 1;
+}
+
+/**
+ * Starts a request due at \p due on the idle \p connection.
+ */
+static void dispatch(struct worker *worker, struct connection *connection, unsigned long long due) {
+    connection->target = pick_target(worker);
+    connection->started = due;
+
+    if(!send_request(worker, connection)) {
+        if(due >= measure_time) {
+            worker->errors++;
+        }
+
+        make_idle(worker, connection);
+    }
+}
+
+static void count_reply(struct worker *worker, struct connection *connection) {
+    unsigned long long finished = now();
+
+    if(finished < measure_time) {
+        return;
+    }
+
+    worker->requests++;
+    worker->latency[bucket_of(finished - connection->started)]++;
+
+    if(connection->status < 200 || connection->status > 299) {
+        worker->failed_replies++;
+    }
+}
+
+/**
+ * Parses the reply header of \p connection, which ends at \p header_length.
+ *
+ * @return The status code of the reply.
+ */
+static int parse_header(struct connection *connection, int header_length) {
+    int status = 0;
+
+    if(sscanf(connection->header, "HTTP/%*d.%*d %d", &status) != 1) {
+        status = 0;
+    }
+
+    connection->header[header_length - 1] = '\0';
+
+    for(char *line = strstr(connection->header, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+        if(strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+            connection->remaining = atoll(line + 17);
+        }
+        else if(strncasecmp(line + 2, "Connection: close", 17) == 0) {
+            connection->close_after = 1;
+        }
+    }
+
+    // Without a length, the body is delimited by the end of the connection
+    if(connection->remaining == -1) {
+        connection->close_after = 1;
+    }
+    else {
+        connection->remaining -= connection->nheader - header_length;
+    }
+
+    return status;
+}
+
+/**
+ * Receives what is available for \p connection.
+ *
+ * @return 1 if the reply is complete; 0 if more is expected; -1 if the connection failed.
+ */
+static int receive_reply(struct worker *worker, struct connection *connection, char *buffer) {
+    for(;;) {
+        ssize_t result = recv(connection->socket, buffer, RECEIVE_BYTES, 0);
+
+        if(result == -1) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        if(result == 0) {
+            if(connection->state == STATE_BODY && connection->remaining == -1) {
+                return 1;
+            }
+
+            return -1;
+        }
+
+        if(worker->measuring) {
+            worker->bytes += result;
+        }
+
+        if(connection->state == STATE_HEADER) {
+            int copied = (result < HEADER_BYTES - 1 - connection->nheader) ? result : HEADER_BYTES - 1 - connection->nheader;
+
+            memcpy(connection->header + connection->nheader, buffer, copied);
+            connection->nheader += copied;
+            connection->header[connection->nheader] = '\0';
+
+            char *end = strstr(connection->header, "\r\n\r\n");
+
+            if(end == NULL) {
+                if(connection->nheader == HEADER_BYTES - 1) {
+                    return -1;
+                }
+
+                continue;
+            }
+
+            connection->status = parse_header(connection, end + 4 - connection->header);
+
+            // The rest of this read (beyond the copy) is body
+            if(connection->remaining != -1) {
+                connection->remaining -= result - copied;
+            }
+
+            connection->state = STATE_BODY;
+        }
+        else if(connection->remaining != -1) {
+            connection->remaining -= result;
+        }
+
+        if(connection->remaining == 0) {
+            return 1;
+        }
+    }
+}
+
+/**
+ * Handles the readiness of \p connection. Once its reply is complete, the connection becomes idle.
+ */
+static void handle_readable(struct worker *worker, struct connection *connection, char *buffer) {
+    // An idle persistent connection closed by the server (on its keep-alive timeout or request limit)
+    if(connection->state == STATE_IDLE) {
+        disconnect(connection);
+        return;
+    }
+
+    int outcome = receive_reply(worker, connection, buffer);
+
+    if(outcome == 0) {
+        return;
+    }
+
+    if(outcome == -1) {
+        // A persistent connection closed by the server while idle: send the request again on a new one
+        if(connection->state == STATE_HEADER && connection->nheader == 0 && connection->reused) {
+            disconnect(connection);
+
+            if(send_request(worker, connection)) {
+                return;
+            }
+        }
+
+        disconnect(connection);
+
+        if(worker->measuring) {
+            worker->errors++;
+        }
+
+        make_idle(worker, connection);
+        return;
+    }
+
+    count_reply(worker, connection);
+
+    if(connection->close_after) {
+        disconnect(connection);
+    }
+    else {
+        connection->reused = 1;
+    }
+
+    make_idle(worker, connection);
+}
+
+/**
+ * @return When the next request of an open loop is due.
+ */
+static unsigned long long next_due(struct worker *worker) {
+    return start_time + (unsigned long long) (worker->interval * (worker->backlog_tail + worker->skipped));
+}
+
+/**
+ * Hands the requests that are due to idle connections: all of them in a closed loop; those whose time has come
+ * (oldest first) in an open loop.
+ */
+static void dispatch_due(struct worker *worker, unsigned long long current) {
+    if(options.rate == 0) {
+        int nidle = worker->nidle;
+
+        // Connections that fail right away become idle again (behind the ones read), and are retried on the next call
+        worker->nidle = 0;
+
+        for(int i = 0; i < nidle; i++) {
+            dispatch(worker, worker->idle[i], now());
+        }
+
+        return;
+    }
+
+    unsigned long long due;
+
+    while((due = next_due(worker)) <= current) {
+        if(worker->backlog_tail - worker->backlog_head < BACKLOG) {
+            worker->backlog[worker->backlog_tail++ % BACKLOG] = due;
+        }
+        else {
+            worker->skipped++;
+            worker->missed += (due >= measure_time);
+        }
+    }
+
+    while(worker->nidle > 0 && worker->backlog_head != worker->backlog_tail) {
+        dispatch(worker, worker->idle[--worker->nidle], worker->backlog[worker->backlog_head++ % BACKLOG]);
+    }
+}
+
+/**
+ * @return Milliseconds epoll_wait() may sleep before requests are due (or the run ends).
+ */
+static int wait_timeout(struct worker *worker, unsigned long long current) {
+    unsigned long long until = end_time;
+
+    if(options.rate > 0) {
+        unsigned long long due = next_due(worker);
+
+        if(due < until) {
+            until = due;
+        }
+    }
+    else if(worker->nidle > 0) {
+        // Connections that could not connect are retried shortly
+        until = current + 10000000ULL;
+    }
+
+    return (until > current) ? (int) ((until - current + 999999) / 1000000) : 0;
+}
+
+static void *run_worker(void *argument) {
+    struct worker *worker = (struct worker *) argument;
+    struct epoll_event events[64];
+    char *buffer = (char *) malloc(RECEIVE_BYTES);
+
+    if(buffer == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    unsigned long long current;
+
+    while((current = now()) < end_time) {
+        worker->measuring = (current >= measure_time);
+
+        dispatch_due(worker, current);
+
+        int nevents = epoll_wait(worker->epoll, events, 64, wait_timeout(worker, current));
+
+        for(int i = 0; i < nevents; i++) {
+            handle_readable(worker, (struct connection *) events[i].data.ptr, buffer);
+        }
+    }
+
+    for(int i = 0; i < worker->nconnections; i++) {
+        disconnect(&worker->connections[i]);
+    }
+
+    free(buffer);
+
+    return NULL;
+}
+
+static int setup_worker(struct worker *worker, int nconnections, int index) {
+    worker->epoll = epoll_create1(0);
+    worker->connections = (struct connection *) calloc(nconnections, sizeof(struct connection));
+    worker->idle = (struct connection **) calloc(nconnections, sizeof(struct connection *));
+    worker->backlog = (options.rate > 0) ? (unsigned long long *) malloc(BACKLOG * sizeof(unsigned long long)) : NULL;
+
+    if(worker->epoll == -1 || worker->connections == NULL || worker->idle == NULL || (options.rate > 0 && worker->backlog == NULL)) {
+        return -1;
+    }
+
+    worker->nconnections = nconnections;
+
+    for(int i = 0; i < nconnections; i++) {
+        worker->connections[i].socket = -1;
+        make_idle(worker, &worker->connections[i]);
+    }
+
+    // Threads share the rate
+    worker->interval = (options.rate > 0) ? 1e9 * options.threads / options.rate : 0;
+    worker->random = 0x9E3779B97F4A7C15ULL * (index + 1);
+
+    return 0;
+}
+
+/**
+ * Builds the request of every target.
+ */
+static int prepare_requests(void) {
+    for(int i = 0; i < options.ntargets; i++) {
+        struct target *target = &options.targets[i];
+        int length = strlen(target->path) + strlen(options.host) + 64;
+
+        if((target->request = (char *) malloc(length)) == NULL) {
+            return -1;
+        }
+
+        target->request_length = snprintf(target->request, length, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n", target->path, options.host, options.keep_alive ? "keep-alive" : "close");
+    }
+
+    return 0;
+}
+
+static void report(struct worker *workers) {
+    unsigned long latency[BUCKETS] = {0};
+    unsigned long requests = 0;
+    unsigned long failed_replies = 0;
+    unsigned long errors = 0;
+    unsigned long missed = 0;
+    unsigned long long bytes = 0;
+
+    for(int t = 0; t < options.threads; t++) {
+        for(int i = 0; i < BUCKETS; i++) {
+            latency[i] += workers[t].latency[i];
+        }
+
+        requests += workers[t].requests;
+        failed_replies += workers[t].failed_replies;
+        errors += workers[t].errors;
+        missed += workers[t].missed;
+        bytes += workers[t].bytes;
+    }
+
+    // Each percentile is reported as the largest value of the bucket it falls in, in microseconds
+    static const double percentiles[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+    double values[5] = {0};
+    unsigned long seen = 0;
+    int p = 0;
+
+    for(int i = 0; i < BUCKETS && p < 5 && requests > 0; i++) {
+        seen += latency[i];
+
+        while(p < 5 && seen > 0 && seen >= percentiles[p] * requests) {
+            values[p++] = bucket_limit(i) / 1e3;
+        }
+    }
+
+    double seconds = options.duration - options.warmup;
+    double throughput = requests / seconds;
+    double megabytes = bytes / seconds / (1 << 20);
+
+    if(options.tsv) {
+        printf("%.1f\t%.2f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%lu\n", throughput, megabytes, values[0], values[1], values[2], values[3], values[4], errors + failed_replies + missed);
+        return;
+    }
+
+    printf("%d s (after %d s of warm-up), %d threads, %d connections, %s loop", options.duration - options.warmup, options.warmup, options.threads, options.connections, options.rate ? "open" : "closed");
+
+    if(options.rate) {
+        printf(" at %d requests/s", options.rate);
+    }
+
+    printf(", keep-alive %s\n", options.keep_alive ? "on" : "off");
+
+    printf("  Requests:   %lu (%.1f/s)\n", requests, throughput);
+    printf("  Received:   %.1f MB (%.2f MB/s)\n", bytes / (double) (1 << 20), megabytes);
+    printf("  Errors:     %lu connection, %lu non-2xx", errors, failed_replies);
+
+    if(options.rate) {
+        printf(", %lu not issued (backlog full)", missed);
+    }
+
+    printf("\n  Latency:    p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n", values[0], values[1], values[2], values[3], values[4]);
+}
+
+enum {
+    OPTION_CONNECTIONS = 256,
+    OPTION_THREADS,
+    OPTION_DURATION,
+    OPTION_WARMUP,
+    OPTION_RATE,
+    OPTION_KEEP_ALIVE,
+    OPTION_MIX,
+    OPTION_TSV,
+};
+
+static const struct option long_options[] = {
+    {"connections", required_argument, NULL, OPTION_CONNECTIONS},
+    {"threads", required_argument, NULL, OPTION_THREADS},
+    {"duration", required_argument, NULL, OPTION_DURATION},
+    {"warmup", required_argument, NULL, OPTION_WARMUP},
+    {"rate", required_argument, NULL, OPTION_RATE},
+    {"keep-alive", required_argument, NULL, OPTION_KEEP_ALIVE},
+    {"mix", required_argument, NULL, OPTION_MIX},
+    {"tsv", no_argument, NULL, OPTION_TSV},
+    {NULL, 0, NULL, 0},
+};
+
+static void usage(char *program) {
+    fprintf(stderr, "Usage: %s [options] <host> <port>\n", program);
+    fprintf(stderr, "  --connections=N     concurrent connections (default 64)\n");
+    fprintf(stderr, "  --threads=N         threads sharing the connections (default 1)\n");
+    fprintf(stderr, "  --duration=SECS     length of the run, warm-up included (default 10)\n");
+    fprintf(stderr, "  --warmup=SECS       initial time not measured (default 1)\n");
+    fprintf(stderr, "  --rate=N            open loop: requests per second, due whether or not replies came (default 0, closed loop)\n");
+    fprintf(stderr, "  --keep-alive=0|1    reuse connections for further requests (default 1)\n");
+    fprintf(stderr, "  --mix=PATH:W,...    files requested, each with a relative weight (default /index.html:1)\n");
+    fprintf(stderr, "  --tsv               print one line: requests/s, MB/s, p50, p90, p99, p99.9 and max (us), errors\n");
+}
+
+/**
+ * Parses a non-negative integer.
+ *
+ * @return 1 on success; 0 if \p text is not a non-negative integer.
+ */
+static int parse_count(const char *text, int *count) {
+    char *end;
+    long value = strtol(text, &end, 10);
+
+    if(end == text || *end != '\0' || value < 0 || value > 1 << 30) {
+        return 0;
+    }
+
+    *count = (int) value;
+
+    return 1;
+}
+
+/**
+ * Parses a mix of files such as "/small.html:8,/large.bin:1" (a missing weight is 1).
+ *
+ * @return 1 on success; 0 if \p text is not a mix.
+ */
+static int parse_mix(char *text) {
+    options.ntargets = 0;
+    options.total_weight = 0;
+
+    for(char *item = strtok(text, ","); item != NULL; item = strtok(NULL, ",")) {
+        if(options.ntargets == MAX_TARGETS || item[0] != '/') {
+            return 0;
+        }
+
+        struct target *target = &options.targets[options.ntargets++];
+        char *weight = strrchr(item, ':');
+
+        target->path = item;
+        target->weight = 1;
+
+        if(weight != NULL) {
+            *weight = '\0';
+
+            if(!parse_count(weight + 1, &target->weight)) {
+                return 0;
+            }
+        }
+
+        options.total_weight += target->weight;
+    }
+
+    return options.ntargets > 0 && options.total_weight > 0;
+}
+
+static int parse_options(int argc, char **argv) {
+    static char default_mix[] = "/index.html:1";
+    int option;
+    int valid = parse_mix(default_mix);
+
+    while((option = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch(option) {
+        case OPTION_CONNECTIONS:
+            valid = parse_count(optarg, &options.connections) && options.connections > 0;
+            break;
+        case OPTION_THREADS:
+            valid = parse_count(optarg, &options.threads) && options.threads > 0;
+            break;
+        case OPTION_DURATION:
+            valid = parse_count(optarg, &options.duration);
+            break;
+        case OPTION_WARMUP:
+            valid = parse_count(optarg, &options.warmup);
+            break;
+        case OPTION_RATE:
+            valid = parse_count(optarg, &options.rate);
+            break;
+        case OPTION_KEEP_ALIVE:
+            valid = parse_count(optarg, &options.keep_alive);
+            break;
+        case OPTION_MIX:
+            valid = parse_mix(optarg);
+            break;
+        case OPTION_TSV:
+            options.tsv = 1;
+            break;
+        default:
+            valid = 0;
+            break;
+        }
+
+        if(!valid) {
+            break;
+        }
+    }
+
+    if(!valid || argc - optind != 2 || options.warmup >= options.duration) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    options.host = argv[optind];
+    options.port = argv[optind + 1];
+
+    if(options.threads > options.connections) {
+        options.threads = options.connections;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if(parse_options(argc, argv) == -1 || prepare_requests() == -1) {
+        return EXIT_FAILURE;
+    }
+
+    struct worker *workers = (struct worker *) calloc(options.threads, sizeof(struct worker));
+
+    if(workers == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    for(int t = 0; t < options.threads; t++) {
+        int nconnections = options.connections / options.threads + (t < options.connections % options.threads);
+
+        if(setup_worker(&workers[t], nconnections, t) == -1) {
+            perror("setup_worker");
+            return EXIT_FAILURE;
+        }
+    }
+
+    start_time = now();
+    measure_time = start_time + options.warmup * 1000000000ULL;
+    end_time = start_time + options.duration * 1000000000ULL;
+
+    for(int t = 0; t < options.threads; t++) {
+        if(pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    for(int t = 0; t < options.threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+
+    report(workers);
+
+    return EXIT_SUCCESS;
+}
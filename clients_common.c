@@ -11,59 +11,147 @@
 #include <stdatomic.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include "clients_common.h"
+#include "file_cache.h"
+#include "content_cache.h"
+#include "file_transfer.h"
 #include "networking.h"
+#include "pool.h"
+#include "access_log.h"
+#include "metrics.h"
+#include "config.h"
 
 atomic_ulong operations_completed;
 
+// The connection state is small and allocated all the time: it comes from a slab
+static struct slab clients = SLAB_INITIALIZER(sizeof(struct client));
+
 int flush_buffer(struct client *client);
 int obtain_file_size(char *filename);
 
 struct client *make_client(int socket) {
-    struct client *new_client = (struct client *) malloc(sizeof(struct client));
+    struct client *new_client = (struct client *) slab_alloc(&clients);
 
     if(new_client != NULL) {
         new_client->socket = socket;
         new_client->state = E_RECV_REQUEST;
 
-        new_client->file = NULL;
+        memset(&new_client->peer, 0, sizeof(struct sockaddr_in6));
+
+        new_client->content = NULL;
+        new_client->file_entry = NULL;
+        new_client->ranges = NULL;
+        new_client->reply_buffer = NULL;
+        new_client->file = -1;
+        new_client->file_offset = 0;
+        new_client->file_end = 0;
+
+        new_client->splice_pipe[0] = -1;
+        new_client->splice_pipe[1] = -1;
+        new_client->nspliced = 0;
 
         new_client->nread = 0;
         new_client->nwritten = 0;
 
         new_client->ntowrite = 0;
+        new_client->header = NULL;
+
+        new_client->buffer = NULL;
+
+        http_parser_init(&new_client->parser);
 
         new_client->status = STATUS_OK;
+        new_client->reply_code = 0;
+
+        new_client->request_started = metrics_now();
+        new_client->header_received = 0;
+        new_client->first_byte_sent = 0;
+
+        new_client->keep_alive = 0;
+        new_client->nrequests = 0;
+
+        new_client->pipelined = NULL;
+        new_client->npipelined = 0;
+
+        new_client->timers = NULL;
+        new_client->deadline.next = NULL;
+        new_client->deadline.previous = NULL;
+
+        new_client->offload = NULL;
+        new_client->task = NULL;
+        new_client->next_completed = NULL;
+
+        new_client->resolution = NULL;
+        new_client->prefetched = 0;
+
+        new_client->ring_buffer = -1;
+        new_client->nbuffered = 0;
+        new_client->nbuffer_sent = 0;
+        new_client->next_waiting = NULL;
 
-        new_client->prev = NULL;
-        new_client->next = NULL;
+        new_client->index = -1;
+        new_client->key = socket;
+
+        new_client->dead_list = NULL;
+        new_client->next_dead = NULL;
+
+        metrics_connection_opened();
     }
 
     return new_client;
 }
 
+void free_client(struct client *client) {
+    release_request_buffer(client);
+
+    metrics_connection_closed();
+
+    slab_free(&clients, client);
+}
+
+int acquire_request_buffer(struct client *client) {
+    if(client->buffer == NULL) {
+        client->buffer = buffer_alloc(BUFFER_SIZE);
+    }
+
+    return client->buffer != NULL;
+}
+
+void release_request_buffer(struct client *client) {
+    buffer_free(client->buffer, BUFFER_SIZE);
+    client->buffer = NULL;
+}
+
 int read_request(struct client *client) {
+    if(!acquire_request_buffer(client)) {
+        client->status = STATUS_BAD;
+        finish_client(client);
+        return 0;
+    }
+
     ssize_t chunk_size = read(client->socket, client->buffer, BUFFER_SIZE - 1);
 
     while((chunk_size) > 0) {
         client->nread += chunk_size;
 
-        if(header_complete(client->buffer, client->nread)) {
-            char filename[1024];
-            char protocol[16];
+        // Only the bytes just received are scanned
+        int result = http_parse(&client->parser, client->buffer, client->nread);
 
-            if(get_filename(client->buffer, client->nread, filename, 1024, protocol, 16) == 0) {
-                switch_state(client, filename, protocol);
-                printf("%s", client->buffer);
-                return 1;
-            }
+        if(result == HTTP_PARSE_DONE) {
+            metrics_header_received(client);
 
-            //in case get_filename encounters an error
-            client->status = STATUS_BAD;
-            finish_client(client);
+            switch_state(client, http_filename(&client->parser), client->parser.protocol.data);
+            return 1;
+        }
+
+        //in case the header is malformed, or does not fit in the buffer
+        if(result == HTTP_PARSE_ERROR || client->nread == BUFFER_SIZE - 1) {
+            reject_request(client, (result == HTTP_PARSE_ERROR) ? client->parser.error : 431);
             return 0;
         }
 
@@ -76,36 +164,315 @@ int read_request(struct client *client) {
     return 0;
 }
 
+void reject_request(struct client *client, int code) {
+    const char *reply;
+
+    if(code == 431) {
+        reply = "HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+    }
+    else if(code == 408) {
+        reply = "HTTP/1.1 408 Request Timeout\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+    }
+    else if(code == 501) {
+        reply = "HTTP/1.1 501 Not Implemented\r\nAllow: GET, HEAD\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+    }
+    else {
+        reply = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+    }
+
+    // The connection is closed right away, so the reply is not worth waiting for
+    if(write(client->socket, reply, strlen(reply)) == -1) {
+        fprintf(stderr, "Client socket no. %d: cannot send error %d\n", client->socket, code);
+    }
+
+    log_rejection(client, code);
+
+    client->status = STATUS_BAD;
+    finish_client(client);
+}
+
 void switch_state(struct client *client, char *filename, char *protocol) {
-    char temporary_buffer[BUFFER_SIZE];
+    struct file_entry *entry;
+    struct content *content;
+
+    resolve_file(filename, protocol, http_encodings(&client->parser), &entry, &content);
+    prepare_reply(client, filename, protocol, entry, content);
+}
+
+/**
+ * Looks for a precompressed sidecar of \p filename (resolved in \p entry) in one of the codings \p encodings, brotli
+ * first. Sidecars older than the file are stale, and ignored. Unless \p blocking, only the file cache is consulted.
+ *
+ * @return 1 if the search is over, and \p sidecar holds a referenced entry for the sidecar, or NULL if there is none;
+ *         0 if it would block.
+ */
+static int find_sidecar(struct file_entry *entry, char *filename, char *protocol, int encodings, int blocking, struct file_entry **sidecar) {
+    static const int preferred[] = {HTTP_ENCODING_BR, HTTP_ENCODING_GZIP};
+
+    char path[BUFFER_SIZE];
+
+    *sidecar = NULL;
+
+    for(int i = 0; i < (int) (sizeof(preferred) / sizeof(preferred[0])); i++) {
+        if(!(encodings & preferred[i]) || !content_sidecar(filename, preferred[i], path)) {
+            continue;
+        }
+
+        struct file_entry *candidate = blocking ? file_cache_acquire(path) : file_cache_peek(path);
+
+        if(candidate == NULL) {
+            if(!blocking) {
+                return 0;
+            }
+
+            continue;
+        }
+
+        int current = candidate->mtime.tv_sec > entry->mtime.tv_sec || (candidate->mtime.tv_sec == entry->mtime.tv_sec && candidate->mtime.tv_nsec >= entry->mtime.tv_nsec);
+
+        if(candidate->status == STATUS_OK && current && file_cache_encoded_header(candidate, protocol) != NULL) {
+            *sidecar = candidate;
+            return 1;
+        }
+
+        file_cache_release(candidate);
+    }
+
+    return 1;
+}
+
+/**
+ * @return The coding to compress with here, among \p encodings (see content_cache.h); 0 for none.
+ */
+static int compression_wanted(int encodings) {
+    return (config.gzip_level > 0 && (encodings & HTTP_ENCODING_GZIP)) ? HTTP_ENCODING_GZIP : 0;
+}
+
+void resolve_file(char *filename, char *protocol, int encodings, struct file_entry **entry, struct content **content) {
+    // Resolve the filename through the file cache: on a hit, no system call is made here.
+    // The cache remembers whether the file does not exist (404) or cannot be opened for reading (403).
+    if(strcmp(filename, METRICS_PATH) == 0) {
+        *entry = NULL;
+        *content = metrics_content(protocol);
+        return;
+    }
+
+    *entry = file_cache_acquire(filename);
+    *content = NULL;
+
+    if(*entry == NULL || (*entry)->status != STATUS_OK) {
+        return;
+    }
+
+    // Text files go out compressed if the client accepts it: precompressed next to the file, or compressed here
+    if(encodings != 0 && content_compressible(filename)) {
+        struct file_entry *sidecar;
+
+        find_sidecar(*entry, filename, protocol, encodings, 1, &sidecar);
+
+        if(sidecar != NULL) {
+            file_cache_release(*entry);
+            *entry = sidecar;
+
+            *content = content_cache_acquire(sidecar, filename, protocol, content_sidecar_encoding(sidecar->path));
+            return;
+        }
+
+        int encoding = compression_wanted(encodings);
+
+        if(encoding != 0 && (*content = content_cache_acquire(*entry, filename, protocol, encoding)) != NULL) {
+            return;
+        }
+    }
+
+    // Small files are answered from the content cache, where header and body are already laid out in memory
+    *content = content_cache_acquire(*entry, filename, protocol, 0);
+}
+
+int try_resolve_file(char *filename, char *protocol, int encodings, struct file_entry **entry, struct content **content) {
+    // The snapshot is taken right away: it makes no system call
+    if(strcmp(filename, METRICS_PATH) == 0) {
+        *entry = NULL;
+        *content = metrics_content(protocol);
+        return 1;
+    }
+
+    *content = NULL;
+
+    if((*entry = file_cache_peek(filename)) == NULL) {
+        return 0;
+    }
+
+    if((*entry)->status != STATUS_OK) {
+        return 1;
+    }
+
+    int encoding = 0;
+
+    if(encodings != 0 && content_compressible(filename)) {
+        struct file_entry *sidecar;
+
+        if(!find_sidecar(*entry, filename, protocol, encodings, 0, &sidecar)) {
+            file_cache_release(*entry);
+            return 0;
+        }
 
-    // Check if the file does not exist.
-    //  -If that's the case, we are preparing a 404 "not found" response, and take note of that in client->status
-    if(access(filename, F_OK) == -1) {
-        get_404(temporary_buffer, filename, protocol);
-        client->status = STATUS_404;
+        if(sidecar != NULL) {
+            file_cache_release(*entry);
+            *entry = sidecar;
+
+            encoding = content_sidecar_encoding(sidecar->path);
+        }
+        else if(content_cache_wants(*entry)) {
+            // Compressing is left to a worker
+            encoding = compression_wanted(encodings);
+        }
     }
 
-    // Check if the file cannot be opened for reading. Check the status of fopen(3) from the standard C library into client->file.
-    //  - If that's the case, we are preparing a 403 "forbidden" response, and take note of that in client->status
-    else if((client->file = fopen(filename, "r")) == NULL) {
-        get_403(temporary_buffer, filename, protocol);
-        client->status = STATUS_403;
+    if(content_cache_wants(*entry)) {
+        if((*content = content_cache_peek(*entry, filename, protocol, encoding)) == NULL) {
+            file_cache_release(*entry);
+            return 0;
+        }
     }
 
-    // If neither of the above happened, we are preparing a "200 OK" response. The client->status remains STATUS_OK (the default).
+    return 1;
+}
+
+/**
+ * Prepares the whole reply of \p client, as for a GET (see prepare_reply()).
+ */
+static void attach_reply(struct client *client, char *filename, char *protocol, struct file_entry *entry, struct content *content) {
+    // Without an entry, the content is a snapshot of the metrics (see metrics.h); without either, memory ran out
+    int status = (entry != NULL) ? entry->status : (content != NULL) ? STATUS_OK : STATUS_503;
+
+    // A body compressed here has validators of its own; a precompressed sidecar is a file of its own
+    int compressed = (content != NULL && content->not_modified != NULL);
+    int sidecar = (entry != NULL && strcmp(entry->path, filename) != 0);
+
+    // A client whose copy is current only gets the header (prebuilt like the others, see file_cache.h)
+    const struct file_header *header;
+
+    if(status == STATUS_OK && entry != NULL && http_not_modified(&client->parser, compressed ? content->etag : entry->etag, entry->mtime.tv_sec) &&
+       (header = compressed ? content->not_modified : file_cache_not_modified(entry, protocol)) != NULL) {
+        client->reply_code = 304;
+
+        client->header = header->data;
+        client->ntowrite = header->length;
+        client->nwritten = 0;
+
+        // The entry (or the content) is only kept so that its header outlives the reply
+        if(compressed) {
+            attach_content(client, content);
+            file_cache_release(entry);
+        }
+        else {
+            if(content != NULL) {
+                content_cache_release(content);
+            }
+
+            client->file_entry = entry;
+        }
+
+        client->file_offset = 0;
+        client->file_end = 0;
+
+        client->state = E_SEND_REPLY;
+        return;
+    }
+
+    // Only the parts of the file asked for, starting from their offsets (compressed replies are sent whole)
+    if(status == STATUS_OK && entry != NULL && !compressed && !sidecar && client->parser.range.data != NULL && attach_ranges(client, entry, content, filename, protocol)) {
+        client->state = E_SEND_REPLY;
+        return;
+    }
+
+    // Small files are answered from the content cache, where header and body are already laid out in memory
+    if(status == STATUS_OK && content != NULL) {
+        attach_content(client, content);
+
+        client->ntowrite = 0;
+        client->nwritten = 0;
+
+        client->state = E_SEND_REPLY;
+
+        if(entry != NULL) {
+            file_cache_release(entry);
+        }
+        return;
+    }
+
+    // We take note of a 404 "not found", 403 "forbidden" or 503 "unavailable" response in client->status.
+    // For a "200 OK" response, the client->status remains STATUS_OK (the default).
+    if(status != STATUS_OK) {
+        client->status = status;
+    }
+
+    // The header (the whole response, for the errors) is normally prebuilt for the entry, and sent from there
+    if(entry == NULL) {
+        header = NULL;
+    }
     else {
-        get_200(temporary_buffer, filename, protocol, obtain_file_size(filename));
+        header = sidecar ? file_cache_encoded_header(entry, protocol) : file_cache_header(entry, protocol);
     }
 
-    strcpy(client->buffer, temporary_buffer);
+    if(header != NULL) {
+        client->header = header->data;
+        client->ntowrite = header->length;
+    }
+    else {
+        char temporary_buffer[BUFFER_SIZE];
+
+        if(status == STATUS_404) {
+            get_404(temporary_buffer, filename, protocol);
+        }
+        else if(status == STATUS_403) {
+            get_403(temporary_buffer, filename, protocol);
+        }
+        else if(status == STATUS_503) {
+            get_503(temporary_buffer, protocol);
+        }
+        else {
+            get_200(temporary_buffer, filename, protocol, entry->size);
+        }
+
+        // Kept apart from the request buffer, whose request line is logged once the reply is sent (see access_log.h).
+        // Only without memory for it does the header take the place of the request.
+        client->reply_buffer = buffer_alloc(BUFFER_SIZE);
+
+        char *destination = (client->reply_buffer != NULL) ? client->reply_buffer : client->buffer;
+
+        strcpy(destination, temporary_buffer);
+
+        client->header = destination;
+        client->ntowrite = strlen(destination);
+    }
 
-    client->ntowrite = strlen(client->buffer);
     client->nwritten = 0;
 
+    // The body is later sent straight from the cached descriptor (see file_transfer.h). For the errors, the
+    // entry is only kept so that its header outlives the reply.
+    if(status == STATUS_OK) {
+        attach_file(client, entry, 0, entry->size);
+    }
+    else {
+        client->file_entry = entry;
+        client->file_offset = 0;
+        client->file_end = 0;
+    }
+
     client->state = E_SEND_REPLY;
 }
 
+void prepare_reply(struct client *client, char *filename, char *protocol, struct file_entry *entry, struct content *content) {
+    attach_reply(client, filename, protocol, entry, content);
+
+    // A HEAD request gets the header that a GET would get, without the body
+    if(client->parser.head) {
+        omit_body(client);
+    }
+}
+
 int write_reply(struct client *client) {
     // Flush the buffer that contains the header of the response, using flush_buffer
     if(flush_buffer(client) == 0) {
@@ -114,34 +481,37 @@ int write_reply(struct client *client) {
         return 0;
     }
 
-    // If the file is different than NULL, we just sent a "200 OK" response, and now we need to send the file
-    if(client->file != NULL) {
-        int bytes_read;
-        while((bytes_read = fread(client->buffer, sizeof(char), BUFFER_SIZE, client->file)) > 0) {
-            client->ntowrite = bytes_read;
-            client->nwritten = 0;
+    // If there is a body (a file, or a cached "200 OK" response), we now need to send it
+    ssize_t bytes_sent;
 
-            //Flush the buffer that contains the first chunk of the file contents, using flush_buffer
-            if(flush_buffer(client) == 0) {
-                client->status = STATUS_BAD;
-                finish_client(client);
-                return 0;
-            }
+    for(;;) {
+        while((bytes_sent = send_body_chunk(client)) > 0) {
+            metrics_reply_progress(client);
+        }
 
-            //Repeat until read is less than BUFFER_SIZE. In this case, reached the end of the file!
-            if(bytes_read < BUFFER_SIZE) {
-                fclose(client->file);
-                client->file = NULL;
-                finish_client(client);
-                return 1;
-            }
+        if(bytes_sent == -1) {
+            client->status = STATUS_BAD;
+            finish_client(client);
+            return 0;
         }
 
-        client->status = STATUS_BAD;
-        finish_client(client);
-        return 0;
+        // The next part of a multipart reply has its own header
+        if(!next_range(client)) {
+            break;
+        }
+
+        if(flush_buffer(client) == 0) {
+            client->status = STATUS_BAD;
+            finish_client(client);
+            return 0;
+        }
     }
 
+    log_reply(client);
+    metrics_reply_sent(client);
+
+    release_body(client);
+
     finish_client(client);
     return 1;
 }
@@ -162,12 +532,17 @@ int flush_buffer(struct client *client) {
     if(client->ntowrite < 0 || client->nwritten > 0) {
         return 0;
     }
+    // A file body follows right after: MSG_MORE lets the header share its first segment
+    int flags = (client->file != -1 && client->file_offset < client->file_end) ? MSG_MORE : 0;
+
     while(client->ntowrite > 0) {
-        if((bytes_written = write(client->socket, client->buffer, client->ntowrite)) <= 0) {
+        if((bytes_written = send(client->socket, client->header + client->nwritten, client->ntowrite, flags)) <= 0) {
             return 0;
         }
         client->nwritten += bytes_written;
         client->ntowrite -= bytes_written;
+
+        metrics_reply_progress(client);
     }
 
     return 1;
@@ -191,6 +566,25 @@ int obtain_file_size(char *filename) {
 }
 
 void finish_client(struct client *client) {
+    if(client->status == STATUS_BAD) {
+        metrics_request_failed();
+    }
+
+    release_body(client);
+
+    buffer_free(client->pipelined, client->npipelined);
+    client->pipelined = NULL;
+    client->npipelined = 0;
+
+    release_request_buffer(client);
+
     close(client->socket);
     client->socket = -1;
+
+    // Clients owned by a connection table are queued on its dead list, so reaping only touches closed connections
+    if(client->dead_list != NULL) {
+        client->next_dead = *client->dead_list;
+        *client->dead_list = client;
+        client->dead_list = NULL;
+    }
 }
@@ -8,46 +8,161 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <time.h>
+
+#include "http_parser.h"
+#include "timer_wheel.h"
 
 #define E_RECV_REQUEST  1
 #define E_SEND_REPLY    2
+#define E_WAIT_IO       3 // A blocking operation runs on the thread pool (see offload.h)
 
 #define STATUS_OK  EXIT_SUCCESS
 #define STATUS_BAD EXIT_FAILURE
 #define STATUS_403 128 // Standard is to use 128+N for general error N
 #define STATUS_404 129 // Standard is to use 128+N for general error N
+#define STATUS_503 130 // The file could not be opened for now (out of descriptors or memory): never cached
 
 #define BUFFER_SIZE     4096
 
+struct file_entry;
+struct content;
+struct byte_ranges;
+struct offload_queue;
+struct resolution;
+
 struct client {
 	int socket;
 	int state;
 
-	FILE *file;
+	struct sockaddr_in6 peer;       // Address of the other end (IPv4 or IPv6), once the access log needs it
+
+	struct content *content;        // In-memory response being sent, if any
+	struct file_entry *file_entry;  // Otherwise, the file being sent, if any
+
+	struct byte_ranges *ranges;     // Parts of the file being sent, for a 206 or 416 reply (see file_transfer.h)
+
+	int file;           // Descriptor of the file being sent, or -1
+	off_t file_offset;  // Next byte of the file (or content) to send
+	off_t file_end;     // One past the last byte of the file (or content) to send
+
+	int splice_pipe[2]; // Only used if sendfile(2) is unavailable
+	int nspliced;       // Bytes sitting in splice_pipe, not yet sent
 
 	int nread;
 	int nwritten;
 
 	int ntowrite;
+	const char *header;     // Reply header being sent: reply_buffer, or one prebuilt (see file_cache.h and file_transfer.h)
+	char *reply_buffer;     // BUFFER_SIZE bytes from the buffer pool for a header built for this reply only, or NULL
 
-	char buffer[BUFFER_SIZE];
+	char *buffer;           // BUFFER_SIZE bytes from the buffer pool (see pool.h), or NULL while the connection is idle
+
+	struct http_parser parser;  // Parses the request header in buffer as it is received
 
 	int status;
+	int reply_code;     // HTTP status of a reply with STATUS_OK that is not "200 OK" (such as 206); 0 otherwise
+
+	// Times (see metrics_now()) the current request started, its header was complete, and its reply started; 0 until then
+	unsigned long long request_started;
+	unsigned long long header_received;
+	unsigned long long first_byte_sent;
 
 	// These parameters are used in the state machine version
 
-	struct client *prev;
-	struct client *next;
+	int keep_alive;     // Whether the connection stays open after the current reply
+	int nrequests;      // Requests received on this connection so far
+
+	char *pipelined;    // Bytes received after the current request header, set aside while the reply uses the buffer (from the buffer pool)
+	int npipelined;
+
+	struct timer_wheel *timers; // Wheel of the event loop that holds the deadline (NULL: no deadlines)
+	struct timer deadline;      // For the request header, the progress of the reply, or the next request (see config.h)
+
+	int index;                  // Position in the connection table's dense array
+	int key;                    // Socket the client was registered under (client->socket becomes -1 when finished)
+
+	struct client **dead_list;  // If not NULL, finish_client() queues the client there for reaping
+	struct client *next_dead;
+
+	// These parameters are used when the state machine offloads blocking operations to the thread pool
+
+	struct offload_queue *offload;          // Where completed operations are collected (NULL to block in place)
+	void (*task)(struct client *client);    // Operation to run on a worker
+	struct client *next_completed;
+
+	struct resolution *resolution;          // Request being resolved by a worker, if any
+	off_t prefetched;                       // The file has been read ahead up to this offset
+
+	// These parameters are used by the io_uring backend (see server_uring.c)
+
+	int ring_buffer;                // Registered buffer holding the part of the file being sent, or -1
+	int nbuffered;                  // Bytes of the file in ring_buffer
+	int nbuffer_sent;               // Bytes of ring_buffer already sent
+	struct iovec ring_segments[2];  // Reply header and ring_buffer, sent together (see queue_send_reply())
+	struct msghdr ring_message;
+	struct client *next_waiting;    // Next client waiting for a registered buffer
 };
 
 extern atomic_ulong operations_completed;
 
+/**
+ * @return A new client for \p socket, from the pool of clients; NULL if memory is exhausted. The client has no
+ *         buffer until acquire_request_buffer() is called.
+ */
 struct client *make_client(int socket);
 
+/**
+ * Gives \p client (finished already) back to the pool of clients.
+ */
+void free_client(struct client *client);
+
+/**
+ * Gives \p client a request buffer, unless it has one already.
+ *
+ * @return 1 on success; 0 if memory is exhausted.
+ */
+int acquire_request_buffer(struct client *client);
+
+/**
+ * Gives the request buffer of \p client, if any, back to the buffer pool. Called when the connection goes idle.
+ */
+void release_request_buffer(struct client *client);
+
 int read_request(struct client *client);
 
+/**
+ * Answers a request that could not be parsed (or was not received in time) with the error \p code (400, 408, 431 or 501),
+ * as far as the socket takes it without blocking, and finishes \p client.
+ */
+void reject_request(struct client *client, int code);
+
 void switch_state(struct client *client, char *filename, char *protocol);
 
+/**
+ * Resolves \p filename to a file entry and, for small files, an in-memory response. May block on the disk.
+ * Either reference may be NULL. For a text file, the reply may use one of the content codings \p encodings (see
+ * http_encodings()): the entry is then its precompressed sidecar, or the content is compressed.
+ */
+void resolve_file(char *filename, char *protocol, int encodings, struct file_entry **entry, struct content **content);
+
+/**
+ * Same as resolve_file(), but only succeeds if the answer is already in memory.
+ *
+ * @return 1 if \p entry and \p content have been filled; 0 if resolving the file would block.
+ */
+int try_resolve_file(char *filename, char *protocol, int encodings, struct file_entry **entry, struct content **content);
+
+/**
+ * Prepares the reply of \p client from a resolved file and moves it to E_SEND_REPLY, taking over both references.
+ * Never blocks. switch_state() is resolve_file() followed by prepare_reply().
+ */
+void prepare_reply(struct client *client, char *filename, char *protocol, struct file_entry *entry, struct content *content);
+
 int write_reply(struct client *client);
 
 void finish_client(struct client *client);
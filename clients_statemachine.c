@@ -2,13 +2,23 @@
  * Copyright (c) 2017, Hammurabi Mendes.
  * Licence: BSD 2-clause
  */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <limits.h>
+#include <stdatomic.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "networking.h"
 
@@ -16,169 +26,711 @@
 
 #include "clients_statemachine.h"
 #include "server_statemachine.h"
+#include "file_transfer.h"
+#include "config.h"
+#include "offload.h"
+#include "pool.h"
+#include "access_log.h"
+#include "metrics.h"
+
+int continue_reading_request(struct client *client);
+int continue_sending_reply(struct client *client);
+
+static int parse_request(struct client *client);
+static int restart_client(struct client *client);
+static void set_deadline(struct client *client, int seconds);
+static void begin_reply(struct client *client, char *filename, char *protocol);
+
+static void resolve_task(struct client *client);
+static void prefetch_task(struct client *client);
+
+/**
+ * Request whose file is being resolved on the thread pool.
+ */
+struct resolution {
+	char *filename;     // Both point into the request header, which stays in the client buffer meanwhile
+	char *protocol;
+	int encodings;      // Content codings accepted (see http_encodings())
+
+	struct file_entry *entry;
+	struct content *content;
+};
 
-void continue_reading_request(struct client *client);
-void continue_sending_reply(struct client *client);
+#define INITIAL_CAPACITY 1024
 
-// Global variables
+// Connections open in the process, over all the tables (see connection_slots())
+static atomic_int connections_open = 0;
 
-struct client *head;
-struct client *tail;
+// When accepting may be tried again after running out of descriptors or memory (see timer_clock()), and whether that
+// has been reported since the last connection accepted (see accept_failed())
+static atomic_ullong accept_resume = 0;
+static atomic_int accept_exhausted = 0;
 
 // Functions
 
-void init() {
-	head = NULL;
-	tail = NULL;
+void init(struct client_table *table) {
+	table->by_socket = NULL;
+	table->capacity = 0;
+
+	table->clients = NULL;
+	table->size = 0;
+	table->allocated = 0;
+
+	table->dead = NULL;
+
+	timer_wheel_init(&table->timers);
+
+	table->offload = NULL;
 }
 
-int insert_client(int socket) {
+void destroy(struct client_table *table) {
+	for(int i = 0; i < table->size; i++) {
+		struct client *client = table->clients[i];
+
+		if(client->resolution != NULL) {
+			// Resolved by a worker, but never picked up by the event loop
+			if(client->resolution->entry != NULL) {
+				file_cache_release(client->resolution->entry);
+			}
+
+			if(client->resolution->content != NULL) {
+				content_cache_release(client->resolution->content);
+			}
+
+			free(client->resolution);
+			client->resolution = NULL;
+		}
+
+		if(client->socket != -1) {
+			finish_client(client);
+		}
+	}
+
+	reap_clients(table);
+
+	free(table->by_socket);
+	free(table->clients);
+
+	init(table);
+}
+
+/**
+ * Grows \p array (of \p length entries) so that it has at least \p minimum entries, doubling its size.
+ * New entries are zeroed.
+ *
+ * @return 1 on success; 0 if memory could not be allocated (the array is left untouched).
+ */
+static int grow(struct client ***array, int *length, int minimum) {
+	int new_length = (*length > 0) ? *length : INITIAL_CAPACITY;
+
+	while(new_length < minimum) {
+		new_length *= 2;
+	}
+
+	if(new_length == *length) {
+		return 1;
+	}
+
+	struct client **new_array = (struct client **) realloc(*array, new_length * sizeof(struct client *));
+
+	if(new_array == NULL) {
+		return 0;
+	}
+
+	memset(new_array + *length, 0, (new_length - *length) * sizeof(struct client *));
+
+	*array = new_array;
+	*length = new_length;
+
+	return 1;
+}
+
+struct client *insert_client(struct client_table *table, int socket) {
+	if(socket < 0) {
+		return NULL;
+	}
+
+	if(!grow(&table->by_socket, &table->capacity, socket + 1) || !grow(&table->clients, &table->allocated, table->size + 1)) {
+		return NULL;
+	}
+
 	struct client *new_client = make_client(socket);
 
 	if(new_client != NULL) {
-		new_client->prev = NULL;
-		new_client->next = head;
+		// A previous owner of this descriptor may have been finished but not reaped yet: it only remains on the dead list
+		table->by_socket[socket] = new_client;
 
-		if(head != NULL) {
-			head->prev = new_client;
-		}
+		new_client->index = table->size;
+		table->clients[table->size++] = new_client;
 
-		head = new_client;
+		new_client->dead_list = &table->dead;
+		new_client->offload = table->offload;
 
-		if(tail == NULL) {
-			tail = new_client;
+		// The first request header is due from the moment the connection is accepted
+		new_client->timers = &table->timers;
+		set_deadline(new_client, config.header_timeout);
+
+		atomic_fetch_add_explicit(&connections_open, 1, memory_order_relaxed);
+
+		// Accepting works again: a later shortage of descriptors is reported anew
+		if(atomic_load_explicit(&accept_exhausted, memory_order_relaxed)) {
+			atomic_store_explicit(&accept_exhausted, 0, memory_order_relaxed);
 		}
+	}
 
-		return 1;
+	return new_client;
+}
+
+struct client *search_client(struct client_table *table, int socket) {
+	if(socket < 0 || socket >= table->capacity) {
+		return NULL;
 	}
 
-	return 0;
+	return table->by_socket[socket];
+}
+
+static void remove_client(struct client_table *table, struct client *client) {
+	timer_cancel(&table->timers, &client->deadline);
+
+	if(client->key < table->capacity && table->by_socket[client->key] == client) {
+		table->by_socket[client->key] = NULL;
+	}
+
+	// Keep the array dense by moving the last client into the vacated position
+	struct client *last = table->clients[--table->size];
+
+	last->index = client->index;
+	table->clients[client->index] = last;
+
+	free_client(client);
+
+	atomic_fetch_sub_explicit(&connections_open, 1, memory_order_relaxed);
 }
 
-struct client *search_client(int socket) {
-	struct client *temporary;
+// Client sockets must be below this descriptor (see limit_descriptors())
+static int descriptor_ceiling = INT_MAX;
+
+// Descriptors left to everything but the connections and the file cache: the event loops, the logs, the index walk...
+#define RESERVED_DESCRIPTORS 64
 
-	temporary = head;
+static int limit = 0;
 
-	while(temporary != NULL) {
-		if(socket == temporary->socket) {
-			return temporary;
+/**
+ * @return The most connections the process keeps open: as many as its descriptors allow (below the ceiling, if any),
+ *         or config.max_connections if lower.
+ */
+static int connection_limit(void) {
+	if(limit == 0) {
+		struct rlimit descriptors;
+		long available = descriptor_ceiling;
+
+		if(getrlimit(RLIMIT_NOFILE, &descriptors) == 0 && descriptors.rlim_cur != RLIM_INFINITY && descriptors.rlim_cur < (rlim_t) available) {
+			available = (long) descriptors.rlim_cur;
+		}
+
+		// Besides those reserved and those the file cache keeps open, each connection may take two: its socket, and
+		// a file evicted from the cache while it is being sent
+		long fit = (available < (1 << 30)) ? (available - RESERVED_DESCRIPTORS - file_cache_descriptors()) / 2 : (1 << 30);
+
+		if(fit < 1) {
+			fit = 1;
 		}
 
-		temporary = temporary->next;
+		limit = (config.max_connections > 0 && config.max_connections < fit) ? config.max_connections : (int) fit;
+	}
+
+	return limit;
+}
+
+int connection_slots(void) {
+	return connection_limit() - atomic_load_explicit(&connections_open, memory_order_relaxed);
+}
+
+void limit_descriptors(int ceiling) {
+	descriptor_ceiling = ceiling;
+
+	// Cached files take descriptors below the ceiling as well: both are fit in again
+	file_cache_limit_descriptors(ceiling);
+	limit = 0;
+}
+
+int accept_failed(int error) {
+	// Only the connection being accepted is lost: go on with the next one
+	if(error == ECONNABORTED || error == EINTR || error == EPROTO || error == EPERM) {
+		return 0;
 	}
 
-	return NULL;
+	// The process ran out of descriptors or memory (EMFILE, ENFILE, ENOBUFS, ENOMEM), or the accept socket failed:
+	// accepting again right away would fail the same way
+	atomic_store_explicit(&accept_resume, timer_clock() + ACCEPT_RETRY, memory_order_relaxed);
+
+	if(!atomic_exchange_explicit(&accept_exhausted, 1, memory_order_relaxed)) {
+		fprintf(stderr, "accept: %s (pausing for %d ms at a time until a connection is accepted)\n", strerror(error), ACCEPT_RETRY);
+	}
+
+	return 1;
 }
 
-int remove_client(int socket) {
-	struct client *found_client = search_client(socket);
+long accept_backoff(void) {
+	unsigned long long resume = atomic_load_explicit(&accept_resume, memory_order_relaxed);
 
-	if(found_client == NULL) {
+	if(resume == 0) {
 		return 0;
 	}
 
-	if(found_client->prev != NULL) {
-		found_client->prev->next = found_client->next;
+	unsigned long long now = timer_clock();
+
+	return (now < resume) ? (long) (resume - now) : 0;
+}
+
+int accept_clients(struct client_table *table, int accept_socket, void (*accepted)(struct client *client, void *context), void *context) {
+	for(int i = 0; i < ACCEPT_BATCH; i++) {
+		// Under overload, leave the connections in the backlog until some of ours close, or descriptors are freed
+		if(connection_slots() <= 0 || accept_backoff() > 0) {
+			return 1;
+		}
+
+		// Non-blocking and close-on-exec from the start, without further system calls
+		int client_socket = accept4(accept_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if(client_socket == -1) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+
+			if(accept_failed(errno)) {
+				return 1;
+			}
+
+			continue;
+		}
+
+		// Beyond what the event loop can watch: turn the connection away
+		if(client_socket >= descriptor_ceiling) {
+			close(client_socket);
+			return 1;
+		}
+
+		struct client *client = insert_client(table, client_socket);
+
+		if(client == NULL) {
+			close(client_socket);
+			continue;
+		}
+
+		log_connection(client, 1);
+
+		if(accepted != NULL) {
+			accepted(client, context);
+		}
 	}
-	else {
-		head = found_client->next;
+
+	return 1;
+}
+
+int reap_clients(struct client_table *table) {
+	int reaped = 0;
+
+	while(table->dead != NULL) {
+		struct client *dead = table->dead;
+
+		table->dead = dead->next_dead;
+
+		remove_client(table, dead);
+		reaped++;
+	}
+
+	return reaped;
+}
+
+/**
+ * Arms the deadline of \p client \p seconds from now, replacing the one it had (0 seconds: no deadline).
+ */
+static void set_deadline(struct client *client, int seconds) {
+	if(client->timers == NULL) {
+		return;
 	}
 
-	if(found_client->next != NULL) {
-		found_client->next->prev = found_client->prev;
+	if(seconds > 0) {
+		timer_arm(client->timers, &client->deadline, timer_clock() + seconds * 1000ULL);
 	}
 	else {
-		tail = found_client->prev;
+		timer_cancel(client->timers, &client->deadline);
 	}
+}
 
-	free(found_client);
+int expire_clients(struct client_table *table, void (*expire)(struct client *client, void *context), void *context) {
+	int expired = 0;
+	struct timer *next;
 
-	return 1;
+	for(struct timer *timer = timer_wheel_advance(&table->timers, timer_clock()); timer != NULL; timer = next) {
+		next = timer->next;
+
+		struct client *client = (struct client *) ((char *) timer - offsetof(struct client, deadline));
+
+		if(client->socket == -1) {
+			continue;
+		}
+
+		// A worker owns the client: look again once the send timeout passes anew
+		if(client->state == E_WAIT_IO) {
+			set_deadline(client, config.send_timeout);
+			continue;
+		}
+
+		expired++;
+
+		if(expire != NULL) {
+			expire(client, context);
+		}
+		else if(client->state == E_RECV_REQUEST && client->nread > 0) {
+			reject_request(client, 408);
+		}
+		else {
+			// A connection that never sent a request (or is idle between requests) has not failed any
+			if(client->state != E_RECV_REQUEST) {
+				client->status = STATUS_BAD;
+			}
+
+			finish_client(client);
+		}
+	}
+
+	return expired;
+}
+
+long next_deadline(struct client_table *table) {
+	return timer_wheel_timeout(&table->timers, timer_clock());
 }
 
-void handle_client(struct client *client) {
+int handle_client(struct client *client) {
 	if(!client) {
-		return;
+		return 0;
 	}
 
+	// Clients in E_WAIT_IO belong to a worker until complete_task()
 	switch(client->state) {
 	case E_RECV_REQUEST:
-		continue_reading_request(client);
-		break;
+		return continue_reading_request(client);
 	case E_SEND_REPLY:
-		continue_sending_reply(client);
-		break;
+		return continue_sending_reply(client);
 	}
+
+	return 0;
 }
 
-void continue_reading_request(struct client *client) {
+void complete_task(struct client *client) {
+	struct resolution *resolution = client->resolution;
+
+	if(resolution != NULL) {
+		client->resolution = NULL;
+
+		prepare_reply(client, resolution->filename, resolution->protocol, resolution->entry, resolution->content);
+
+		free(resolution);
+	}
+	else {
+		// The next part of the file has been read ahead
+		client->state = E_SEND_REPLY;
+	}
+
+	set_deadline(client, config.send_timeout);
+}
+
+/**
+ * Prepares the reply of \p client. If resolving the file could block (it is not cached, or must be checked
+ * against the filesystem), the resolution is offloaded to the thread pool and the client waits in E_WAIT_IO.
+ */
+static void begin_reply(struct client *client, char *filename, char *protocol) {
+	struct file_entry *entry;
+	struct content *content;
+
+	if(client->offload == NULL) {
+		switch_state(client, filename, protocol);
+		return;
+	}
+
+	int encodings = http_encodings(&client->parser);
+
+	if(try_resolve_file(filename, protocol, encodings, &entry, &content)) {
+		prepare_reply(client, filename, protocol, entry, content);
+		return;
+	}
+
+	struct resolution *resolution = (struct resolution *) malloc(sizeof(struct resolution));
+
+	if(resolution == NULL) {
+		switch_state(client, filename, protocol);
+		return;
+	}
+
+	resolution->filename = filename;
+	resolution->protocol = protocol;
+	resolution->encodings = encodings;
+
+	resolution->entry = NULL;
+	resolution->content = NULL;
+
+	client->resolution = resolution;
+	client->state = E_WAIT_IO;
+
+	offload(client, resolve_task);
+}
+
+/**
+ * Runs on a worker: opens (or revalidates) the file, and loads it into the content cache if it is small.
+ */
+static void resolve_task(struct client *client) {
+	struct resolution *resolution = client->resolution;
+
+	resolve_file(resolution->filename, resolution->protocol, resolution->encodings, &resolution->entry, &resolution->content);
+}
+
+/**
+ * Runs on a worker: brings the next part of the file into the page cache, so that sendfile(2) on the
+ * event loop does not wait for the disk.
+ */
+static void prefetch_task(struct client *client) {
+	off_t length = client->file_end - client->file_offset;
+
+	if(length > TRANSFER_CHUNK) {
+		length = TRANSFER_CHUNK;
+	}
+
+	// readahead(2) returns once the data has been read
+	readahead(client->file, client->file_offset, length);
+
+	client->prefetched = client->file_offset + length;
+}
+
+int continue_reading_request(struct client *client) {
+	// Idle connections hold no buffer: it is only taken when the next request arrives
+	if(!acquire_request_buffer(client)) {
+		client->status = STATUS_BAD;
+		finish_client(client);
+
+		return 0;
+	}
+
 	int result = read(client->socket, client->buffer + client->nread, BUFFER_SIZE - 1 - client->nread);
 
+	if(result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		// Nothing arrived: the connection is still idle
+		if(client->nread == 0) {
+			release_request_buffer(client);
+		}
+
+		return 0;
+	}
+
+	return request_received(client, result);
+}
+
+int request_received(struct client *client, int result) {
 	if(result <= 0) {
-		fprintf(stderr, "Client socket no. %d closed connection prematurely\n", client->socket);
+		log_connection(client, 0);
 
-		client->status = STATUS_BAD;
+		// A connection closed before sending anything has no request that failed
+		client->status = (result == 0 && client->nread == 0) ? STATUS_OK : STATUS_BAD;
 		finish_client(client);
 
-		return;
+		return 0;
+	}
+
+	// The first request of a connection starts when it is accepted; later ones, with their first byte
+	if(client->request_started == 0) {
+		client->request_started = metrics_now();
+
+		set_deadline(client, config.header_timeout);
 	}
 
 	client->nread += result;
 
-	if(header_complete(client->buffer, client->nread)) {
-		// If you want to print what's in the response
-		printf("Request:\n%s\n", client->buffer);
+	return parse_request(client);
+}
 
-		char filename[1024];
-		char protocol[16];
+/**
+ * If the buffer of \p client holds a complete request header, prepares the reply and moves the client to
+ * E_SEND_REPLY. Bytes received after the header (pipelined requests) are set aside until the reply has been sent.
+ *
+ * @return 1 if the client may be able to progress further; 0 if it has been finished.
+ */
+static int parse_request(struct client *client) {
+	struct http_parser *parser = &client->parser;
 
-		if(get_filename(client->buffer, client->nread, filename, 1024, protocol, 16) == -1) {
-			fprintf(stderr, "Client socket no. %d sent invalid header - closing connection\n", client->socket);
+	// Only the bytes received since the last call are scanned
+	int result = http_parse(parser, client->buffer, client->nread);
 
-			client->status = STATUS_BAD;
-			finish_client(client);
+	if(result == HTTP_PARSE_INCOMPLETE && client->nread < BUFFER_SIZE - 1) {
+		return 1;
+	}
+
+	if(result != HTTP_PARSE_DONE) {
+		reject_request(client, (result == HTTP_PARSE_ERROR) ? parser->error : 431);
+
+		return 0;
+	}
+
+	metrics_header_received(client);
+
+	// From now on, the reply must keep progressing
+	set_deadline(client, config.send_timeout);
+
+	char *filename = http_filename(parser);
+	char *protocol = parser->protocol.data;
+
+	int length = parser->header_length;
+	int close_requested = parser->close;
+
+	// The reply header may overwrite the buffer
+	if(client->nread > length) {
+		client->npipelined = client->nread - length;
+		client->pipelined = buffer_alloc(client->npipelined);
+
+		if(client->pipelined == NULL) {
+			client->npipelined = 0;
+			close_requested = 1;
+		}
+		else {
+			memcpy(client->pipelined, client->buffer + length, client->npipelined);
 		}
+	}
 
-		switch_state(client, filename, protocol);
+	client->nrequests++;
+
+	// Only "200 OK" replies carry a Content-Length, so any other reply will be delimited by closing the connection
+	client->keep_alive = !close_requested && strcmp(protocol, "HTTP/1.1") == 0 && client->nrequests < config.keepalive_requests;
+
+	begin_reply(client, filename, protocol);
+
+	return 1;
+}
+
+/**
+ * Brings a persistent connection back to E_RECV_REQUEST after a reply, handling the next pipelined request
+ * right away if it has been received already.
+ *
+ * @return 1 if the client may be able to progress further; 0 if it has been finished.
+ */
+static int restart_client(struct client *client) {
+	client->state = E_RECV_REQUEST;
+	client->status = STATUS_OK;
+	client->reply_code = 0;
+
+	client->nread = 0;
+	client->nwritten = 0;
+	client->ntowrite = 0;
+
+	http_parser_init(&client->parser);
+
+	client->request_started = (client->npipelined > 0) ? metrics_now() : 0;
+	client->header_received = 0;
+	client->first_byte_sent = 0;
+
+	set_deadline(client, (client->npipelined > 0) ? config.header_timeout : config.keepalive_timeout);
+
+	if(client->npipelined > 0) {
+		memcpy(client->buffer, client->pipelined, client->npipelined);
+		client->nread = client->npipelined;
+
+		buffer_free(client->pipelined, client->npipelined);
+		client->pipelined = NULL;
+		client->npipelined = 0;
+
+		return parse_request(client);
 	}
+
+	// The connection goes idle: its buffer is better used by the connections that are active
+	release_request_buffer(client);
+
+	return 1;
 }
 
-void continue_sending_reply(struct client *client) {
+int continue_sending_reply(struct client *client) {
 	int result;
 
 	if(client->ntowrite) {
-		result = write(client->socket, client->buffer + client->nwritten, client->ntowrite);
+		// MSG_MORE lets the header share a segment with the file body, unless a worker must read the body first
+		int flags = (client->offload == NULL && client->file != -1 && client->file_offset < client->file_end) ? MSG_MORE : 0;
+
+		result = send(client->socket, client->header + client->nwritten, client->ntowrite, flags);
 
 		if(result == -1) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+
 			client->status = STATUS_BAD;
 			finish_client(client);
+
+			return 0;
 		}
 
 		client->nwritten += result;
 		client->ntowrite -= result;
 
-		return;
+		reply_progressed(client);
+
+		return 1;
 	}
 
-	if(client->file == NULL) {
-		// If you got here, you're done (in a clean way)
-		finish_client(client);
+	// Large files are read ahead by the thread pool, one chunk at a time, before being sent from the event loop
+	if(client->offload != NULL && client->file != -1 && client->nspliced == 0 && client->file_offset >= client->prefetched && client->file_offset < client->file_end) {
+		client->state = E_WAIT_IO;
+		offload(client, prefetch_task);
 
-		if(client->status == STATUS_OK) {
-			operations_completed++;
-		}
+		return 0;
 	}
-	else {
-		result = fread(client->buffer, sizeof(char), BUFFER_SIZE, client->file);
 
-		if(result < BUFFER_SIZE) {
-			fclose(client->file);
-			client->file = NULL;
+	result = send_body_chunk(client);
+
+	if(result > 0) {
+		reply_progressed(client);
+
+		return 1;
+	}
+
+	if(result == -1) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
 		}
 
-		client->nwritten = 0;
-		client->ntowrite = result;
+		client->status = STATUS_BAD;
+		finish_client(client);
+
+		return 0;
+	}
+
+	// The next part of a multipart reply has its own header
+	if(next_range(client)) {
+		return 1;
 	}
+
+	return reply_sent(client);
 }
 
+void reply_progressed(struct client *client) {
+	metrics_reply_progress(client);
+
+	set_deadline(client, config.send_timeout);
+}
+
+int reply_sent(struct client *client) {
+	log_reply(client);
+	metrics_reply_sent(client);
+
+	release_body(client);
+
+	// If you got here, you're done (in a clean way)
+	if(client->status == STATUS_OK) {
+		operations_completed++;
+	}
+
+	if(client->keep_alive && client->status == STATUS_OK) {
+		return restart_client(client);
+	}
+
+	finish_client(client);
+
+	return 0;
+}
@@ -6,16 +6,139 @@
 #define CLIENTS_STATEMACHINE_H
 
 #include "clients_common.h"
+#include "timer_wheel.h"
 
-extern struct client *head;
-extern struct client *tail;
+/**
+ * Connection table of an event loop. Clients are indexed directly by socket descriptor for O(1)
+ * lookup, and also kept in a dense array so that the loop can iterate over them without holes.
+ * Finished clients are queued in an intrusive dead list by finish_client(), and reaping only
+ * touches those.
+ */
+struct client_table {
+	struct client **by_socket;
+	int capacity;
+
+	struct client **clients;
+	int size;
+	int allocated;
+
+	struct client *dead;
+
+	struct timer_wheel timers;      // Deadlines of the clients (see config.h)
+
+	struct offload_queue *offload; // Given to new clients (NULL: blocking operations run in the event loop)
+};
+
+// Connections accepted per readiness of an accept socket, so that a storm of them does not starve the clients
+#define ACCEPT_BATCH 64
+
+// Milliseconds between attempts to accept while the process is at its connection limit, or out of descriptors
+#define ACCEPT_RETRY 50
+
+void init(struct client_table *table);
+void destroy(struct client_table *table);
+
+struct client *insert_client(struct client_table *table, int socket);
+struct client *search_client(struct client_table *table, int socket);
+
+/**
+ * Accepts up to ACCEPT_BATCH pending connections from the non-blocking \p accept_socket into \p table, with
+ * accept4(2) so that they are non-blocking from the start. Accepting stops early while the process is at its
+ * connection limit (see connection_slots()) or backing off (see accept_backoff()). Each client accepted is given to
+ * \p accepted (with \p context), if not NULL.
+ *
+ * @return 1 if connections may still be pending (the batch was used up, or accepting paused); 0 if the backlog
+ *         is empty.
+ */
+int accept_clients(struct client_table *table, int accept_socket, void (*accepted)(struct client *client, void *context), void *context);
+
+/**
+ * Accounts an accept that failed with \p error (an errno value other than EAGAIN). Unless only that connection was
+ * lost, the process is out of descriptors or memory: every event loop stops accepting for ACCEPT_RETRY milliseconds,
+ * and the error is reported once, until a connection is accepted again.
+ *
+ * @return 1 if accepting should pause (see accept_backoff()); 0 if the next connection may be accepted right away.
+ */
+int accept_failed(int error);
+
+/**
+ * @return Milliseconds left before the event loops may accept again, after running out of descriptors or memory;
+ *         0 if they may accept now.
+ */
+long accept_backoff(void);
+
+/**
+ * @return How many more connections the process may open (see config.max_connections); 0 or less while it is at the
+ *         limit, when the event loops stop accepting.
+ */
+int connection_slots(void);
+
+/**
+ * Keeps client sockets below the descriptor \p ceiling (FD_SETSIZE, for select()): the connection limit and the
+ * descriptors of the file cache are lowered to fit below it, and sockets accepted at or above it anyway are closed
+ * at once. Called before any connection is accepted.
+ */
+void limit_descriptors(int ceiling);
+
+/**
+ * Removes and frees every client that has been finished since the last call.
+ *
+ * @return Number of clients reaped.
+ */
+int reap_clients(struct client_table *table);
+
+/**
+ * Handles the clients whose deadline has passed: a request header not received within the header timeout, a reply
+ * without progress for the send timeout, or a persistent connection idle for the keep-alive timeout. Each client
+ * has a single deadline, moved in O(1) as it changes state.
+ *
+ * The clients are given to \p expire (with \p context), for backends with operations in flight; if \p expire is
+ * NULL, they are finished right away, after a 408 reply if part of a request header was received.
+ *
+ * @return Number of clients expired.
+ */
+int expire_clients(struct client_table *table, void (*expire)(struct client *client, void *context), void *context);
+
+/**
+ * @return Milliseconds until the next deadline of a client of \p table, which the event loop should wait for at most;
+ *         -1 if there is none.
+ */
+long next_deadline(struct client_table *table);
+
+/**
+ * Resumes \p client after its offloaded operation has completed (see offload.h). The caller should then
+ * drive the client with handle_client().
+ */
+void complete_task(struct client *client);
+
+/**
+ * Advances the state machine of \p client by one non-blocking read or write.
+ *
+ * @return 1 if progress was made and the client may be able to progress further; 0 if the
+ *         socket would block or the client has been finished.
+ */
+int handle_client(struct client *client);
 
-void init();
+/**
+ * Completion-based interface, for backends that perform the socket operations themselves (see server_uring.c).
+ * Accounts \p result bytes received into the buffer of \p client (0 or less: the connection failed), and
+ * prepares the reply if the request header is complete.
+ *
+ * @return 1 if the client may be able to progress further; 0 if it has been finished.
+ */
+int request_received(struct client *client, int result);
 
-int insert_client(int socket);
-struct client *search_client(int socket);
-int remove_client(int socket);
+/**
+ * Completion-based interface: \p client has sent part of its reply, which postpones its send deadline.
+ */
+void reply_progressed(struct client *client);
 
-void handle_client(struct client *client);
+/**
+ * Completion-based interface: the whole reply of \p client has been sent. Releases the body, and either waits
+ * for (or handles) the next request on a persistent connection, or finishes the client.
+ *
+ * @return 1 if the client may be able to progress further; 0 if it has been finished.
+ */
+int reply_sent(struct client *client);
 
 #endif /* CLIENTS_STATEMACHINE_H */
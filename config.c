@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "config.h"
+#include "access_log.h"
+
+struct server_config config = {
+    .cache_bytes = 64 << 20,
+    .cache_object_bytes = 1 << 20,
+    .gzip_level = 6,
+    .index = 1,
+
+    .keepalive_requests = 100,
+    .keepalive_timeout = 5,
+    .header_timeout = 10,
+    .send_timeout = 30,
+
+    .max_connections = 0,
+
+    .reactors = 1,
+
+    .offload = 1,
+
+    .threads = 0,
+    .pin_threads = 0,
+
+    .processes = 0,
+
+    .log_level = LOG_INFO,
+    .log_sample = 1,
+};
+
+enum {
+    OPTION_CACHE_BYTES = 256,
+    OPTION_CACHE_OBJECT_BYTES,
+    OPTION_GZIP_LEVEL,
+    OPTION_INDEX,
+    OPTION_KEEPALIVE_REQUESTS,
+    OPTION_KEEPALIVE_TIMEOUT,
+    OPTION_HEADER_TIMEOUT,
+    OPTION_SEND_TIMEOUT,
+    OPTION_MAX_CONNECTIONS,
+    OPTION_REACTORS,
+    OPTION_OFFLOAD,
+    OPTION_THREADS,
+    OPTION_PIN_THREADS,
+    OPTION_PROCESSES,
+    OPTION_LOG_LEVEL,
+    OPTION_LOG_SAMPLE,
+    OPTION_HELP,
+};
+
+static const struct option options[] = {
+    {"cache-bytes", required_argument, NULL, OPTION_CACHE_BYTES},
+    {"cache-object-bytes", required_argument, NULL, OPTION_CACHE_OBJECT_BYTES},
+    {"gzip-level", required_argument, NULL, OPTION_GZIP_LEVEL},
+    {"index", required_argument, NULL, OPTION_INDEX},
+    {"keepalive-requests", required_argument, NULL, OPTION_KEEPALIVE_REQUESTS},
+    {"keepalive-timeout", required_argument, NULL, OPTION_KEEPALIVE_TIMEOUT},
+    {"header-timeout", required_argument, NULL, OPTION_HEADER_TIMEOUT},
+    {"send-timeout", required_argument, NULL, OPTION_SEND_TIMEOUT},
+    {"max-connections", required_argument, NULL, OPTION_MAX_CONNECTIONS},
+    {"reactors", required_argument, NULL, OPTION_REACTORS},
+    {"offload", required_argument, NULL, OPTION_OFFLOAD},
+    {"threads", required_argument, NULL, OPTION_THREADS},
+    {"pin-threads", required_argument, NULL, OPTION_PIN_THREADS},
+    {"processes", required_argument, NULL, OPTION_PROCESSES},
+    {"log-level", required_argument, NULL, OPTION_LOG_LEVEL},
+    {"log-sample", required_argument, NULL, OPTION_LOG_SAMPLE},
+    {"help", no_argument, NULL, OPTION_HELP},
+    {NULL, 0, NULL, 0},
+};
+
+static void usage(char *program) {
+    fprintf(stderr, "Usage: %s [options] <port> [select|epoll|uring|fork]\n", program);
+    fprintf(stderr, "  --cache-bytes=SIZE         memory used to keep whole files (0 disables; default 64M)\n");
+    fprintf(stderr, "  --cache-object-bytes=SIZE  largest file kept in memory (default 1M)\n");
+    fprintf(stderr, "  --gzip-level=N             zlib level of text files compressed in memory (0 disables; default 6)\n");
+    fprintf(stderr, "  --index=0|1                index the document root in memory, kept current with inotify (default 1)\n");
+    fprintf(stderr, "  --keepalive-requests=N     requests served per connection (1 disables keep-alive; default 100)\n");
+    fprintf(stderr, "  --keepalive-timeout=SECS   idle time before a persistent connection is closed (0 for no limit; default 5)\n");
+    fprintf(stderr, "  --header-timeout=SECS      time allowed to receive a request header (0 for no limit; default 10)\n");
+    fprintf(stderr, "  --send-timeout=SECS        time a reply may go without progress (0 for no limit; default 30)\n");
+    fprintf(stderr, "  --max-connections=N        connections open at once, beyond which accepting pauses (0 for as many as the fd limit allows; default 0)\n");
+    fprintf(stderr, "  --reactors=N               event loops run in parallel in epoll mode (0 for one per CPU; default 1)\n");
+    fprintf(stderr, "  --offload=0|1              run file opens and disk reads of the event loops on the thread pool (default 1)\n");
+    fprintf(stderr, "  --threads=N                workers in the thread pool (0 for one per CPU; default 0)\n");
+    fprintf(stderr, "  --pin-threads=0|1          pin each worker to one CPU (default 0)\n");
+    fprintf(stderr, "  --processes=N              pre-forked worker processes in fork mode (0 for one per CPU; default 0)\n");
+    fprintf(stderr, "  --log-level=LEVEL          access log detail: off, error, info or debug (default info)\n");
+    fprintf(stderr, "  --log-sample=N             log one in N replies and connections (default 1)\n");
+}
+
+/**
+ * Parses a non-negative integer.
+ *
+ * @return 1 on success; 0 if \p text is not a non-negative integer.
+ */
+static int parse_count(const char *text, int *count) {
+    char *end;
+    long value = strtol(text, &end, 10);
+
+    if(end == text || *end != '\0' || value < 0 || value > 1 << 30) {
+        return 0;
+    }
+
+    *count = (int) value;
+
+    return 1;
+}
+
+/**
+ * Parses a log level name (see access_log.h).
+ *
+ * @return 1 on success; 0 if \p text is not a level.
+ */
+static int parse_level(const char *text, int *level) {
+    static const char *names[] = {"off", "error", "info", "debug"};
+
+    for(int i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++) {
+        if(strcmp(text, names[i]) == 0) {
+            *level = i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Parses a size such as 4096, 64K, 16M or 1G.
+ *
+ * @return 1 on success; 0 if \p text is not a size.
+ */
+static int parse_size(const char *text, size_t *size) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+
+    if(end == text) {
+        return 0;
+    }
+
+    switch(*end) {
+    case 'G':
+    case 'g':
+        value <<= 10;
+        // fall through
+    case 'M':
+    case 'm':
+        value <<= 10;
+        // fall through
+    case 'K':
+    case 'k':
+        value <<= 10;
+        end++;
+        break;
+    }
+
+    if(*end != '\0') {
+        return 0;
+    }
+
+    *size = value;
+
+    return 1;
+}
+
+int parse_config(int argc, char **argv) {
+    int option;
+    int valid = 1;
+
+    while((option = getopt_long(argc, argv, "+", options, NULL)) != -1) {
+        switch(option) {
+        case OPTION_CACHE_BYTES:
+            valid = parse_size(optarg, &config.cache_bytes);
+            break;
+        case OPTION_CACHE_OBJECT_BYTES:
+            valid = parse_size(optarg, &config.cache_object_bytes);
+            break;
+        case OPTION_GZIP_LEVEL:
+            valid = parse_count(optarg, &config.gzip_level) && config.gzip_level <= 9;
+            break;
+        case OPTION_INDEX:
+            valid = parse_count(optarg, &config.index);
+            break;
+        case OPTION_KEEPALIVE_REQUESTS:
+            valid = parse_count(optarg, &config.keepalive_requests);
+            break;
+        case OPTION_KEEPALIVE_TIMEOUT:
+            valid = parse_count(optarg, &config.keepalive_timeout);
+            break;
+        case OPTION_HEADER_TIMEOUT:
+            valid = parse_count(optarg, &config.header_timeout);
+            break;
+        case OPTION_SEND_TIMEOUT:
+            valid = parse_count(optarg, &config.send_timeout);
+            break;
+        case OPTION_MAX_CONNECTIONS:
+            valid = parse_count(optarg, &config.max_connections);
+            break;
+        case OPTION_REACTORS:
+            valid = parse_count(optarg, &config.reactors);
+            break;
+        case OPTION_OFFLOAD:
+            valid = parse_count(optarg, &config.offload);
+            break;
+        case OPTION_THREADS:
+            valid = parse_count(optarg, &config.threads);
+            break;
+        case OPTION_PIN_THREADS:
+            valid = parse_count(optarg, &config.pin_threads);
+            break;
+        case OPTION_PROCESSES:
+            valid = parse_count(optarg, &config.processes);
+            break;
+        case OPTION_LOG_LEVEL:
+            valid = parse_level(optarg, &config.log_level);
+            break;
+        case OPTION_LOG_SAMPLE:
+            valid = parse_count(optarg, &config.log_sample);
+            break;
+        default:
+            valid = 0;
+            break;
+        }
+
+        if(!valid) {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    return optind;
+}
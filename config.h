@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+/**
+ * Tunables set from the command line. Every field has a sensible default, so a server can be
+ * started with just a port.
+ */
+struct server_config {
+    size_t cache_bytes;         // Total size of the in-memory content cache (0 disables it)
+    size_t cache_object_bytes;  // Largest file kept in the content cache
+    int gzip_level;             // zlib level of the text files compressed in memory (0 disables it)
+    int index;                  // Whether the document root is indexed in memory and watched with inotify
+
+    int keepalive_requests;     // Requests served per persistent connection (1 disables keep-alive)
+    int keepalive_timeout;      // Seconds an idle persistent connection is kept open (0 for no limit)
+    int header_timeout;         // Seconds allowed to receive a request header (0 for no limit)
+    int send_timeout;           // Seconds a reply may go without any progress (0 for no limit)
+
+    int max_connections;        // Connections open at once; accepting pauses at the limit (0 for as many as descriptors allow)
+
+    int reactors;               // Event loops run in parallel by the epoll server (0 for one per CPU)
+
+    int offload;                // Whether event loops hand blocking disk operations to the thread pool
+
+    int threads;                // Workers in the thread pool (0 for one per CPU)
+    int pin_threads;            // Whether each worker is pinned to one CPU
+
+    int processes;              // Worker processes in fork mode (0 for one per CPU)
+
+    int log_level;              // Most detailed records written to the access log (see access_log.h)
+    int log_sample;             // Only one in this many replies and connections is logged
+};
+
+extern struct server_config config;
+
+/**
+ * Parses the options at the beginning of \p argv into the global configuration.
+ *
+ * @return Index of the first non-option argument, or -1 if the options are invalid (usage has been printed).
+ */
+int parse_config(int argc, char **argv);
+
+#endif /* CONFIG_H */
@@ -0,0 +1,539 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * In-memory cache of complete responses for small, hot files, sharded like the file cache, with LRU eviction under
+ * a byte budget split evenly over the shards. Responses in a content coding are cached apart, from precompressed
+ * sidecars or compressed here.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "clients_common.h"
+#include "content_cache.h"
+#include "file_cache.h"
+#include "config.h"
+#include "networking.h"
+
+#define NUM_SHARDS      16
+#define NUM_BUCKETS     256 // Per shard
+
+struct shard {
+    pthread_mutex_t mutex;
+
+    struct content *buckets[NUM_BUCKETS];
+
+    // Most recently used first
+    struct content *lru_head;
+    struct content *lru_tail;
+
+    // Bytes held by cached contents (contents evicted but still being sent are not counted)
+    size_t bytes;
+};
+
+static struct shard shards[NUM_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void initialize_shards(void) {
+    for(int i = 0; i < NUM_SHARDS; i++) {
+        memset(&shards[i], 0, sizeof(struct shard));
+        pthread_mutex_init(&shards[i].mutex, NULL);
+    }
+}
+
+static unsigned long hash_key(const char *key, size_t length) {
+    // FNV-1a
+    unsigned long hash = 14695981039346656037UL;
+
+    for(size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211UL;
+    }
+
+    return hash;
+}
+
+static struct shard *shard_of(unsigned long hash) {
+    return &shards[hash % NUM_SHARDS];
+}
+
+static struct content **bucket_of(struct shard *shard, unsigned long hash) {
+    return &shard->buckets[(hash / NUM_SHARDS) % NUM_BUCKETS];
+}
+
+/**
+ * @return The bytes each shard may hold.
+ */
+static size_t shard_budget(void) {
+    return config.cache_bytes / NUM_SHARDS;
+}
+
+static int same_file(struct content *content, struct file_entry *entry) {
+    return content->inode == entry->inode && content->device == entry->device && content->size == entry->size && content->mtime.tv_sec == entry->mtime.tv_sec && content->mtime.tv_nsec == entry->mtime.tv_nsec;
+}
+
+static void lru_unlink(struct shard *shard, struct content *content) {
+    if(content->lru_prev != NULL) {
+        content->lru_prev->lru_next = content->lru_next;
+    }
+    else {
+        shard->lru_head = content->lru_next;
+    }
+
+    if(content->lru_next != NULL) {
+        content->lru_next->lru_prev = content->lru_prev;
+    }
+    else {
+        shard->lru_tail = content->lru_prev;
+    }
+}
+
+static void lru_push_front(struct shard *shard, struct content *content) {
+    content->lru_prev = NULL;
+    content->lru_next = shard->lru_head;
+
+    if(shard->lru_head != NULL) {
+        shard->lru_head->lru_prev = content;
+    }
+
+    shard->lru_head = content;
+
+    if(shard->lru_tail == NULL) {
+        shard->lru_tail = content;
+    }
+}
+
+static struct content *find(struct shard *shard, const char *key, size_t key_length, unsigned long hash) {
+    for(struct content *content = *bucket_of(shard, hash); content != NULL; content = content->next) {
+        if(content->hash == hash && content->key_length == key_length && memcmp(content->key, key, key_length) == 0) {
+            return content;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Removes \p content from \p shard. The caller holds the shard's lock, and is responsible for dropping the cache's
+ * reference.
+ */
+static void detach(struct shard *shard, struct content *content) {
+    struct content **link = bucket_of(shard, content->hash);
+
+    while(*link != content) {
+        link = &(*link)->next;
+    }
+
+    *link = content->next;
+
+    lru_unlink(shard, content);
+    shard->bytes -= content->length;
+}
+
+/**
+ * Reads the whole file resolved in \p entry into \p data.
+ *
+ * @return 0 on success; -1 on failure.
+ */
+static int read_file(struct file_entry *entry, char *data) {
+    // pread(2) leaves the shared descriptor's offset alone
+    off_t loaded = 0;
+
+    while(loaded < entry->size) {
+        ssize_t result = pread(entry->fd, data + loaded, entry->size - loaded, loaded);
+
+        if(result <= 0) {
+            if(result == -1 && errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        loaded += result;
+    }
+
+    return 0;
+}
+
+/**
+ * Compresses the file resolved in \p entry in the gzip format, at config.gzip_level.
+ *
+ * @return The compressed bytes (to be freed), whose length is stored in \p length; NULL on failure.
+ */
+static char *compress_file(struct file_entry *entry, size_t *length) {
+    char *original = (char *) malloc(entry->size > 0 ? entry->size : 1);
+
+    if(original == NULL || read_file(entry, original) == -1) {
+        free(original);
+        return NULL;
+    }
+
+    z_stream stream;
+
+    memset(&stream, 0, sizeof(z_stream));
+
+    // 16 more window bits ask for the gzip wrapper instead of the zlib one
+    if(deflateInit2(&stream, config.gzip_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(original);
+        return NULL;
+    }
+
+    size_t bound = deflateBound(&stream, entry->size);
+    char *compressed = (char *) malloc(bound);
+
+    if(compressed != NULL) {
+        stream.next_in = (Bytef *) original;
+        stream.avail_in = entry->size;
+        stream.next_out = (Bytef *) compressed;
+        stream.avail_out = bound;
+
+        // The bound guarantees that a single call finishes
+        if(deflate(&stream, Z_FINISH) == Z_STREAM_END) {
+            *length = stream.total_out;
+        }
+        else {
+            free(compressed);
+            compressed = NULL;
+        }
+    }
+
+    deflateEnd(&stream);
+    free(original);
+
+    return compressed;
+}
+
+/**
+ * Fills in the header of the response for \p filename compressed here into \p buffer (of BUFFER_SIZE bytes), and
+ * the entity tag and "304 Not Modified" reply of \p content, for a body of \p length bytes.
+ *
+ * @return The length of the header; 0 on failure.
+ */
+static size_t compressed_header(struct content *content, struct file_entry *entry, char *filename, char *protocol, size_t length, char *buffer) {
+    // The entity tag of the file, with the coding before the closing quote
+    snprintf(content->etag, ETAG_SIZE, "%.*s-%s\"", (int) strlen(entry->etag) - 1, entry->etag, content_encoding_name(content->encoding));
+
+    char fields[BUFFER_SIZE];
+    int fields_length = snprintf(fields, BUFFER_SIZE, "Content-Encoding: %s\r\nVary: Accept-Encoding\r\nETag: %s\r\nLast-Modified: %s\r\n", content_encoding_name(content->encoding), content->etag, entry->last_modified);
+
+    int not_modified_length = snprintf(buffer, BUFFER_SIZE, "%s 304 Not Modified\r\nFilename: %s\r\nVary: Accept-Encoding\r\nETag: %s\r\nLast-Modified: %s\r\n\r\n", protocol, filename, content->etag, entry->last_modified);
+
+    if(fields_length >= BUFFER_SIZE || not_modified_length >= BUFFER_SIZE) {
+        return 0;
+    }
+
+    if((content->not_modified = (struct file_header *) malloc(sizeof(struct file_header) + not_modified_length + 1)) == NULL) {
+        return 0;
+    }
+
+    content->not_modified->length = not_modified_length;
+    memcpy(content->not_modified->data, buffer, not_modified_length + 1);
+
+    get_200(buffer, filename, protocol, length);
+
+    size_t header_length = strlen(buffer);
+
+    if(header_length < 2 || header_length + fields_length >= BUFFER_SIZE) {
+        return 0;
+    }
+
+    // Before the blank line ending the header
+    memcpy(buffer + header_length - 2, fields, fields_length);
+    memcpy(buffer + header_length - 2 + fields_length, "\r\n", 3);
+
+    return header_length + fields_length;
+}
+
+static void free_content(struct content *content) {
+    free(content->key);
+    free(content->data);
+    free(content->not_modified);
+    free(content);
+}
+
+/**
+ * Builds the response for \p filename in the coding \p encoding from \p entry (see content_cache_acquire()): its
+ * header (for files sent as they are, prebuilt: see file_cache_header()) followed by the whole body.
+ * Called without the lock held.
+ */
+static struct content *load(struct file_entry *entry, char *filename, char *protocol, int encoding, const char *key, size_t key_length, unsigned long hash) {
+    struct content *content = (struct content *) malloc(sizeof(struct content));
+
+    if(content == NULL) {
+        return NULL;
+    }
+
+    content->encoding = encoding;
+    content->etag[0] = '\0';
+    content->not_modified = NULL;
+
+    content->key = (char *) malloc(key_length);
+    content->data = NULL;
+
+    char temporary_buffer[BUFFER_SIZE];
+    const char *header = temporary_buffer;
+    size_t header_length = 0;
+
+    char *compressed = NULL;
+    size_t body_length = entry->size;
+
+    if(encoding != 0 && strcmp(entry->path, filename) == 0) {
+        if((compressed = compress_file(entry, &body_length)) != NULL) {
+            header_length = compressed_header(content, entry, filename, protocol, body_length, temporary_buffer);
+        }
+    }
+    else {
+        const struct file_header *prebuilt = (encoding != 0) ? file_cache_encoded_header(entry, protocol) : file_cache_header(entry, protocol);
+
+        if(prebuilt != NULL) {
+            header = prebuilt->data;
+            header_length = prebuilt->length;
+        }
+        else if(encoding == 0) {
+            get_200(temporary_buffer, filename, protocol, entry->size);
+            header_length = strlen(temporary_buffer);
+        }
+    }
+
+    if(content->key == NULL || header_length == 0 || (content->data = (char *) malloc(header_length + body_length)) == NULL) {
+        free(compressed);
+        free_content(content);
+        return NULL;
+    }
+
+    memcpy(content->key, key, key_length);
+    memcpy(content->data, header, header_length);
+
+    if(compressed != NULL) {
+        memcpy(content->data + header_length, compressed, body_length);
+        free(compressed);
+    }
+    else if(read_file(entry, content->data + header_length) == -1) {
+        free_content(content);
+        return NULL;
+    }
+
+    content->key_length = key_length;
+    content->hash = hash;
+
+    content->inode = entry->inode;
+    content->device = entry->device;
+    content->size = entry->size;
+    content->mtime = entry->mtime;
+
+    content->length = header_length + body_length;
+    content->header_length = header_length;
+
+    atomic_init(&content->references, 1);
+
+    return content;
+}
+
+int content_cache_wants(struct file_entry *entry) {
+    return (size_t) entry->size <= config.cache_object_bytes && (size_t) entry->size < shard_budget();
+}
+
+/**
+ * Builds the key of a response: the header depends on the filename and the protocol, and the body on the coding.
+ *
+ * @return Length of the key, or 0 if it does not fit in \p key (of BUFFER_SIZE bytes).
+ */
+static size_t make_key(char *key, char *filename, char *protocol, int encoding) {
+    size_t filename_length = strlen(filename);
+    size_t protocol_length = strlen(protocol);
+
+    if(filename_length + 1 + protocol_length + 2 > BUFFER_SIZE) {
+        return 0;
+    }
+
+    memcpy(key, filename, filename_length);
+    key[filename_length] = '\0';
+    memcpy(key + filename_length + 1, protocol, protocol_length);
+
+    size_t length = filename_length + 1 + protocol_length;
+
+    if(encoding != 0) {
+        key[length++] = '\0';
+        key[length++] = '0' + encoding;
+    }
+
+    return length;
+}
+
+/**
+ * @return The content cached under \p key with a new reference, if it was loaded from the file in \p entry; NULL otherwise.
+ */
+static struct content *lookup(struct file_entry *entry, const char *key, size_t key_length, unsigned long hash) {
+    struct shard *shard = shard_of(hash);
+
+    pthread_once(&shards_once, initialize_shards);
+    pthread_mutex_lock(&shard->mutex);
+
+    struct content *content = find(shard, key, key_length, hash);
+
+    if(content != NULL && same_file(content, entry)) {
+        atomic_fetch_add(&content->references, 1);
+
+        lru_unlink(shard, content);
+        lru_push_front(shard, content);
+    }
+    else {
+        content = NULL;
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    return content;
+}
+
+struct content *content_cache_peek(struct file_entry *entry, char *filename, char *protocol, int encoding) {
+    char key[BUFFER_SIZE];
+    size_t key_length;
+
+    if(!content_cache_wants(entry) || (key_length = make_key(key, filename, protocol, encoding)) == 0) {
+        return NULL;
+    }
+
+    return lookup(entry, key, key_length, hash_key(key, key_length));
+}
+
+struct content *content_cache_acquire(struct file_entry *entry, char *filename, char *protocol, int encoding) {
+    char key[BUFFER_SIZE];
+    size_t key_length;
+
+    if(!content_cache_wants(entry) || (key_length = make_key(key, filename, protocol, encoding)) == 0) {
+        return NULL;
+    }
+
+    unsigned long hash = hash_key(key, key_length);
+    struct content *content = lookup(entry, key, key_length, hash);
+
+    if(content != NULL) {
+        return content;
+    }
+
+    // Miss, or the file changed since it was loaded
+    struct content *fresh = load(entry, filename, protocol, encoding, key, key_length, hash);
+
+    if(fresh == NULL) {
+        return NULL;
+    }
+
+    if(fresh->length > shard_budget()) {
+        // The header pushed it over the budget: serve this response from the private copy only
+        return fresh;
+    }
+
+    struct shard *shard = shard_of(hash);
+    struct content *replaced;
+    struct content *evicted = NULL;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    if((replaced = find(shard, key, key_length, hash)) != NULL) {
+        detach(shard, replaced);
+    }
+
+    // Evict least recently used contents until the new one fits; they are freed once their last response is sent
+    while(shard->bytes + fresh->length > shard_budget() && shard->lru_tail != NULL) {
+        struct content *victim = shard->lru_tail;
+
+        detach(shard, victim);
+
+        victim->next = evicted;
+        evicted = victim;
+    }
+
+    // One reference for the cache, one for the caller
+    atomic_fetch_add(&fresh->references, 1);
+
+    fresh->next = *bucket_of(shard, hash);
+    *bucket_of(shard, hash) = fresh;
+
+    lru_push_front(shard, fresh);
+    shard->bytes += fresh->length;
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    if(replaced != NULL) {
+        content_cache_release(replaced);
+    }
+
+    while(evicted != NULL) {
+        struct content *next = evicted->next;
+
+        content_cache_release(evicted);
+        evicted = next;
+    }
+
+    return fresh;
+}
+
+void content_cache_release(struct content *content) {
+    if(atomic_fetch_sub(&content->references, 1) == 1) {
+        free_content(content);
+    }
+}
+
+int content_compressible(const char *filename) {
+    static const char *extensions[] = {"html", "htm", "css", "js", "mjs", "json", "xml", "svg", "txt", "csv", "md", "map", "wasm"};
+
+    const char *dot = strrchr(filename, '.');
+
+    if(dot == NULL || strchr(dot, '/') != NULL) {
+        return 0;
+    }
+
+    for(int i = 0; i < (int) (sizeof(extensions) / sizeof(extensions[0])); i++) {
+        if(strcasecmp(dot + 1, extensions[i]) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+const char *content_encoding_name(int encoding) {
+    return (encoding == HTTP_ENCODING_BR) ? "br" : "gzip";
+}
+
+/**
+ * @return The filename suffix of the sidecars in the coding \p encoding.
+ */
+static const char *sidecar_suffix(int encoding) {
+    return (encoding == HTTP_ENCODING_BR) ? ".br" : ".gz";
+}
+
+int content_sidecar(const char *filename, int encoding, char *sidecar) {
+    return snprintf(sidecar, BUFFER_SIZE, "%s%s", filename, sidecar_suffix(encoding)) < BUFFER_SIZE;
+}
+
+int content_sidecar_encoding(const char *path) {
+    static const int encodings[] = {HTTP_ENCODING_GZIP, HTTP_ENCODING_BR};
+
+    size_t length = strlen(path);
+
+    for(int i = 0; i < (int) (sizeof(encodings) / sizeof(encodings[0])); i++) {
+        const char *suffix = sidecar_suffix(encodings[i]);
+        size_t suffix_length = strlen(suffix);
+
+        if(length > suffix_length && length - suffix_length < BUFFER_SIZE && strcmp(path + length - suffix_length, suffix) == 0) {
+            char original[BUFFER_SIZE];
+
+            memcpy(original, path, length - suffix_length);
+            original[length - suffix_length] = '\0';
+
+            return content_compressible(original) ? encodings[i] : 0;
+        }
+    }
+
+    return 0;
+}
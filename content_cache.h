@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef CONTENT_CACHE_H
+#define CONTENT_CACHE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "file_cache.h"
+
+/**
+ * A complete "200 OK" response (header followed by the whole file, possibly compressed) kept in memory.
+ * Contents are reference counted like file entries: the cache holds one reference while
+ * the content is cached, and every response being sent from it holds another.
+ */
+struct content {
+    char *key;          // Filename and protocol, separated by a null character
+    size_t key_length;
+    unsigned long hash;
+
+    // Identity of the file the content was read from
+    ino_t inode;
+    dev_t device;
+    off_t size;
+    struct timespec mtime;
+
+    char *data;
+    size_t length;
+    size_t header_length;
+
+    int encoding;       // Content coding of the body (see http_parser.h); 0 if it is the file as it is
+
+    // For bodies compressed here, which are not files of their own: their entity tag (the file's, marked with the
+    // coding), and the "304 Not Modified" reply that goes with it. Otherwise, NULL.
+    char etag[ETAG_SIZE];
+    struct file_header *not_modified;
+
+    atomic_int references;
+
+    // Hash chain and LRU list (protected by the cache lock)
+    struct content *next;
+    struct content *lru_prev;
+    struct content *lru_next;
+};
+
+/**
+ * Returns the in-memory response for \p filename in the content coding \p encoding (0 for none), loading it from the
+ * file resolved in \p entry (which must have STATUS_OK) if the file is small enough and the cache is enabled (see
+ * config.h). With a coding, \p entry is either a precompressed sidecar of \p filename (see content_sidecar()), whose
+ * bytes are sent as they are, or the file itself, which is then compressed here (only gzip is supported).
+ * Safe to call from any thread.
+ *
+ * @return A referenced content, which must be given back with content_cache_release(); NULL if the
+ *         file should be sent from disk instead.
+ */
+struct content *content_cache_acquire(struct file_entry *entry, char *filename, char *protocol, int encoding);
+
+/**
+ * @return 1 if the file resolved in \p entry is small enough to be served from the content cache: at most
+ *         config.cache_object_bytes, and less than the share of config.cache_bytes held by each of its shards.
+ */
+int content_cache_wants(struct file_entry *entry);
+
+/**
+ * Same as content_cache_acquire(), but never loads the file.
+ *
+ * @return A referenced content, or NULL if it is not cached yet.
+ */
+struct content *content_cache_peek(struct file_entry *entry, char *filename, char *protocol, int encoding);
+
+/**
+ * Drops a reference obtained from content_cache_acquire() or content_cache_peek().
+ */
+void content_cache_release(struct content *content);
+
+/**
+ * @return 1 if \p filename is worth compressing (a text type, by its extension); 0 otherwise.
+ */
+int content_compressible(const char *filename);
+
+/**
+ * @return The name of the content coding \p encoding, as in Content-Encoding ("gzip" or "br").
+ */
+const char *content_encoding_name(int encoding);
+
+/**
+ * Writes into \p sidecar (of BUFFER_SIZE bytes) the name of the file holding \p filename precompressed with the
+ * coding \p encoding: \p filename followed by ".gz" or ".br".
+ *
+ * @return 1 on success; 0 if the name does not fit.
+ */
+int content_sidecar(const char *filename, int encoding, char *sidecar);
+
+/**
+ * @return The coding of the precompressed sidecar at \p path (see content_sidecar()); 0 if \p path is not the
+ *         sidecar of a compressible file.
+ */
+int content_sidecar_encoding(const char *path);
+
+#endif /* CONTENT_CACHE_H */
@@ -0,0 +1,948 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * In-memory index of the document root, built by parallel walkers and kept current with inotify.
+ */
+#define _GNU_SOURCE // memrchr()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "config.h"
+#include "docroot_index.h"
+
+#define NUM_SHARDS      64
+#define INITIAL_BUCKETS 64  // Per shard; doubled whenever the shard holds twice as many records
+
+// Changes reported for every watched directory: anything that may change what a request for one of its entries gets
+#define WATCH_MASK      (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | \
+                         IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+// Room for the events read at once by the watcher
+#define EVENTS_SIZE     (64 * 1024)
+
+/**
+ * What is at a path under the document root.
+ */
+struct record {
+    unsigned long hash;
+    long version;           // Given out anew whenever the metadata changes (see docroot_index_lookup())
+
+    mode_t mode;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+
+    int complete;           // For directories: whether all of its entries are indexed, and it is watched
+
+    struct record *next;    // Hash chain
+
+    size_t length;
+    char path[];
+};
+
+struct shard {
+    pthread_rwlock_t lock;
+
+    struct record **buckets;
+    size_t nbuckets;
+    size_t count;
+};
+
+/**
+ * Directories waiting to be walked, shared by the walkers of a tree.
+ */
+struct walk {
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+
+    char **pending;         // Stack of paths (to be freed)
+    int npending;
+    int capacity;
+
+    int busy;               // Walkers reading a directory, which may find more
+    atomic_long paths;      // Paths indexed
+};
+
+static struct shard shards[NUM_SHARDS];
+
+static atomic_int trusted;          // Whether lookups are answered (the index is complete and watched)
+static atomic_int root_complete;    // Same as record::complete, for the document root
+static atomic_int exhausted;        // Whether a record was lost for lack of memory
+static atomic_long versions;        // Last version given out
+
+static int inotify_descriptor = -1;
+
+static pthread_t watcher;
+static int running;
+
+// Directory watched by each watch descriptor (written by the walkers and the watcher)
+static pthread_mutex_t watches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char **watches;
+static int watches_capacity;
+
+static unsigned long hash_path(const char *path, size_t length) {
+    // FNV-1a
+    unsigned long hash = 14695981039346656037UL;
+
+    for(size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) path[i];
+        hash *= 1099511628211UL;
+    }
+
+    return hash;
+}
+
+static struct shard *shard_of(unsigned long hash) {
+    return &shards[hash % NUM_SHARDS];
+}
+
+static struct record **bucket_of(struct shard *shard, unsigned long hash) {
+    return &shard->buckets[(hash / NUM_SHARDS) & (shard->nbuckets - 1)];
+}
+
+/**
+ * @return 0 on success; -1 if memory is exhausted.
+ */
+static int initialize_shards(void) {
+    for(int i = 0; i < NUM_SHARDS; i++) {
+        pthread_rwlock_init(&shards[i].lock, NULL);
+
+        if((shards[i].buckets = (struct record **) calloc(INITIAL_BUCKETS, sizeof(struct record *))) == NULL) {
+            return -1;
+        }
+
+        shards[i].nbuckets = INITIAL_BUCKETS;
+        shards[i].count = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * @return The record of the first \p length bytes of \p path in \p shard (whose lock is held), or NULL.
+ */
+static struct record *find(struct shard *shard, const char *path, size_t length, unsigned long hash) {
+    for(struct record *record = *bucket_of(shard, hash); record != NULL; record = record->next) {
+        if(record->hash == hash && record->length == length && memcmp(record->path, path, length) == 0) {
+            return record;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Doubles the buckets of \p shard (whose lock is held for writing). Without memory, the chains just get longer.
+ */
+static void grow(struct shard *shard) {
+    size_t nbuckets = shard->nbuckets * 2;
+    struct record **buckets = (struct record **) calloc(nbuckets, sizeof(struct record *));
+
+    if(buckets == NULL) {
+        return;
+    }
+
+    struct record **old_buckets = shard->buckets;
+    size_t old_nbuckets = shard->nbuckets;
+
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
+
+    for(size_t i = 0; i < old_nbuckets; i++) {
+        struct record *next;
+
+        for(struct record *record = old_buckets[i]; record != NULL; record = next) {
+            next = record->next;
+
+            struct record **bucket = bucket_of(shard, record->hash);
+
+            record->next = *bucket;
+            *bucket = record;
+        }
+    }
+
+    free(old_buckets);
+}
+
+static int same_time(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/**
+ * Records that \p path is described by \p file_stat, with a new version if anything changed.
+ *
+ * @return 1 if something else than before is at the path now (another file, or another type), so that whatever
+ *         was known below it is out of date; 0 otherwise; -1 if memory is exhausted.
+ */
+static int store(const char *path, size_t length, const struct stat *file_stat) {
+    unsigned long hash = hash_path(path, length);
+    struct shard *shard = shard_of(hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    struct record *record = find(shard, path, length, hash);
+    int replaced = 0;
+
+    if(record == NULL) {
+        if((record = (struct record *) malloc(sizeof(struct record) + length + 1)) == NULL) {
+            pthread_rwlock_unlock(&shard->lock);
+
+            atomic_store(&exhausted, 1);
+            return -1;
+        }
+
+        record->hash = hash;
+        record->complete = 0;
+        record->length = length;
+        memcpy(record->path, path, length);
+        record->path[length] = '\0';
+
+        struct record **bucket = bucket_of(shard, hash);
+
+        record->next = *bucket;
+        *bucket = record;
+
+        if(++shard->count > 2 * shard->nbuckets) {
+            grow(shard);
+        }
+    }
+    else if(record->mode == file_stat->st_mode && record->inode == file_stat->st_ino && record->size == file_stat->st_size &&
+            same_time(&record->mtime, &file_stat->st_mtim) && same_time(&record->ctime, &file_stat->st_ctim)) {
+        pthread_rwlock_unlock(&shard->lock);
+        return 0;
+    }
+    else if(record->inode != file_stat->st_ino || (record->mode & S_IFMT) != (file_stat->st_mode & S_IFMT)) {
+        record->complete = 0;
+        replaced = 1;
+    }
+
+    record->version = atomic_fetch_add(&versions, 1) + 1;
+    record->mode = file_stat->st_mode;
+    record->inode = file_stat->st_ino;
+    record->size = file_stat->st_size;
+    record->mtime = file_stat->st_mtim;
+    record->ctime = file_stat->st_ctim;
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    return replaced;
+}
+
+/**
+ * Copies what the index knows about the first \p length bytes of \p path.
+ *
+ * @return 1 if the path has a record; 0 otherwise.
+ */
+static int describe(const char *path, size_t length, long *version, mode_t *mode, int *complete) {
+    unsigned long hash = hash_path(path, length);
+    struct shard *shard = shard_of(hash);
+
+    pthread_rwlock_rdlock(&shard->lock);
+
+    struct record *record = find(shard, path, length, hash);
+
+    if(record != NULL) {
+        *version = record->version;
+        *mode = record->mode;
+        *complete = record->complete;
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    return record != NULL;
+}
+
+/**
+ * Marks the directory \p path as indexed whole.
+ */
+static void set_complete(const char *path) {
+    if(strcmp(path, ".") == 0) {
+        atomic_store(&root_complete, 1);
+        return;
+    }
+
+    size_t length = strlen(path);
+    unsigned long hash = hash_path(path, length);
+    struct shard *shard = shard_of(hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    struct record *record = find(shard, path, length, hash);
+
+    if(record != NULL && S_ISDIR(record->mode)) {
+        record->complete = 1;
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+/**
+ * @return 1 if \p path is \p prefix, or below it.
+ */
+static int below(const char *path, size_t length, const char *prefix, size_t prefix_length) {
+    return length >= prefix_length && memcmp(path, prefix, prefix_length) == 0 && (length == prefix_length || path[prefix_length] == '/');
+}
+
+/**
+ * Forgets \p path and, with \p subtree, everything below it (the directory was moved or replaced, so no event comes
+ * for its entries), including the watches of its directories. Only the record of \p path itself is kept if
+ * \p keep is set.
+ */
+static void forget(const char *path, int subtree, int keep) {
+    size_t length = strlen(path);
+    unsigned long hash = hash_path(path, length);
+
+    if(!keep) {
+        struct shard *shard = shard_of(hash);
+
+        pthread_rwlock_wrlock(&shard->lock);
+
+        for(struct record **link = bucket_of(shard, hash); *link != NULL; link = &(*link)->next) {
+            struct record *record = *link;
+
+            if(record->hash == hash && record->length == length && memcmp(record->path, path, length) == 0) {
+                *link = record->next;
+                shard->count--;
+                free(record);
+                break;
+            }
+        }
+
+        pthread_rwlock_unlock(&shard->lock);
+    }
+
+    if(!subtree) {
+        return;
+    }
+
+    // Below a directory, any shard may hold records
+    for(int i = 0; i < NUM_SHARDS; i++) {
+        struct shard *shard = &shards[i];
+
+        pthread_rwlock_wrlock(&shard->lock);
+
+        for(size_t j = 0; j < shard->nbuckets; j++) {
+            struct record **link = &shard->buckets[j];
+
+            while(*link != NULL) {
+                struct record *record = *link;
+
+                if(record->length > length && below(record->path, record->length, path, length)) {
+                    *link = record->next;
+                    shard->count--;
+                    free(record);
+                }
+                else {
+                    link = &record->next;
+                }
+            }
+        }
+
+        pthread_rwlock_unlock(&shard->lock);
+    }
+
+    pthread_mutex_lock(&watches_mutex);
+
+    for(int wd = 0; wd < watches_capacity; wd++) {
+        if(watches[wd] != NULL && below(watches[wd], strlen(watches[wd]), path, length)) {
+            inotify_rm_watch(inotify_descriptor, wd);
+
+            free(watches[wd]);
+            watches[wd] = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&watches_mutex);
+}
+
+/**
+ * Forgets every record and every watch, before the index is built again.
+ */
+static void forget_all(void) {
+    for(int i = 0; i < NUM_SHARDS; i++) {
+        struct shard *shard = &shards[i];
+
+        pthread_rwlock_wrlock(&shard->lock);
+
+        for(size_t j = 0; j < shard->nbuckets; j++) {
+            struct record *next;
+
+            for(struct record *record = shard->buckets[j]; record != NULL; record = next) {
+                next = record->next;
+                free(record);
+            }
+
+            shard->buckets[j] = NULL;
+        }
+
+        shard->count = 0;
+
+        pthread_rwlock_unlock(&shard->lock);
+    }
+
+    pthread_mutex_lock(&watches_mutex);
+
+    for(int wd = 0; wd < watches_capacity; wd++) {
+        free(watches[wd]);
+        watches[wd] = NULL;
+    }
+
+    pthread_mutex_unlock(&watches_mutex);
+
+    atomic_store(&root_complete, 0);
+}
+
+/**
+ * Remembers that \p wd watches the directory \p path.
+ *
+ * @return 0 on success; -1 if memory is exhausted.
+ */
+static int remember_watch(int wd, const char *path) {
+    char *copy = strdup(path);
+
+    if(copy == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&watches_mutex);
+
+    if(wd >= watches_capacity) {
+        int capacity = (watches_capacity > 0) ? watches_capacity : 1024;
+
+        while(capacity <= wd) {
+            capacity *= 2;
+        }
+
+        char **grown = (char **) realloc(watches, capacity * sizeof(char *));
+
+        if(grown == NULL) {
+            pthread_mutex_unlock(&watches_mutex);
+
+            free(copy);
+            return -1;
+        }
+
+        memset(grown + watches_capacity, 0, (capacity - watches_capacity) * sizeof(char *));
+
+        watches = grown;
+        watches_capacity = capacity;
+    }
+
+    // The same directory watched again (after a move) keeps its descriptor
+    free(watches[wd]);
+    watches[wd] = copy;
+
+    pthread_mutex_unlock(&watches_mutex);
+
+    return 0;
+}
+
+/**
+ * @return A copy (to be freed) of the directory watched by \p wd, or NULL.
+ */
+static char *watched_directory(int wd) {
+    char *path = NULL;
+
+    pthread_mutex_lock(&watches_mutex);
+
+    if(wd >= 0 && wd < watches_capacity && watches[wd] != NULL) {
+        path = strdup(watches[wd]);
+    }
+
+    pthread_mutex_unlock(&watches_mutex);
+
+    return path;
+}
+
+static void forget_watch(int wd) {
+    pthread_mutex_lock(&watches_mutex);
+
+    if(wd >= 0 && wd < watches_capacity) {
+        free(watches[wd]);
+        watches[wd] = NULL;
+    }
+
+    pthread_mutex_unlock(&watches_mutex);
+}
+
+/**
+ * @return The path (to be freed) of \p name in \p directory, as in a request; NULL if memory is exhausted.
+ */
+static char *join(const char *directory, const char *name) {
+    if(strcmp(directory, ".") == 0) {
+        return strdup(name);
+    }
+
+    size_t directory_length = strlen(directory);
+    size_t name_length = strlen(name);
+    char *path = (char *) malloc(directory_length + 1 + name_length + 1);
+
+    if(path != NULL) {
+        memcpy(path, directory, directory_length);
+        path[directory_length] = '/';
+        memcpy(path + directory_length + 1, name, name_length + 1);
+    }
+
+    return path;
+}
+
+/**
+ * Hands the directory \p path (to be freed) to the walkers of \p walk.
+ */
+static void push(struct walk *walk, char *path) {
+    pthread_mutex_lock(&walk->mutex);
+
+    if(walk->npending == walk->capacity) {
+        int capacity = (walk->capacity > 0) ? walk->capacity * 2 : 256;
+        char **grown = (char **) realloc(walk->pending, capacity * sizeof(char *));
+
+        if(grown == NULL) {
+            pthread_mutex_unlock(&walk->mutex);
+
+            // The directory stays incomplete
+            atomic_store(&exhausted, 1);
+            free(path);
+            return;
+        }
+
+        walk->pending = grown;
+        walk->capacity = capacity;
+    }
+
+    walk->pending[walk->npending++] = path;
+
+    pthread_cond_signal(&walk->changed);
+    pthread_mutex_unlock(&walk->mutex);
+}
+
+/**
+ * Watches the directory \p path and indexes its entries, handing its subdirectories to the walkers of \p walk.
+ * A directory that cannot be watched or read stays incomplete: lookups below it are not answered.
+ */
+static void walk_directory(struct walk *walk, const char *path) {
+    // The watch comes before the read, so that no change after the read goes unnoticed
+    int wd = inotify_add_watch(inotify_descriptor, path, WATCH_MASK);
+
+    if(wd == -1) {
+        if(errno == ENOSPC) {
+            static atomic_flag reported = ATOMIC_FLAG_INIT;
+
+            if(!atomic_flag_test_and_set(&reported)) {
+                fprintf(stderr, "Out of inotify watches (see /proc/sys/fs/inotify/max_user_watches): part of the document root is not indexed\n");
+            }
+        }
+
+        return;
+    }
+
+    if(remember_watch(wd, path) == -1) {
+        atomic_store(&exhausted, 1);
+        return;
+    }
+
+    int descriptor = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *directory;
+
+    if(descriptor == -1 || (directory = fdopendir(descriptor)) == NULL) {
+        if(descriptor != -1) {
+            close(descriptor);
+        }
+
+        return;
+    }
+
+    struct dirent *entry;
+    int lost = 0;
+
+    while((entry = readdir(directory)) != NULL) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        struct stat file_stat;
+
+        // Entries removed in the meantime are reported by the watch
+        if(fstatat(descriptor, entry->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+
+        char *child = join(path, entry->d_name);
+
+        if(child == NULL || store(child, strlen(child), &file_stat) == -1) {
+            free(child);
+            lost = 1;
+            continue;
+        }
+
+        atomic_fetch_add(&walk->paths, 1);
+
+        if(S_ISDIR(file_stat.st_mode)) {
+            push(walk, child);
+        }
+        else {
+            free(child);
+        }
+    }
+
+    closedir(directory);
+
+    if(!lost) {
+        set_complete(path);
+    }
+}
+
+static void *walk_loop(void *argument) {
+    struct walk *walk = (struct walk *) argument;
+
+    pthread_mutex_lock(&walk->mutex);
+
+    while(1) {
+        // Nothing to walk now, but busy walkers may find more
+        while(walk->npending == 0 && walk->busy > 0) {
+            pthread_cond_wait(&walk->changed, &walk->mutex);
+        }
+
+        if(walk->npending == 0) {
+            break;
+        }
+
+        char *path = walk->pending[--walk->npending];
+
+        walk->busy++;
+
+        pthread_mutex_unlock(&walk->mutex);
+
+        walk_directory(walk, path);
+        free(path);
+
+        pthread_mutex_lock(&walk->mutex);
+
+        if(--walk->busy == 0 && walk->npending == 0) {
+            pthread_cond_broadcast(&walk->changed);
+        }
+    }
+
+    pthread_mutex_unlock(&walk->mutex);
+
+    return NULL;
+}
+
+/**
+ * Indexes the directory \p root and everything below it with \p nthreads walkers (the caller is one of them).
+ *
+ * @return The number of paths indexed; -1 if memory is exhausted.
+ */
+static long walk_tree(const char *root, int nthreads) {
+    struct walk walk;
+
+    pthread_mutex_init(&walk.mutex, NULL);
+    pthread_cond_init(&walk.changed, NULL);
+
+    walk.pending = NULL;
+    walk.npending = 0;
+    walk.capacity = 0;
+    walk.busy = 0;
+    atomic_init(&walk.paths, 0);
+
+    char *path = strdup(root);
+
+    if(path == NULL) {
+        return -1;
+    }
+
+    push(&walk, path);
+
+    pthread_t *threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    int started = 0;
+
+    while(threads != NULL && started < nthreads - 1 && pthread_create(&threads[started], NULL, walk_loop, &walk) == 0) {
+        started++;
+    }
+
+    walk_loop(&walk);
+
+    for(int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    free(walk.pending);
+
+    pthread_cond_destroy(&walk.changed);
+    pthread_mutex_destroy(&walk.mutex);
+
+    return atomic_load(&walk.paths);
+}
+
+static int walkers(void) {
+    return (config.threads > 0) ? config.threads : sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+/**
+ * Indexes the whole document root (with the index not trusted meanwhile).
+ *
+ * @return The number of paths indexed; -1 if the index is incomplete.
+ */
+static long build(void) {
+    atomic_store(&exhausted, 0);
+
+    long paths = walk_tree(".", walkers());
+
+    if(paths == -1 || !atomic_load(&root_complete) || atomic_load(&exhausted)) {
+        return -1;
+    }
+
+    return paths;
+}
+
+/**
+ * Starts over after events were lost: every watch goes with the old inotify instance.
+ */
+static void rebuild(void) {
+    atomic_store(&trusted, 0);
+
+    close(inotify_descriptor);
+    forget_all();
+
+    if((inotify_descriptor = inotify_init1(IN_CLOEXEC)) == -1) {
+        perror("inotify_init1");
+        return;
+    }
+
+    if(build() == -1) {
+        fprintf(stderr, "Cannot index the document root again: paths are checked on disk from now on\n");
+        return;
+    }
+
+    atomic_store(&trusted, 1);
+}
+
+/**
+ * Brings the record of \p path up to date after an event \p mask about it.
+ */
+static void refresh(const char *path, uint32_t mask) {
+    struct stat file_stat;
+
+    if(fstatat(AT_FDCWD, path, &file_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+        // A directory moved away takes its entries along, without an event for them
+        forget(path, (mask & IN_MOVED_FROM) != 0, 0);
+        return;
+    }
+
+    int replaced = store(path, strlen(path), &file_stat);
+
+    if(replaced == -1) {
+        fprintf(stderr, "Out of memory for the index of the document root: paths are checked on disk from now on\n");
+        atomic_store(&trusted, 0);
+        return;
+    }
+
+    if(replaced == 1) {
+        forget(path, 1, 1);
+    }
+
+    // New directories (or directories moved in) are walked here, one at a time
+    long version;
+    mode_t mode;
+    int complete;
+
+    if(S_ISDIR(file_stat.st_mode) && describe(path, strlen(path), &version, &mode, &complete) && !complete) {
+        walk_tree(path, 1);
+    }
+}
+
+static void handle(const struct inotify_event *event) {
+    if(event->mask & IN_IGNORED) {
+        forget_watch(event->wd);
+        return;
+    }
+
+    char *directory = watched_directory(event->wd);
+
+    if(directory == NULL) {
+        return;
+    }
+
+    if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // Other directories are reported by the directory above them
+        if(strcmp(directory, ".") == 0) {
+            fprintf(stderr, "The document root went away: paths are checked on disk from now on\n");
+            atomic_store(&trusted, 0);
+        }
+    }
+    else if(event->len > 0) {
+        char *path = join(directory, event->name);
+
+        if(path != NULL) {
+            refresh(path, event->mask);
+            free(path);
+        }
+    }
+
+    free(directory);
+}
+
+static void *watch_loop(void *argument) {
+    static char events[EVENTS_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while(1) {
+        ssize_t length = read(inotify_descriptor, events, EVENTS_SIZE);
+
+        if(length <= 0) {
+            if(length == -1 && errno == EINTR) {
+                continue;
+            }
+
+            perror("read");
+            atomic_store(&trusted, 0);
+            break;
+        }
+
+        for(char *event = events; event < events + length; event += sizeof(struct inotify_event) + ((struct inotify_event *) event)->len) {
+            // Events were lost: whatever was read with them belongs to the watches dropped by the rebuild
+            if(((struct inotify_event *) event)->mask & IN_Q_OVERFLOW) {
+                rebuild();
+                break;
+            }
+
+            handle((struct inotify_event *) event);
+        }
+    }
+
+    return NULL;
+}
+
+int docroot_index_start(void) {
+    if(running || !config.index) {
+        return 0;
+    }
+
+    if(initialize_shards() == -1) {
+        return -1;
+    }
+
+    if((inotify_descriptor = inotify_init1(IN_CLOEXEC)) == -1) {
+        perror("inotify_init1");
+        return -1;
+    }
+
+    struct timespec start;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    long paths = build();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if(paths == -1) {
+        forget_all();
+        close(inotify_descriptor);
+        inotify_descriptor = -1;
+        return -1;
+    }
+
+    // Changes made while walking were queued by the watches, and are applied from here on
+    if(pthread_create(&watcher, NULL, watch_loop, NULL) != 0) {
+        return -1;
+    }
+
+    pthread_detach(watcher);
+
+    running = 1;
+
+    atomic_store(&trusted, 1);
+
+    printf("Indexed %ld paths of the document root in %.3f seconds\n", paths, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    return 0;
+}
+
+/**
+ * @return 1 if \p path is in its plain form: relative, with components separated by single slashes, none of them
+ *         "." or "..".
+ */
+static int plain(const char *path, size_t length) {
+    if(length == 0 || path[0] == '/' || path[length - 1] == '/') {
+        return 0;
+    }
+
+    const char *component = path;
+    const char *end = path + length;
+
+    while(component < end) {
+        const char *slash = memchr(component, '/', end - component);
+        size_t component_length = (slash != NULL) ? (size_t) (slash - component) : (size_t) (end - component);
+
+        if(component_length == 0 || (component_length == 1 && component[0] == '.') || (component_length == 2 && component[0] == '.' && component[1] == '.')) {
+            return 0;
+        }
+
+        component += component_length + 1;
+    }
+
+    return 1;
+}
+
+long docroot_index_lookup(const char *path, mode_t *mode) {
+    if(!atomic_load(&trusted)) {
+        return INDEX_UNKNOWN;
+    }
+
+    size_t length = strlen(path);
+
+    if(!plain(path, length)) {
+        return INDEX_UNKNOWN;
+    }
+
+    long version;
+    mode_t found;
+    int complete;
+
+    if(describe(path, length, &version, &found, &complete)) {
+        // Links are followed by open(), but not watched here
+        if(S_ISLNK(found)) {
+            return INDEX_UNKNOWN;
+        }
+
+        if(mode != NULL) {
+            *mode = found;
+        }
+
+        return version;
+    }
+
+    // Nothing at the path: that is certain if the closest path above it is a directory indexed whole
+    while(1) {
+        const char *slash = memrchr(path, '/', length);
+
+        if(slash == NULL) {
+            return atomic_load(&root_complete) ? INDEX_ABSENT : INDEX_UNKNOWN;
+        }
+
+        length = slash - path;
+
+        if(describe(path, length, &version, &found, &complete)) {
+            if(S_ISDIR(found)) {
+                return complete ? INDEX_ABSENT : INDEX_UNKNOWN;
+            }
+
+            // Below a file, open() fails with ENOTDIR
+            return S_ISLNK(found) ? INDEX_UNKNOWN : INDEX_ABSENT;
+        }
+    }
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef DOCROOT_INDEX_H
+#define DOCROOT_INDEX_H
+
+#include <sys/types.h>
+
+// Answers of docroot_index_lookup() other than the version of a path
+#define INDEX_UNKNOWN   (-1L)   // The index cannot tell: the filesystem must be asked
+#define INDEX_ABSENT    0L      // Nothing is at the path (a request for it is a 404)
+
+/**
+ * Indexes the document root (the working directory) in memory: the type, permissions, size and modification time of
+ * every path under it. Directories are walked in parallel by config.threads threads (0 for one per CPU), and each one
+ * is watched with inotify, so that a thread of its own updates the index within milliseconds of any change.
+ *
+ * Returns once the index is complete. Does nothing if it is running already, or if the index is disabled (see
+ * config.h). Threads do not survive fork(): the processes of fork mode do without the index.
+ *
+ * @return 0 on success; -1 if the document root cannot be indexed (then every lookup is INDEX_UNKNOWN).
+ */
+int docroot_index_start(void);
+
+/**
+ * Looks \p path (relative to the document root, as in a request) up in the index, without any system call.
+ * Symbolic links, and paths not in their plain form ("a/b", without "." or ".." components), are not answered.
+ *
+ * @return The version of \p path, which is positive and changes whenever anything at the path changes; its type and
+ *         permissions are stored in \p mode (unless NULL). INDEX_ABSENT if nothing is at the path, or INDEX_UNKNOWN.
+ */
+long docroot_index_lookup(const char *path, mode_t *mode);
+
+#endif /* DOCROOT_INDEX_H */
@@ -0,0 +1,663 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Bounded, sharded cache of open descriptors and metadata, keyed by path.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "clients_common.h"
+#include "file_cache.h"
+#include "content_cache.h"
+#include "docroot_index.h"
+#include "networking.h"
+
+#define NUM_SHARDS      16
+#define NUM_BUCKETS     256 // Per shard
+
+struct shard {
+    pthread_mutex_t mutex;
+
+    struct file_entry *buckets[NUM_BUCKETS];
+
+    // Most recently used first
+    struct file_entry *lru_head;
+    struct file_entry *lru_tail;
+
+    int size;
+    int descriptors;    // Entries holding an open descriptor
+};
+
+static struct shard shards[NUM_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+// Descriptors kept open over all the shards (see file_cache_descriptors())
+static int descriptor_budget;
+
+static void initialize_shards(void) {
+    for(int i = 0; i < NUM_SHARDS; i++) {
+        memset(&shards[i], 0, sizeof(struct shard));
+        pthread_mutex_init(&shards[i].mutex, NULL);
+    }
+
+    struct rlimit descriptors;
+
+    descriptor_budget = FILE_CACHE_CAPACITY;
+
+    if(getrlimit(RLIMIT_NOFILE, &descriptors) == 0 && descriptors.rlim_cur != RLIM_INFINITY && descriptors.rlim_cur / FILE_CACHE_DESCRIPTOR_SHARE < FILE_CACHE_CAPACITY) {
+        descriptor_budget = (int) (descriptors.rlim_cur / FILE_CACHE_DESCRIPTOR_SHARE);
+    }
+
+    // At least one per shard
+    if(descriptor_budget < NUM_SHARDS) {
+        descriptor_budget = NUM_SHARDS;
+    }
+}
+
+static unsigned long hash_path(const char *path) {
+    // FNV-1a
+    unsigned long hash = 14695981039346656037UL;
+
+    for(; *path != '\0'; path++) {
+        hash ^= (unsigned char) *path;
+        hash *= 1099511628211UL;
+    }
+
+    return hash;
+}
+
+static struct shard *shard_of(unsigned long hash) {
+    return &shards[hash % NUM_SHARDS];
+}
+
+static struct file_entry **bucket_of(struct shard *shard, unsigned long hash) {
+    return &shard->buckets[(hash / NUM_SHARDS) % NUM_BUCKETS];
+}
+
+/**
+ * Derives the entity tag and the Last-Modified date of \p entry from its metadata. Any change to the file that the
+ * cache notices (see still_valid()) also changes its entity tag.
+ */
+static void set_validators(struct file_entry *entry) {
+    unsigned long long modified = entry->mtime.tv_sec * 1000000000ULL + entry->mtime.tv_nsec;
+
+    snprintf(entry->etag, ETAG_SIZE, "\"%lx-%llx-%llx\"", (unsigned long) entry->inode, (unsigned long long) entry->size, modified);
+
+    struct tm date;
+
+    if(gmtime_r(&entry->mtime.tv_sec, &date) == NULL || strftime(entry->last_modified, HTTP_DATE_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &date) == 0) {
+        entry->last_modified[0] = '\0';
+    }
+}
+
+/**
+ * Opens \p path and fills a new entry with the outcome. Called without any lock held. The docroot index tells 403s
+ * and 404s without the filesystem; otherwise, unless \p blocking, nothing is done.
+ *
+ * @return The new entry; NULL if it would block, or memory is exhausted.
+ */
+static struct file_entry *resolve(const char *path, unsigned long hash, int blocking) {
+    // The index is read first: a change while the path is opened then shows as a newer version
+    mode_t mode;
+    long version = docroot_index_lookup(path, &mode);
+    int status = STATUS_OK;
+
+    if(version == INDEX_ABSENT) {
+        status = STATUS_404;
+    }
+    else if(version != INDEX_UNKNOWN && !S_ISREG(mode)) {
+        status = STATUS_403;
+    }
+    else if(!blocking) {
+        return NULL;
+    }
+
+    struct file_entry *entry = (struct file_entry *) malloc(sizeof(struct file_entry));
+
+    if(entry == NULL) {
+        return NULL;
+    }
+
+    if((entry->path = strdup(path)) == NULL) {
+        free(entry);
+        return NULL;
+    }
+
+    entry->hash = hash;
+    entry->status = status;
+    entry->indexed = (status != STATUS_OK);
+    entry->fd = -1;
+    entry->size = 0;
+    entry->inode = 0;
+    entry->device = 0;
+    memset(&entry->mtime, 0, sizeof(struct timespec));
+    atomic_init(&entry->checked, time(NULL));
+    atomic_init(&entry->version, version);
+    atomic_init(&entry->references, 1);
+
+    entry->etag[0] = '\0';
+    entry->last_modified[0] = '\0';
+
+    for(int i = 0; i < FILE_CACHE_PROTOCOLS; i++) {
+        atomic_init(&entry->headers[i], NULL);
+        atomic_init(&entry->not_modified[i], NULL);
+        atomic_init(&entry->encoded[i], NULL);
+    }
+
+    struct stat file_stat;
+
+    if(status != STATUS_OK) {
+        return entry;
+    }
+
+    // Only what is at the path makes a 403 or 404: other errors (out of descriptors or memory) pass
+    if((entry->fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        entry->status = (errno == ENOENT || errno == ENOTDIR) ? STATUS_404 : (errno == EACCES || errno == EPERM) ? STATUS_403 : STATUS_503;
+    }
+    else if(fstat(entry->fd, &file_stat) == -1) {
+        close(entry->fd);
+        entry->fd = -1;
+        entry->status = STATUS_503;
+    }
+    else if(!S_ISREG(file_stat.st_mode)) {
+        // Directories and special files are never served
+        close(entry->fd);
+        entry->fd = -1;
+        entry->status = STATUS_403;
+    }
+    else {
+        entry->size = file_stat.st_size;
+        entry->mtime = file_stat.st_mtim;
+        entry->inode = file_stat.st_ino;
+        entry->device = file_stat.st_dev;
+
+        set_validators(entry);
+    }
+
+    return entry;
+}
+
+/**
+ * @return 1 if \p entry still describes what is on disk at its path.
+ */
+static int still_valid(struct file_entry *entry) {
+    struct stat file_stat;
+
+    if(stat(entry->path, &file_stat) == -1) {
+        return entry->status == STATUS_404 && (errno == ENOENT || errno == ENOTDIR);
+    }
+
+    if(entry->status != STATUS_OK) {
+        // Something appeared at the path, or its permissions may have changed
+        return 0;
+    }
+
+    return file_stat.st_ino == entry->inode && file_stat.st_dev == entry->device && file_stat.st_size == entry->size && file_stat.st_mtim.tv_sec == entry->mtime.tv_sec && file_stat.st_mtim.tv_nsec == entry->mtime.tv_nsec;
+}
+
+static void lru_unlink(struct shard *shard, struct file_entry *entry) {
+    if(entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    }
+    else {
+        shard->lru_head = entry->lru_next;
+    }
+
+    if(entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }
+    else {
+        shard->lru_tail = entry->lru_prev;
+    }
+}
+
+static void lru_push_front(struct shard *shard, struct file_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+
+    if(shard->lru_head != NULL) {
+        shard->lru_head->lru_prev = entry;
+    }
+
+    shard->lru_head = entry;
+
+    if(shard->lru_tail == NULL) {
+        shard->lru_tail = entry;
+    }
+}
+
+/**
+ * Removes \p entry from its shard. The caller holds the shard lock, and is responsible for dropping the cache's reference.
+ */
+static void detach(struct shard *shard, struct file_entry *entry) {
+    struct file_entry **link = bucket_of(shard, entry->hash);
+
+    while(*link != entry) {
+        link = &(*link)->next;
+    }
+
+    *link = entry->next;
+
+    lru_unlink(shard, entry);
+    shard->size--;
+
+    if(entry->fd != -1) {
+        shard->descriptors--;
+    }
+}
+
+static struct file_entry *find(struct shard *shard, const char *path, unsigned long hash) {
+    for(struct file_entry *entry = *bucket_of(shard, hash); entry != NULL; entry = entry->next) {
+        if(entry->hash == hash && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @return The entry cached for \p path with a new reference, or NULL.
+ */
+static struct file_entry *lookup(struct shard *shard, const char *path, unsigned long hash) {
+    struct file_entry *entry;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    if((entry = find(shard, path, hash)) != NULL) {
+        atomic_fetch_add(&entry->references, 1);
+
+        lru_unlink(shard, entry);
+        lru_push_front(shard, entry);
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    return entry;
+}
+
+static int fresh(struct file_entry *entry) {
+    // While the docroot index knows the path, the entry holds until anything changes there. A 403 or 404 that came
+    // from an error of open(2) instead is checked again after the TTL, as nothing may change there to end it.
+    long version = (entry->status == STATUS_OK || entry->indexed) ? docroot_index_lookup(entry->path, NULL) : INDEX_UNKNOWN;
+
+    if(version != INDEX_UNKNOWN) {
+        return version == atomic_load(&entry->version);
+    }
+
+    // time(2) is served by the vDSO, without entering the kernel
+    return time(NULL) - atomic_load(&entry->checked) < FILE_CACHE_TTL;
+}
+
+/**
+ * Caches \p resolved in \p shard in place of \p stale (if not NULL), on which the caller holds a reference.
+ *
+ * @return A referenced entry for the path: \p resolved, or the one another thread cached concurrently.
+ */
+static struct file_entry *insert(struct shard *shard, struct file_entry *resolved, struct file_entry *stale) {
+    struct file_entry *evicted = NULL;      // Linked through next, once out of their bucket
+
+    pthread_mutex_lock(&shard->mutex);
+
+    struct file_entry *current = find(shard, resolved->path, resolved->hash);
+
+    if(current != NULL && current != stale) {
+        // Another thread resolved the path concurrently: keep its entry
+        atomic_fetch_add(&current->references, 1);
+
+        pthread_mutex_unlock(&shard->mutex);
+
+        file_cache_release(resolved);
+
+        if(stale != NULL) {
+            file_cache_release(stale);
+        }
+
+        return current;
+    }
+
+    if(current != NULL) {
+        detach(shard, current);
+    }
+    else if(shard->size >= FILE_CACHE_CAPACITY / NUM_SHARDS) {
+        evicted = shard->lru_tail;
+        detach(shard, evicted);
+        evicted->next = NULL;
+    }
+
+    // So are the least recently used descriptors, to stay within the share of the descriptor limit
+    struct file_entry *previous;
+
+    for(struct file_entry *victim = shard->lru_tail; resolved->fd != -1 && victim != NULL && shard->descriptors >= descriptor_budget / NUM_SHARDS; victim = previous) {
+        previous = victim->lru_prev;
+
+        if(victim->fd != -1) {
+            detach(shard, victim);
+
+            victim->next = evicted;
+            evicted = victim;
+        }
+    }
+
+    // One reference for the cache, one for the caller
+    atomic_fetch_add(&resolved->references, 1);
+
+    struct file_entry **bucket = bucket_of(shard, resolved->hash);
+
+    resolved->next = *bucket;
+    *bucket = resolved;
+
+    lru_push_front(shard, resolved);
+    shard->size++;
+
+    if(resolved->fd != -1) {
+        shard->descriptors++;
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    if(current != NULL) {
+        // The cache's reference to the stale entry
+        file_cache_release(current);
+    }
+
+    if(stale != NULL) {
+        // Our own reference to the stale entry
+        file_cache_release(stale);
+    }
+
+    while(evicted != NULL) {
+        struct file_entry *next = evicted->next;
+
+        file_cache_release(evicted);
+        evicted = next;
+    }
+
+    return resolved;
+}
+
+struct file_entry *file_cache_peek(const char *path) {
+    pthread_once(&shards_once, initialize_shards);
+
+    unsigned long hash = hash_path(path);
+    struct shard *shard = shard_of(hash);
+    struct file_entry *entry = lookup(shard, path, hash);
+
+    if(entry != NULL && fresh(entry)) {
+        return entry;
+    }
+
+    // Only what the docroot index tells (403s and 404s) is resolved here
+    struct file_entry *resolved = resolve(path, hash, 0);
+
+    if(resolved == NULL) {
+        if(entry != NULL) {
+            file_cache_release(entry);
+        }
+
+        return NULL;
+    }
+
+    return insert(shard, resolved, entry);
+}
+
+struct file_entry *file_cache_acquire(const char *path) {
+    pthread_once(&shards_once, initialize_shards);
+
+    unsigned long hash = hash_path(path);
+    struct shard *shard = shard_of(hash);
+    struct file_entry *entry = lookup(shard, path, hash);
+    struct file_entry *stale = NULL;
+
+    if(entry != NULL) {
+        // Fresh entries are answered without any system call
+        if(fresh(entry)) {
+            return entry;
+        }
+
+        long version = docroot_index_lookup(path, NULL);
+
+        if(still_valid(entry)) {
+            atomic_store(&entry->checked, time(NULL));
+            atomic_store(&entry->version, version);
+            return entry;
+        }
+
+        stale = entry;
+    }
+
+    // Miss (or stale entry): touch the filesystem without holding the lock
+    struct file_entry *resolved = resolve(path, hash, 1);
+
+    if(resolved == NULL || resolved->status == STATUS_503) {
+        // The stale entry stays cached: it is checked again next time
+        if(stale != NULL) {
+            file_cache_release(stale);
+        }
+
+        return resolved;
+    }
+
+    return insert(shard, resolved, stale);
+}
+
+int file_cache_descriptors(void) {
+    pthread_once(&shards_once, initialize_shards);
+
+    return descriptor_budget;
+}
+
+void file_cache_limit_descriptors(int limit) {
+    pthread_once(&shards_once, initialize_shards);
+
+    if(limit / FILE_CACHE_DESCRIPTOR_SHARE < descriptor_budget) {
+        descriptor_budget = (limit / FILE_CACHE_DESCRIPTOR_SHARE > NUM_SHARDS) ? limit / FILE_CACHE_DESCRIPTOR_SHARE : NUM_SHARDS;
+    }
+}
+
+/**
+ * @return Slot of \p protocol in file_entry::headers, or -1 if its headers are not kept.
+ */
+static int protocol_slot(const char *protocol) {
+    if(strcmp(protocol, "HTTP/1.1") == 0) {
+        return 1;
+    }
+
+    if(strcmp(protocol, "HTTP/1.0") == 0) {
+        return 0;
+    }
+
+    return -1;
+}
+
+/**
+ * Adds \p field (a whole "Name: value" line) at the end of the header of \p length bytes in \p buffer, which has
+ * BUFFER_SIZE bytes.
+ *
+ * @return The length of the header with the field; \p length if it does not fit.
+ */
+static size_t add_field(char *buffer, size_t length, const char *field) {
+    size_t field_length = strlen(field);
+
+    if(length < 2 || length + field_length >= BUFFER_SIZE) {
+        return length;
+    }
+
+    // Before the blank line ending the header
+    memcpy(buffer + length - 2, field, field_length);
+    memcpy(buffer + length - 2 + field_length, "\r\n", 3);
+
+    return length + field_length;
+}
+
+/**
+ * Adds the validators of \p entry (see set_validators()) to the header of \p length bytes in \p buffer, and the
+ * Vary field if the file (or the file it was compressed from) may also be sent in a content coding.
+ *
+ * @return The new length.
+ */
+static size_t add_validators(struct file_entry *entry, char *buffer, size_t length) {
+    char field[ETAG_SIZE + HTTP_DATE_SIZE + 32];
+
+    if(content_compressible(entry->path) || content_sidecar_encoding(entry->path) != 0) {
+        length = add_field(buffer, length, "Vary: Accept-Encoding\r\n");
+    }
+
+    snprintf(field, sizeof(field), "ETag: %s\r\n", entry->etag);
+    length = add_field(buffer, length, field);
+
+    if(entry->last_modified[0] != '\0') {
+        snprintf(field, sizeof(field), "Last-Modified: %s\r\n", entry->last_modified);
+        length = add_field(buffer, length, field);
+    }
+
+    return length;
+}
+
+/**
+ * Copies the header of \p length bytes in \p buffer to \p slot, unless another thread has published one there first.
+ *
+ * @return The header in \p slot; NULL if memory is exhausted.
+ */
+static struct file_header *publish(_Atomic(struct file_header *) *slot, const char *buffer, size_t length) {
+    struct file_header *header = (struct file_header *) malloc(sizeof(struct file_header) + length + 1);
+
+    if(header == NULL) {
+        return NULL;
+    }
+
+    header->length = length;
+    memcpy(header->data, buffer, length);
+    header->data[length] = '\0';
+
+    // Several threads may build the header at once: the first one to publish it wins
+    struct file_header *expected = NULL;
+
+    if(!atomic_compare_exchange_strong_explicit(slot, &expected, header, memory_order_acq_rel, memory_order_acquire)) {
+        free(header);
+        return expected;
+    }
+
+    return header;
+}
+
+const struct file_header *file_cache_header(struct file_entry *entry, char *protocol) {
+    int slot = protocol_slot(protocol);
+
+    if(slot == -1) {
+        return NULL;
+    }
+
+    struct file_header *header = atomic_load_explicit(&entry->headers[slot], memory_order_acquire);
+
+    if(header != NULL) {
+        return header;
+    }
+
+    char temporary_buffer[BUFFER_SIZE];
+
+    if(entry->status == STATUS_404) {
+        get_404(temporary_buffer, entry->path, protocol);
+    }
+    else if(entry->status == STATUS_403) {
+        get_403(temporary_buffer, entry->path, protocol);
+    }
+    else if(entry->status == STATUS_503) {
+        get_503(temporary_buffer, protocol);
+    }
+    else {
+        get_200(temporary_buffer, entry->path, protocol, entry->size);
+    }
+
+    size_t length = strlen(temporary_buffer);
+
+    // Parts of the file can be asked for (see http_ranges()), and copies of it revalidated (see http_not_modified())
+    if(entry->status == STATUS_OK) {
+        length = add_field(temporary_buffer, length, "Accept-Ranges: bytes\r\n");
+        length = add_validators(entry, temporary_buffer, length);
+    }
+
+    return publish(&entry->headers[slot], temporary_buffer, length);
+}
+
+const struct file_header *file_cache_not_modified(struct file_entry *entry, char *protocol) {
+    int slot = protocol_slot(protocol);
+
+    if(slot == -1) {
+        return NULL;
+    }
+
+    struct file_header *header = atomic_load_explicit(&entry->not_modified[slot], memory_order_acquire);
+
+    if(header != NULL) {
+        return header;
+    }
+
+    // The reply has no body, so it needs no Content-Length to end
+    char temporary_buffer[BUFFER_SIZE];
+    int length = snprintf(temporary_buffer, BUFFER_SIZE, "%s 304 Not Modified\r\nFilename: %s\r\n\r\n", protocol, entry->path);
+
+    if(length >= BUFFER_SIZE) {
+        return NULL;
+    }
+
+    return publish(&entry->not_modified[slot], temporary_buffer, add_validators(entry, temporary_buffer, length));
+}
+
+const struct file_header *file_cache_encoded_header(struct file_entry *entry, char *protocol) {
+    int slot = protocol_slot(protocol);
+    int encoding = content_sidecar_encoding(entry->path);
+
+    if(slot == -1 || encoding == 0 || entry->status != STATUS_OK) {
+        return NULL;
+    }
+
+    struct file_header *header = atomic_load_explicit(&entry->encoded[slot], memory_order_acquire);
+
+    if(header != NULL) {
+        return header;
+    }
+
+    // Named after the file it was compressed from: the path without the suffix of the sidecar
+    char filename[BUFFER_SIZE];
+
+    snprintf(filename, BUFFER_SIZE, "%.*s", (int) (strrchr(entry->path, '.') - entry->path), entry->path);
+
+    char temporary_buffer[BUFFER_SIZE];
+    char field[64];
+
+    get_200(temporary_buffer, filename, protocol, entry->size);
+
+    snprintf(field, sizeof(field), "Content-Encoding: %s\r\n", content_encoding_name(encoding));
+
+    size_t length = add_field(temporary_buffer, strlen(temporary_buffer), field);
+
+    return publish(&entry->encoded[slot], temporary_buffer, add_validators(entry, temporary_buffer, length));
+}
+
+void file_cache_release(struct file_entry *entry) {
+    if(atomic_fetch_sub(&entry->references, 1) == 1) {
+        if(entry->fd != -1) {
+            close(entry->fd);
+        }
+
+        for(int i = 0; i < FILE_CACHE_PROTOCOLS; i++) {
+            free(atomic_load(&entry->headers[i]));
+            free(atomic_load(&entry->not_modified[i]));
+            free(atomic_load(&entry->encoded[i]));
+        }
+
+        free(entry->path);
+        free(entry);
+    }
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Maximum number of paths remembered by the cache (the descriptors kept open are bounded as well, see
+// file_cache_descriptors())
+#define FILE_CACHE_CAPACITY 4096
+
+// The cache keeps open at most one descriptor in this many allowed to the process (RLIMIT_NOFILE)
+#define FILE_CACHE_DESCRIPTOR_SHARE 4
+
+// Seconds after which an entry is checked against the filesystem again (unless the docroot index vouches for it)
+#define FILE_CACHE_TTL      1
+
+// Protocols whose reply headers are built once per entry (see file_cache_header())
+#define FILE_CACHE_PROTOCOLS 2
+
+// Room for the validators of an entry: its entity tag (quoted) and its modification time (an HTTP date)
+#define ETAG_SIZE           64
+#define HTTP_DATE_SIZE      32
+
+/**
+ * Reply header built for an entry: the status line and fields of a "200 OK" response,
+ * or the whole response (with its HTML body) for the errors.
+ */
+struct file_header {
+    size_t length;
+    char data[];
+};
+
+/**
+ * Outcome of resolving a path: STATUS_OK with an open descriptor and the file metadata,
+ * or STATUS_403/STATUS_404 (or STATUS_503, which is never cached). Entries are reference counted:
+ * the cache holds one reference while the entry is cached, and every response using the descriptor
+ * holds another.
+ */
+struct file_entry {
+    char *path;
+    unsigned long hash;
+
+    int status;
+
+    int fd;
+    off_t size;
+    struct timespec mtime;
+    ino_t inode;
+    dev_t device;
+
+    // Validators for conditional requests, derived from the metadata (empty unless STATUS_OK): an entity tag made of
+    // the inode, size and modification time, and the modification time as sent in Last-Modified
+    char etag[ETAG_SIZE];
+    char last_modified[HTTP_DATE_SIZE];
+
+    atomic_long checked; // When the entry was last known to match the filesystem
+    atomic_long version; // Version of the path in the docroot index when it was last checked (see docroot_index.h)
+    int indexed;         // Whether the index told the status (a 403 or 404), rather than open(2)
+
+    atomic_int references;
+
+    // Reply headers for HTTP/1.0 and HTTP/1.1, built on first use. Entries never change once resolved, so
+    // the header is shared by every response using the entry.
+    _Atomic(struct file_header *) headers[FILE_CACHE_PROTOCOLS];
+    _Atomic(struct file_header *) not_modified[FILE_CACHE_PROTOCOLS];
+    _Atomic(struct file_header *) encoded[FILE_CACHE_PROTOCOLS];
+
+    // Hash chain and LRU list of the shard owning the entry (protected by the shard lock)
+    struct file_entry *next;
+    struct file_entry *lru_prev;
+    struct file_entry *lru_next;
+};
+
+/**
+ * Resolves \p path, from memory if it has been resolved recently, or if the docroot index tells that it is not a
+ * regular file (403) or that nothing is there (404). Safe to call from any thread.
+ *
+ * Only what the file is (missing, forbidden or readable) is cached: if it cannot be opened for now (out of
+ * descriptors or memory), the entry returned has STATUS_503, and the next call tries again.
+ *
+ * @return A referenced entry, which must be given back with file_cache_release(); NULL if memory is exhausted.
+ */
+struct file_entry *file_cache_acquire(const char *path);
+
+/**
+ * Same as file_cache_acquire(), but only answers from memory: never makes a system call.
+ *
+ * @return A referenced entry, or NULL if \p path must be opened or checked against the filesystem.
+ */
+struct file_entry *file_cache_peek(const char *path);
+
+/**
+ * Returns the header of the reply for \p entry in \p protocol (for a 403/404, the whole reply), building it on first
+ * use. The header lives as long as the entry: the caller keeps its reference until the header has been sent.
+ *
+ * @return The header, or NULL if \p protocol is not HTTP/1.0 or HTTP/1.1, or memory is exhausted.
+ */
+const struct file_header *file_cache_header(struct file_entry *entry, char *protocol);
+
+/**
+ * Returns the whole "304 Not Modified" reply for \p entry (which must have STATUS_OK) in \p protocol, building it on
+ * first use, like file_cache_header().
+ *
+ * @return The reply, or NULL if \p protocol is not HTTP/1.0 or HTTP/1.1, or memory is exhausted.
+ */
+const struct file_header *file_cache_not_modified(struct file_entry *entry, char *protocol);
+
+/**
+ * Returns the header of the "200 OK" reply that sends the precompressed sidecar resolved in \p entry (see
+ * content_sidecar()) in \p protocol, as the file it was compressed from in its content coding. It is built on first
+ * use, like file_cache_header().
+ *
+ * @return The header, or NULL if \p entry is not a sidecar, \p protocol is not HTTP/1.0 or HTTP/1.1, or memory is
+ *         exhausted.
+ */
+const struct file_header *file_cache_encoded_header(struct file_entry *entry, char *protocol);
+
+/**
+ * @return The most descriptors the cache keeps open at once: FILE_CACHE_CAPACITY, or less under a low descriptor
+ *         limit (see FILE_CACHE_DESCRIPTOR_SHARE). Responses in flight may keep evicted ones open a while longer.
+ */
+int file_cache_descriptors(void);
+
+/**
+ * Lowers the budget of file_cache_descriptors() as if the descriptor limit were \p limit (say, FD_SETSIZE). Called
+ * before the cache is used.
+ */
+void file_cache_limit_descriptors(int limit);
+
+/**
+ * Drops a reference obtained from file_cache_acquire() or file_cache_peek(). The descriptor is closed when the entry
+ * has left the cache and no response uses it anymore.
+ */
+void file_cache_release(struct file_entry *entry);
+
+#endif /* FILE_CACHE_H */
@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Zero-copy transmission of file bodies.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+#include "file_transfer.h"
+#include "pool.h"
+
+static ssize_t drain_pipe(struct client *client);
+static ssize_t splice_file_chunk(struct client *client, size_t length);
+
+void attach_file(struct client *client, struct file_entry *entry, off_t offset, off_t end) {
+    client->file_entry = entry;
+    client->file = entry->fd;
+    client->prefetched = offset;
+    client->file_offset = offset;
+    client->file_end = end;
+}
+
+void attach_content(struct client *client, struct content *content) {
+    client->content = content;
+    client->file_offset = 0;
+    client->file_end = content->length;
+}
+
+// Source of the boundaries of multipart replies
+static atomic_ulong boundaries;
+
+/**
+ * Writes the header of part \p index of a multipart reply (for index == count, the closing boundary) into \p buffer,
+ * of \p size bytes (0 to only measure it).
+ *
+ * @return Its length.
+ */
+static int part_header(struct byte_ranges *ranges, int index, char *buffer, size_t size) {
+    if(index == ranges->count) {
+        return snprintf(buffer, size, "\r\n--%016lx--\r\n", ranges->boundary);
+    }
+
+    struct http_range *range = &ranges->ranges[index];
+
+    return snprintf(buffer, size, "\r\n--%016lx\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n", ranges->boundary, (long long) range->first, (long long) range->last, (long long) ranges->size);
+}
+
+/**
+ * Sets \p client to send the range \p index of its reply.
+ */
+static void seek_range(struct client *client, int index) {
+    struct byte_ranges *ranges = client->ranges;
+
+    client->file_offset = ranges->body + ranges->ranges[index].first;
+    client->file_end = ranges->body + ranges->ranges[index].last + 1;
+    client->prefetched = client->file_offset;
+}
+
+int attach_ranges(struct client *client, struct file_entry *entry, struct content *content, char *filename, char *protocol) {
+    struct byte_ranges *ranges = (struct byte_ranges *) buffer_alloc(sizeof(struct byte_ranges));
+
+    if(ranges == NULL) {
+        return 0;
+    }
+
+    // Ranges of a file changed since the client got its part (see If-Range) are not sent
+    int count = http_range_applies(&client->parser, entry->etag, entry->mtime.tv_sec) ? http_ranges(&client->parser, entry->size, ranges->ranges) : 0;
+
+    ranges->count = (count > 0) ? count : 0;
+    ranges->current = 0;
+    ranges->size = entry->size;
+    ranges->body = (content != NULL) ? (off_t) content->header_length : 0;
+    ranges->boundary = (atomic_fetch_add_explicit(&boundaries, 1, memory_order_relaxed) + 1) * 0x9E3779B97F4A7C15UL;
+
+    int length;
+
+    if(count == -1) {
+        length = snprintf(ranges->header, RANGES_HEADER_SIZE, "%s 416 Range Not Satisfiable\r\nFilename: %s\r\nContent-Range: bytes */%lld\r\nContent-Length: 0\r\n\r\n", protocol, filename, (long long) entry->size);
+
+        ranges->length = length;
+    }
+    else if(count == 1) {
+        struct http_range *range = &ranges->ranges[0];
+        off_t body_length = range->last - range->first + 1;
+
+        length = snprintf(ranges->header, RANGES_HEADER_SIZE, "%s 206 Partial Content\r\nFilename: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\nETag: %s\r\nLast-Modified: %s\r\n\r\n", protocol, filename, (long long) range->first, (long long) range->last, (long long) entry->size, (long long) body_length, entry->etag, entry->last_modified);
+
+        ranges->length = length + body_length;
+    }
+    else if(count > 1) {
+        // The length of the body is known in advance: every part header and the closing boundary, with the ranges
+        off_t body_length = part_header(ranges, count, NULL, 0);
+
+        for(int i = 0; i < count; i++) {
+            body_length += part_header(ranges, i, NULL, 0) + (ranges->ranges[i].last - ranges->ranges[i].first + 1);
+        }
+
+        length = snprintf(ranges->header, RANGES_HEADER_SIZE, "%s 206 Partial Content\r\nFilename: %s\r\nContent-Type: multipart/byteranges; boundary=%016lx\r\nContent-Length: %lld\r\nETag: %s\r\nLast-Modified: %s\r\n\r\n", protocol, filename, ranges->boundary, (long long) body_length, entry->etag, entry->last_modified);
+
+        // The first part header goes out with the reply header
+        if(length < RANGES_HEADER_SIZE) {
+            length += part_header(ranges, 0, ranges->header + length, RANGES_HEADER_SIZE - length);
+        }
+
+        ranges->length = length + body_length - part_header(ranges, 0, NULL, 0);
+    }
+    else {
+        length = RANGES_HEADER_SIZE;
+    }
+
+    // No Range field, or a filename too long for the header: the whole file is sent
+    if(length >= RANGES_HEADER_SIZE) {
+        buffer_free((char *) ranges, sizeof(struct byte_ranges));
+
+        return 0;
+    }
+
+    client->ranges = ranges;
+    client->reply_code = (count == -1) ? 416 : 206;
+
+    client->header = ranges->header;
+    client->ntowrite = length;
+    client->nwritten = 0;
+
+    if(count == -1) {
+        // Nothing of the file is sent
+        if(content != NULL) {
+            content_cache_release(content);
+        }
+
+        file_cache_release(entry);
+
+        client->file_offset = 0;
+        client->file_end = 0;
+
+        return 1;
+    }
+
+    if(content != NULL) {
+        attach_content(client, content);
+        file_cache_release(entry);
+    }
+    else {
+        attach_file(client, entry, 0, 0);
+    }
+
+    seek_range(client, 0);
+
+    return 1;
+}
+
+void omit_body(struct client *client) {
+    // Contents hold their header in front of the body
+    if(client->content != NULL) {
+        client->file_end = client->content->header_length;
+        return;
+    }
+
+    client->file_end = client->file_offset;
+
+    // Error replies are prebuilt whole, with their HTML after the header
+    const char *end = memmem(client->header, client->ntowrite, "\r\n\r\n", 4);
+
+    if(end != NULL) {
+        client->ntowrite = (end + 4) - client->header;
+    }
+}
+
+int next_range(struct client *client) {
+    struct byte_ranges *ranges = client->ranges;
+
+    // Single ranges have no part headers; the closing boundary is the last part of the others
+    if(ranges == NULL || ranges->count < 2 || ranges->current >= ranges->count) {
+        return 0;
+    }
+
+    ranges->current++;
+
+    client->header = ranges->header;
+    client->ntowrite = part_header(ranges, ranges->current, ranges->header, RANGES_HEADER_SIZE);
+    client->nwritten = 0;
+
+    if(ranges->current < ranges->count) {
+        seek_range(client, ranges->current);
+    }
+
+    return 1;
+}
+
+off_t reply_length(struct client *client) {
+    if(client->ranges != NULL) {
+        return client->ranges->length;
+    }
+
+    // The header, then the file (for cached contents, the whole response is the body)
+    return client->nwritten + client->file_end;
+}
+
+static ssize_t send_content_chunk(struct client *client) {
+    off_t remaining = client->file_end - client->file_offset;
+
+    if(remaining <= 0) {
+        return 0;
+    }
+
+    size_t length = (remaining < TRANSFER_CHUNK) ? (size_t) remaining : TRANSFER_CHUNK;
+    ssize_t result = write(client->socket, client->content->data + client->file_offset, length);
+
+    if(result > 0) {
+        client->file_offset += result;
+    }
+
+    return result;
+}
+
+ssize_t send_body_chunk(struct client *client) {
+    if(client->content != NULL) {
+        return send_content_chunk(client);
+    }
+
+    if(client->file == -1) {
+        return 0;
+    }
+
+    // Data already moved into the pipe by a previous splice must go out first
+    if(client->nspliced > 0) {
+        return drain_pipe(client);
+    }
+
+    off_t remaining = client->file_end - client->file_offset;
+
+    if(remaining <= 0) {
+        return 0;
+    }
+
+    size_t length = (remaining < TRANSFER_CHUNK) ? (size_t) remaining : TRANSFER_CHUNK;
+
+    if(client->splice_pipe[0] == -1) {
+        // sendfile(2) advances client->file_offset and leaves the descriptor's own offset alone
+        ssize_t result = sendfile(client->socket, client->file, &client->file_offset, length);
+
+        if(result > 0) {
+            return result;
+        }
+
+        if(result == 0) {
+            // The file shrank after the header announced its length
+            errno = EIO;
+            return -1;
+        }
+
+        if(errno != EINVAL && errno != ENOSYS) {
+            return -1;
+        }
+
+        // sendfile is not supported for this pair of descriptors: fall back to splice(2)
+        if(pipe2(client->splice_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+            client->splice_pipe[0] = -1;
+            client->splice_pipe[1] = -1;
+
+            return -1;
+        }
+    }
+
+    return splice_file_chunk(client, length);
+}
+
+static ssize_t splice_file_chunk(struct client *client, size_t length) {
+    ssize_t result = splice(client->file, &client->file_offset, client->splice_pipe[1], NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if(result == 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    if(result == -1) {
+        return -1;
+    }
+
+    client->nspliced = result;
+
+    return drain_pipe(client);
+}
+
+static ssize_t drain_pipe(struct client *client) {
+    ssize_t result = splice(client->splice_pipe[0], NULL, client->socket, NULL, client->nspliced, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if(result <= 0) {
+        if(result == 0) {
+            errno = EIO;
+        }
+
+        return -1;
+    }
+
+    client->nspliced -= result;
+
+    return result;
+}
+
+void release_body(struct client *client) {
+    if(client->content != NULL) {
+        content_cache_release(client->content);
+        client->content = NULL;
+    }
+
+    // The descriptor belongs to the cache entry, and may be shared with other responses
+    if(client->file_entry != NULL) {
+        file_cache_release(client->file_entry);
+        client->file_entry = NULL;
+    }
+
+    client->file = -1;
+
+    if(client->ranges != NULL) {
+        buffer_free((char *) client->ranges, sizeof(struct byte_ranges));
+        client->ranges = NULL;
+    }
+
+    if(client->reply_buffer != NULL) {
+        buffer_free(client->reply_buffer, BUFFER_SIZE);
+        client->reply_buffer = NULL;
+    }
+
+    if(client->splice_pipe[0] != -1) {
+        close(client->splice_pipe[0]);
+        close(client->splice_pipe[1]);
+
+        client->splice_pipe[0] = -1;
+        client->splice_pipe[1] = -1;
+    }
+
+    client->nspliced = 0;
+}
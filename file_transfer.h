@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef FILE_TRANSFER_H
+#define FILE_TRANSFER_H
+
+#include <sys/types.h>
+
+#include "clients_common.h"
+#include "file_cache.h"
+#include "content_cache.h"
+
+// Largest amount of body data moved per call, so that a single reply cannot monopolize an event loop
+#define TRANSFER_CHUNK  (1 << 20)
+
+/**
+ * Prepares \p client to send the bytes [\p offset, \p end) of the file resolved in \p entry. The client takes
+ * over the caller's reference to the entry, which is dropped by release_body().
+ */
+void attach_file(struct client *client, struct file_entry *entry, off_t offset, off_t end);
+
+/**
+ * Prepares \p client to send the whole in-memory response \p content (header included). The client takes
+ * over the caller's reference to the content, which is dropped by release_body().
+ */
+void attach_content(struct client *client, struct content *content);
+
+// Room for the headers of a reply with byte ranges: the reply header (with the filename), or the boundary of a part
+#define RANGES_HEADER_SIZE  2048
+
+/**
+ * Reply to a request with a Range field: a "206 Partial Content" with one range of the file, or with several as the
+ * parts of a "multipart/byteranges" body, or a "416 Range Not Satisfiable". Each range is sent from its offset like a
+ * whole body (see attach_file()), preceded by its part header; the bytes skipped are never read.
+ */
+struct byte_ranges {
+    struct http_range ranges[HTTP_MAX_RANGES];
+    int count;
+    int current;            // Range being sent; count once the closing boundary is due, count + 1 after it
+
+    off_t size;             // Size of the whole file
+    off_t body;             // Offset of the first byte of the file in the body attached (for contents, their header)
+    off_t length;           // Bytes of the whole reply, headers included
+
+    unsigned long boundary; // Separates the parts of a multipart reply
+
+    char header[RANGES_HEADER_SIZE];  // Header being sent: the reply header and the first part header, then the next ones
+};
+
+/**
+ * Prepares \p client to answer the Range field of its request (see http_ranges()) with the parts of the file resolved
+ * in \p entry, from \p content if not NULL. On success, the client takes over the caller's references to both.
+ *
+ * @return 1 if the reply has been prepared; 0 if the request should be answered with the whole file instead.
+ */
+int attach_ranges(struct client *client, struct file_entry *entry, struct content *content, char *filename, char *protocol);
+
+/**
+ * Cuts the reply prepared for \p client after its header (for a HEAD request): the file or content attached is not
+ * sent, nor the HTML of an error reply. The header still tells the length of the body.
+ */
+void omit_body(struct client *client);
+
+/**
+ * Moves \p client to the next part of its multipart reply (see attach_ranges()), once the previous one is sent:
+ * its part header is set to be sent, and then its range of the file.
+ *
+ * @return 1 if there is another part to send; 0 if the reply is complete.
+ */
+int next_range(struct client *client);
+
+/**
+ * @return Bytes of the whole reply of \p client, header included (once the reply is prepared).
+ */
+off_t reply_length(struct client *client);
+
+/**
+ * Sends the next part of the body attached to \p client. Cached contents are written from memory; files are
+ * sent directly from the page cache to the socket, using sendfile(2), or splice(2) through a pipe if sendfile
+ * is not supported for the descriptors. The offset is tracked in the client, so the call can be resumed after
+ * EAGAIN on non-blocking sockets.
+ *
+ * @return Number of bytes sent (> 0); 0 if the whole body has been sent, or there is none; -1 on error (errno is
+ *         EAGAIN or EWOULDBLOCK if the socket would block).
+ */
+ssize_t send_body_chunk(struct client *client);
+
+/**
+ * Releases the file or content (and closes the splice pipe, if any) attached to \p client.
+ */
+void release_body(struct client *client);
+
+#endif /* FILE_TRANSFER_H */
@@ -0,0 +1,604 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Resumable parser for HTTP/1.x request headers.
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "http_parser.h"
+#include "http_scan.h"
+
+// Longest method accepted
+#define MAX_METHOD 16
+
+static char index_filename[] = "index.html";
+
+void http_parser_init(struct http_parser *parser) {
+    memset(parser, 0, sizeof(struct http_parser));
+}
+
+static int fail(struct http_parser *parser, int error) {
+    parser->error = error;
+
+    return HTTP_PARSE_ERROR;
+}
+
+/**
+ * @return 1 if \p c may appear in a header field name (a "token" in RFC 9110); 0 otherwise.
+ */
+static int is_token(char c) {
+    if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        return 1;
+    }
+
+    return c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+/**
+ * Splits the request line (method, path and protocol, separated by single spaces).
+ *
+ * @return 0 on success; -1 if the line is malformed.
+ */
+static int parse_request_line(struct http_parser *parser, char *line, int length) {
+    int first;
+    int second;
+
+    if(http_scanner->split_request_line(line, length, &first, &second) == -1 || first == 0 || first > MAX_METHOD) {
+        return -1;
+    }
+
+    char *method = line;
+
+    for(char *current = method; current < line + first; current++) {
+        if(*current < 'A' || *current > 'Z') {
+            return -1;
+        }
+    }
+
+    char *path = line + first + 1;
+    int path_length = second - first - 1;
+
+    if(*path != '/' || !http_scanner->path_valid(path, path_length)) {
+        return -1;
+    }
+
+    char *protocol = line + second + 1;
+
+    if(length - second - 1 != 8 || memcmp(protocol, "HTTP/", 5) != 0 || !is_digit(protocol[5]) || protocol[6] != '.' || !is_digit(protocol[7])) {
+        return -1;
+    }
+
+    parser->method.data = method;
+    parser->method.length = first;
+
+    parser->path.data = path;
+    parser->path.length = path_length;
+
+    parser->protocol.data = protocol;
+    parser->protocol.length = 8;
+
+    return 0;
+}
+
+/**
+ * @return Whether the field \p line, whose name ends at \p colon, is called \p name (case-insensitively).
+ */
+static int field_is(const char *line, const char *colon, const char *name) {
+    int length = strlen(name);
+
+    return colon - line == length && strncasecmp(line, name, length) == 0;
+}
+
+/**
+ * Sets \p view to the value from \p value to \p end, without the spaces around it.
+ */
+static void set_view(struct http_view *view, char *value, char *end) {
+    while(value < end && (*value == ' ' || *value == '\t')) {
+        value++;
+    }
+
+    while(end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+
+    view->data = value;
+    view->length = end - value;
+}
+
+/**
+ * Checks a header field ("Name: value"), taking note of "Connection: close" and of the fields used by the reply.
+ *
+ * @return 0 on success; -1 if the line is malformed.
+ */
+static int parse_header_line(struct http_parser *parser, char *line, int length) {
+    char *colon = memchr(line, ':', length);
+
+    if(colon == NULL || colon == line) {
+        return -1;
+    }
+
+    for(char *current = line; current < colon; current++) {
+        if(!is_token(*current)) {
+            return -1;
+        }
+    }
+
+    char *end = line + length;
+
+    if(field_is(line, colon, "Connection")) {
+        for(char *value = colon + 1; value + 5 <= end; value++) {
+            if(strncasecmp(value, "close", 5) == 0) {
+                parser->close = 1;
+                break;
+            }
+        }
+    }
+    else if(field_is(line, colon, "Range")) {
+        // Ranges are only defined for GET (RFC 9110, section 14.2)
+        if(!parser->head) {
+            set_view(&parser->range, colon + 1, end);
+        }
+    }
+    else if(field_is(line, colon, "If-Range")) {
+        set_view(&parser->if_range, colon + 1, end);
+    }
+    else if(field_is(line, colon, "If-None-Match")) {
+        set_view(&parser->if_none_match, colon + 1, end);
+    }
+    else if(field_is(line, colon, "If-Modified-Since")) {
+        set_view(&parser->if_modified_since, colon + 1, end);
+    }
+    else if(field_is(line, colon, "Accept-Encoding")) {
+        set_view(&parser->accept_encoding, colon + 1, end);
+    }
+
+    return 0;
+}
+
+/**
+ * @return Length of the line starting at \p line and ending just before \p newline, without the carriage return.
+ */
+static int line_length(const char *line, const char *newline) {
+    int length = newline - line;
+
+    return (length > 0 && line[length - 1] == '\r') ? length - 1 : length;
+}
+
+int http_parse(struct http_parser *parser, char *buffer, int length) {
+    if(parser->header_length > 0) {
+        return HTTP_PARSE_DONE;
+    }
+
+    // The request line is checked first, so that garbage is rejected before the rest of the header arrives
+    while(parser->fields == 0) {
+        char *newline = memchr(buffer + parser->position, '\n', length - parser->position);
+
+        if(newline == NULL) {
+            parser->position = length;
+            return HTTP_PARSE_INCOMPLETE;
+        }
+
+        char *line = buffer + parser->line_start;
+        int request_line_length = line_length(line, newline);
+
+        parser->position = parser->line_start = (newline - buffer) + 1;
+
+        // Empty lines before the request line are ignored
+        if(request_line_length == 0) {
+            continue;
+        }
+
+        if(parse_request_line(parser, line, request_line_length) == -1) {
+            return fail(parser, 400);
+        }
+
+        // Any other method may come with a body, which would otherwise be taken for the next request
+        parser->head = (parser->method.length == 4 && memcmp(parser->method.data, "HEAD", 4) == 0);
+
+        if(!parser->head && (parser->method.length != 3 || memcmp(parser->method.data, "GET", 3) != 0)) {
+            return fail(parser, 501);
+        }
+
+        parser->fields = parser->position;
+    }
+
+    // Only the bytes not seen before are scanned (the kernel looks back for a blank line split between calls)
+    int end = http_scanner->find_header_end(buffer, parser->position, length);
+
+    if(end == -1) {
+        parser->position = length;
+        return HTTP_PARSE_INCOMPLETE;
+    }
+
+    // The header is complete: check its fields, up to the blank line
+    char *line = buffer + parser->fields;
+    int nfields = 0;
+
+    for(;;) {
+        char *newline = memchr(line, '\n', (buffer + end) - line);
+        int field_length = line_length(line, newline);
+
+        if(field_length == 0) {
+            break;
+        }
+
+        if(++nfields > HTTP_MAX_HEADERS) {
+            return fail(parser, 431);
+        }
+
+        if(parse_header_line(parser, line, field_length) == -1) {
+            return fail(parser, 400);
+        }
+
+        line = newline + 1;
+    }
+
+    // The separators (and the end of the request line) become terminators. This is only done now, because the
+    // blank line ending the header is found by looking back at the end of the previous line.
+    parser->method.data[parser->method.length] = '\0';
+    parser->path.data[parser->path.length] = '\0';
+    parser->protocol.data[parser->protocol.length] = '\0';
+
+    parser->position = end;
+    parser->header_length = end;
+
+    return HTTP_PARSE_DONE;
+}
+
+/**
+ * Reads the decimal number at *\p current (before \p end), moving past it.
+ *
+ * @return The number; -1 if there is none, or it is too large.
+ */
+static off_t parse_offset(const char **current, const char *end) {
+    off_t value = 0;
+    const char *start = *current;
+
+    for(; *current < end && is_digit(**current); (*current)++) {
+        if(value > (((off_t) 1 << 62) - 1) / 10) {
+            return -1;
+        }
+
+        value = value * 10 + (**current - '0');
+    }
+
+    return (*current > start) ? value : -1;
+}
+
+static const char *skip_spaces(const char *current, const char *end) {
+    while(current < end && (*current == ' ' || *current == '\t')) {
+        current++;
+    }
+
+    return current;
+}
+
+int http_ranges(struct http_parser *parser, off_t size, struct http_range *ranges) {
+    if(parser->range.data == NULL) {
+        return 0;
+    }
+
+    const char *current = parser->range.data;
+    const char *end = parser->range.data + parser->range.length;
+
+    if(end - current < 6 || strncasecmp(current, "bytes=", 6) != 0) {
+        return 0;
+    }
+
+    current += 6;
+
+    int nranges = 0;
+    int nspecified = 0;
+    off_t total = 0;
+
+    // A list of "first-last", "first-" or "-suffix", separated by commas (empty elements are allowed)
+    for(;;) {
+        current = skip_spaces(current, end);
+
+        if(current < end && *current != ',') {
+            off_t first;
+            off_t last;
+
+            if(*current == '-') {
+                current++;
+
+                off_t suffix = parse_offset(&current, end);
+
+                if(suffix == -1) {
+                    return 0;
+                }
+
+                first = (suffix < size) ? size - suffix : 0;
+                last = (suffix > 0) ? size - 1 : -1;
+            }
+            else {
+                first = parse_offset(&current, end);
+
+                if(first == -1 || current == end || *current != '-') {
+                    return 0;
+                }
+
+                current++;
+
+                if(current < end && is_digit(*current)) {
+                    if((last = parse_offset(&current, end)) < first) {
+                        return 0;
+                    }
+                }
+                else {
+                    last = size - 1;
+                }
+            }
+
+            if(++nspecified > HTTP_MAX_RANGES) {
+                return 0;
+            }
+
+            // Unsatisfiable ranges are left out
+            if(first < size && last >= first) {
+                ranges[nranges].first = first;
+                ranges[nranges].last = (last < size) ? last : size - 1;
+
+                total += ranges[nranges].last - ranges[nranges].first + 1;
+                nranges++;
+            }
+
+            current = skip_spaces(current, end);
+        }
+
+        if(current == end) {
+            break;
+        }
+
+        if(*current != ',') {
+            return 0;
+        }
+
+        current++;
+    }
+
+    if(nspecified == 0) {
+        return 0;
+    }
+
+    // Overlapping ranges adding up to more than the file are not worth a multipart reply: send the file whole instead
+    if(total > size) {
+        return 0;
+    }
+
+    return (nranges > 0) ? nranges : -1;
+}
+
+/**
+ * Parses the HTTP date in \p view, in any of the formats that recipients must accept (RFC 9110, section 5.6.7).
+ *
+ * @return The time; -1 if \p view is not a date.
+ */
+static time_t parse_date(struct http_view *view) {
+    static const char *formats[] = {"%a, %d %b %Y %H:%M:%S GMT", "%A, %d-%b-%y %H:%M:%S GMT", "%a %b %e %H:%M:%S %Y"};
+
+    char date[64];
+
+    if(view->length >= (int) sizeof(date)) {
+        return -1;
+    }
+
+    memcpy(date, view->data, view->length);
+    date[view->length] = '\0';
+
+    for(int i = 0; i < (int) (sizeof(formats) / sizeof(formats[0])); i++) {
+        struct tm fields;
+
+        memset(&fields, 0, sizeof(struct tm));
+
+        char *end = strptime(date, formats[i], &fields);
+
+        if(end != NULL && *end == '\0') {
+            return timegm(&fields);
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @return 1 if the list of entity tags in \p view ("*", or tags separated by commas) has one that matches \p etag,
+ *         ignoring whether it is weak; 0 otherwise.
+ */
+static int etag_listed(struct http_view *view, const char *etag) {
+    const char *current = view->data;
+    const char *end = view->data + view->length;
+    int length = strlen(etag);
+
+    for(;;) {
+        current = skip_spaces(current, end);
+
+        if(current == end) {
+            return 0;
+        }
+
+        if(*current == '*') {
+            return 1;
+        }
+
+        if(end - current >= 2 && current[0] == 'W' && current[1] == '/') {
+            current += 2;
+        }
+
+        if(*current != '"') {
+            return 0;
+        }
+
+        const char *closing = memchr(current + 1, '"', end - (current + 1));
+
+        if(closing == NULL) {
+            return 0;
+        }
+
+        if(closing + 1 - current == length && memcmp(current, etag, length) == 0) {
+            return 1;
+        }
+
+        current = skip_spaces(closing + 1, end);
+
+        if(current < end && *current != ',') {
+            return 0;
+        }
+
+        if(current < end) {
+            current++;
+        }
+    }
+}
+
+int http_not_modified(struct http_parser *parser, const char *etag, time_t modified) {
+    if(parser->if_none_match.data != NULL) {
+        return etag_listed(&parser->if_none_match, etag);
+    }
+
+    if(parser->if_modified_since.data != NULL) {
+        time_t since = parse_date(&parser->if_modified_since);
+
+        return since != -1 && modified <= since;
+    }
+
+    return 0;
+}
+
+int http_range_applies(struct http_parser *parser, const char *etag, time_t modified) {
+    struct http_view *condition = &parser->if_range;
+
+    if(condition->data == NULL) {
+        return 1;
+    }
+
+    // An entity tag must match strongly; a date, exactly
+    if(condition->length > 0 && condition->data[0] == '"') {
+        return condition->length == (int) strlen(etag) && memcmp(condition->data, etag, condition->length) == 0;
+    }
+
+    return parse_date(condition) == modified;
+}
+
+/**
+ * @return The coding called \p name (of \p length bytes): HTTP_ENCODING_GZIP or HTTP_ENCODING_BR; 0 for any other.
+ */
+static int encoding_named(const char *name, int length) {
+    if((length == 4 && strncasecmp(name, "gzip", 4) == 0) || (length == 6 && strncasecmp(name, "x-gzip", 6) == 0)) {
+        return HTTP_ENCODING_GZIP;
+    }
+
+    if(length == 2 && strncasecmp(name, "br", 2) == 0) {
+        return HTTP_ENCODING_BR;
+    }
+
+    return 0;
+}
+
+int http_encodings(struct http_parser *parser) {
+    const char *current = parser->accept_encoding.data;
+    const char *end = current + parser->accept_encoding.length;
+
+    if(current == NULL) {
+        return 0;
+    }
+
+    int accepted = 0;
+    int refused = 0;
+    int wildcard = 0;
+
+    // Codings separated by commas, each optionally with a quality ("gzip;q=0.8"); quality 0 means "not acceptable"
+    while(current < end) {
+        current = skip_spaces(current, end);
+
+        const char *name = current;
+
+        while(current < end && *current != ',' && *current != ';' && *current != ' ' && *current != '\t') {
+            current++;
+        }
+
+        int name_length = current - name;
+        int acceptable = 1;
+
+        for(current = skip_spaces(current, end); current < end && *current == ';'; current = skip_spaces(current, end)) {
+            current = skip_spaces(current + 1, end);
+
+            if(end - current >= 2 && (*current == 'q' || *current == 'Q') && current[1] == '=') {
+                current += 2;
+
+                // Only the zero qualities matter: "0", "0.", "0.0", up to "0.000"
+                const char *quality = current;
+
+                while(current < end && *current != ',' && *current != ';' && *current != ' ' && *current != '\t') {
+                    current++;
+                }
+
+                acceptable = 0;
+
+                for(const char *digit = quality; digit < current; digit++) {
+                    if(*digit >= '1' && *digit <= '9') {
+                        acceptable = 1;
+                    }
+                }
+            }
+            else {
+                while(current < end && *current != ',' && *current != ';') {
+                    current++;
+                }
+            }
+        }
+
+        int encoding = encoding_named(name, name_length);
+
+        if(name_length == 1 && *name == '*') {
+            wildcard = acceptable;
+        }
+        else if(acceptable) {
+            accepted |= encoding;
+        }
+        else {
+            refused |= encoding;
+        }
+
+        // Skip to the next coding
+        while(current < end && *current != ',') {
+            current++;
+        }
+
+        if(current < end) {
+            current++;
+        }
+    }
+
+    // The wildcard covers the codings not listed
+    if(wildcard == 1) {
+        accepted |= (HTTP_ENCODING_GZIP | HTTP_ENCODING_BR) & ~refused;
+    }
+
+    return accepted & ~refused;
+}
+
+char *http_filename(struct http_parser *parser) {
+    char *filename = parser->path.data + 1;
+    char *query = memchr(filename, '?', parser->path.length - 1);
+
+    if(query != NULL) {
+        *query = '\0';
+    }
+
+    // Paths with an empty segment are rejected with the request line (see http_scan.h)
+    assert(*filename != '/');
+
+    return (*filename != '\0') ? filename : index_filename;
+}
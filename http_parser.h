@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#define HTTP_PARSE_ERROR        -1
+#define HTTP_PARSE_INCOMPLETE   0
+#define HTTP_PARSE_DONE         1
+
+// Header fields accepted after the request line
+#define HTTP_MAX_HEADERS        64
+
+// Byte ranges served in one reply; requests for more get the whole file
+#define HTTP_MAX_RANGES         16
+
+// Content codings a reply may use (see http_encodings()); the file as it is has none
+#define HTTP_ENCODING_GZIP      1
+#define HTTP_ENCODING_BR        2
+
+/**
+ * Part of the request buffer.
+ */
+struct http_view {
+    char *data;
+    int length;
+};
+
+/**
+ * Incremental parser for the header of an HTTP request. It is resumed every time more bytes are received.
+ * The request line is checked as soon as it is complete; after that, each call only scans the new bytes for the
+ * blank line ending the header (see http_scan.h), and the header fields are checked once, when it is complete.
+ *
+ * Once the header is complete, the method, path and protocol are views into the request buffer, which the
+ * parser null-terminates in place, so that they can also be used as strings.
+ */
+struct http_parser {
+    int position;               // Next byte of the buffer to scan
+    int line_start;             // First byte of the line being scanned, until the request line has been parsed
+    int fields;                 // First byte after the request line (0 until it has been parsed)
+
+    struct http_view method;    // GET or HEAD: other methods are rejected with 501
+    struct http_view path;
+    struct http_view protocol;
+
+    int head;                   // Whether the method is HEAD: the reply is sent without its body
+    int close;                  // Whether the client sent "Connection: close"
+
+    // Values of the fields used by the reply (data is NULL if the field is absent)
+    struct http_view range;
+    struct http_view if_range;
+    struct http_view if_none_match;
+    struct http_view if_modified_since;
+    struct http_view accept_encoding;
+
+    int header_length;          // Once done: length of the header, blank line included
+    int error;                  // Once failed: HTTP status code of the error
+};
+
+void http_parser_init(struct http_parser *parser);
+
+/**
+ * Continues parsing the request header in the first \p length bytes of \p buffer, from where the previous call stopped.
+ *
+ * Only GET and HEAD are served, so the request never has a body: another method is an error (501) as soon as the
+ * request line is complete, and the connection is closed before anything that follows could be taken for a request.
+ *
+ * @return HTTP_PARSE_DONE if the header is complete; HTTP_PARSE_INCOMPLETE if more bytes are needed; HTTP_PARSE_ERROR
+ *         if the header is malformed, has too many fields, or the method is not served (parser->error tells which).
+ */
+int http_parse(struct http_parser *parser, char *buffer, int length);
+
+/**
+ * Range of bytes of a file, both ends included.
+ */
+struct http_range {
+    off_t first;
+    off_t last;
+};
+
+/**
+ * Interprets the Range field of the request parsed by \p parser for a file of \p size bytes. Ranges past the end of
+ * the file are left out, and the others are cut at the end of the file.
+ *
+ * @return Number of ranges stored in \p ranges (at most HTTP_MAX_RANGES); 0 if the whole file should be sent instead
+ *         (there is no Range field, it is malformed or not in bytes, or it asks for too many or overlapping ranges);
+ *         -1 if no range can be satisfied (416).
+ */
+int http_ranges(struct http_parser *parser, off_t size, struct http_range *ranges);
+
+/**
+ * Evaluates the conditions of the request parsed by \p parser against the current validators of the file: its entity
+ * tag \p etag (quoted) and its modification time \p modified. If-None-Match is checked if present (with the weak
+ * comparison); otherwise If-Modified-Since.
+ *
+ * @return 1 if the copy of the client is current, so a "304 Not Modified" can be sent instead of the file; 0 otherwise.
+ */
+int http_not_modified(struct http_parser *parser, const char *etag, time_t modified);
+
+/**
+ * Evaluates the If-Range field of the request parsed by \p parser against the validators of the file (see
+ * http_not_modified()): ranges of a file that changed since the client got its part would not fit together.
+ *
+ * @return 1 if the Range field may be honored; 0 if the whole file should be sent instead.
+ */
+int http_range_applies(struct http_parser *parser, const char *etag, time_t modified);
+
+/**
+ * @return The content codings accepted by the request parsed by \p parser, according to its Accept-Encoding field
+ *         (those with a non-zero quality, explicitly or through "*"): a combination of HTTP_ENCODING_GZIP and
+ *         HTTP_ENCODING_BR.
+ */
+int http_encodings(struct http_parser *parser);
+
+/**
+ * @return The file requested by the request parsed by \p parser: its path without the leading slash and the
+ *         query string, or "index.html" for "/". Null-terminated in place.
+ */
+char *http_filename(struct http_parser *parser);
+
+#endif /* HTTP_PARSER_H */
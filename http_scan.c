@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Scalar and vectorized (SSE2, AVX2) kernels for scanning request headers.
+ */
+#include <string.h>
+
+#include "http_scan.h"
+
+// SSE2 is part of x86-64
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+// Scalar kernels (also used for the bytes left over by the vectorized ones)
+
+/**
+ * @return 1 if the newline at \p i of \p buffer ends a blank line; 0 otherwise.
+ */
+static inline int ends_blank_line(const char *buffer, int i) {
+    return i >= 1 && (buffer[i - 1] == '\n' || (i >= 2 && buffer[i - 1] == '\r' && buffer[i - 2] == '\n'));
+}
+
+static int find_header_end_scalar(const char *buffer, int from, int length) {
+    for(int i = from; i < length; i++) {
+        if(buffer[i] == '\n' && ends_blank_line(buffer, i)) {
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
+
+static int split_request_line_scalar(const char *line, int length, int *first, int *second) {
+    const char *space = memchr(line, ' ', length);
+
+    if(space == NULL) {
+        return -1;
+    }
+
+    *first = space - line;
+
+    if((space = memchr(space + 1, ' ', length - *first - 1)) == NULL) {
+        return -1;
+    }
+
+    *second = space - line;
+
+    return 0;
+}
+
+/**
+ * @return 1 if the two dots starting at \p i of \p path form a whole segment; 0 otherwise.
+ */
+static inline int dot_segment(const char *path, int i, int length) {
+    return (i == 0 || path[i - 1] == '/') && (i + 2 == length || path[i + 2] == '/' || path[i + 2] == '?');
+}
+
+/**
+ * @return 1 if the two slashes starting at \p i of \p path make an empty segment (they are not in the query); 0
+ *         otherwise.
+ */
+static inline int empty_segment(const char *path, int i) {
+    return memchr(path, '?', i) == NULL;
+}
+
+static int path_valid_from(const char *path, int from, int length) {
+    for(int i = from; i < length; i++) {
+        unsigned char c = (unsigned char) path[i];
+
+        if(c < 0x20 || c == 0x7f) {
+            return 0;
+        }
+
+        // A ".." segment would leave the document root
+        if(c == '.' && i + 1 < length && path[i + 1] == '.' && dot_segment(path, i, length)) {
+            return 0;
+        }
+
+        // So would an empty one: "//etc/passwd" is the absolute path "/etc/passwd" once the first slash is gone
+        if(c == '/' && i + 1 < length && path[i + 1] == '/' && empty_segment(path, i)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int path_valid_scalar(const char *path, int length) {
+    return path_valid_from(path, 0, length);
+}
+
+const struct http_scanner http_scalar_scanner = {
+    .name = "scalar",
+    .find_header_end = find_header_end_scalar,
+    .split_request_line = split_request_line_scalar,
+    .path_valid = path_valid_scalar,
+};
+
+#ifdef HAVE_X86_KERNELS
+
+/*
+ * The vectorized kernels compare 16 (SSE2) or 32 (AVX2) bytes at a time, and turn the comparisons into bit masks
+ * with one bit per byte. The blank line test compares each block with the same block shifted by one and two bytes
+ * (unaligned loads), so that a match is found wherever it starts.
+ *
+ * The 16-byte loops are inlined in both versions: the AVX2 kernels finish with them, which is what matters for the
+ * short paths and request lines, and the compiler encodes them with AVX there, avoiding SSE/AVX transitions.
+ */
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+/**
+ * Finds the blank line from \p i (at least 2) on, 16 bytes at a time.
+ */
+ALWAYS_INLINE int find_header_end_16(const char *buffer, int i, int length) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i carriage_return = _mm_set1_epi8('\r');
+
+    for(; i + 16 <= length; i += 16) {
+        __m128i current = _mm_loadu_si128((const __m128i *) (buffer + i));
+        __m128i previous = _mm_loadu_si128((const __m128i *) (buffer + i - 1));
+        __m128i before_previous = _mm_loadu_si128((const __m128i *) (buffer + i - 2));
+
+        __m128i after_newline = _mm_cmpeq_epi8(previous, newline);
+        __m128i after_crlf = _mm_and_si128(_mm_cmpeq_epi8(previous, carriage_return), _mm_cmpeq_epi8(before_previous, newline));
+        __m128i blank = _mm_and_si128(_mm_cmpeq_epi8(current, newline), _mm_or_si128(after_newline, after_crlf));
+
+        unsigned int mask = _mm_movemask_epi8(blank);
+
+        if(mask != 0) {
+            return i + __builtin_ctz(mask) + 1;
+        }
+    }
+
+    return find_header_end_scalar(buffer, i, length);
+}
+
+/**
+ * The first bytes cannot be looked back from: they are checked one by one.
+ *
+ * @return Offset just past the blank line, if it ends within them; otherwise, -1 (and \p *i is where to continue).
+ */
+ALWAYS_INLINE int find_header_end_prologue(const char *buffer, int from, int length, int *i) {
+    *i = (from >= 2) ? from : 2;
+
+    for(int j = from; j < *i && j < length; j++) {
+        if(buffer[j] == '\n' && ends_blank_line(buffer, j)) {
+            return j + 1;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Records the space at \p position as the first or second one.
+ *
+ * @return 1 if it was the second one; 0 otherwise.
+ */
+ALWAYS_INLINE int record_space(int position, int *found, int *first, int *second) {
+    if((*found)++ == 0) {
+        *first = position;
+        return 0;
+    }
+
+    *second = position;
+    return 1;
+}
+
+/**
+ * Continues looking for the two spaces from \p i on, 16 bytes at a time, \p found of them having been found already.
+ */
+ALWAYS_INLINE int split_request_line_16(const char *line, int i, int length, int found, int *first, int *second) {
+    const __m128i space = _mm_set1_epi8(' ');
+
+    for(; i + 16 <= length; i += 16) {
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (line + i)), space));
+
+        for(; mask != 0; mask &= mask - 1) {
+            if(record_space(i + __builtin_ctz(mask), &found, first, second)) {
+                return 0;
+            }
+        }
+    }
+
+    for(; i < length; i++) {
+        if(line[i] == ' ' && record_space(i, &found, first, second)) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Validates the path from \p i on, 16 bytes at a time.
+ */
+ALWAYS_INLINE int path_valid_16(const char *path, int i, int length) {
+    const __m128i last_control = _mm_set1_epi8(0x1f);
+    const __m128i delete = _mm_set1_epi8(0x7f);
+    const __m128i dot = _mm_set1_epi8('.');
+    const __m128i slash = _mm_set1_epi8('/');
+
+    // Each block also looks at the next byte, to find ".." (or "//") starting at its last byte
+    for(; i + 17 <= length; i += 16) {
+        __m128i current = _mm_loadu_si128((const __m128i *) (path + i));
+        __m128i next = _mm_loadu_si128((const __m128i *) (path + i + 1));
+
+        // Unsigned c <= 0x1f is max(c, 0x1f) == 0x1f
+        __m128i control = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(current, last_control), last_control), _mm_cmpeq_epi8(current, delete));
+
+        if(_mm_movemask_epi8(control) != 0) {
+            return 0;
+        }
+
+        unsigned int dots = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(current, dot), _mm_cmpeq_epi8(next, dot)));
+
+        // Two dots are rare in paths: check the segment boundaries one pair at a time
+        for(; dots != 0; dots &= dots - 1) {
+            if(dot_segment(path, i + __builtin_ctz(dots), length)) {
+                return 0;
+            }
+        }
+
+        unsigned int slashes = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(current, slash), _mm_cmpeq_epi8(next, slash)));
+
+        if(slashes != 0 && empty_segment(path, i + __builtin_ctz(slashes))) {
+            return 0;
+        }
+    }
+
+    return path_valid_from(path, i, length);
+}
+
+static int find_header_end_sse2(const char *buffer, int from, int length) {
+    int i;
+    int end = find_header_end_prologue(buffer, from, length, &i);
+
+    return (end != -1) ? end : find_header_end_16(buffer, i, length);
+}
+
+static int split_request_line_sse2(const char *line, int length, int *first, int *second) {
+    return split_request_line_16(line, 0, length, 0, first, second);
+}
+
+static int path_valid_sse2(const char *path, int length) {
+    return path_valid_16(path, 0, length);
+}
+
+const struct http_scanner http_sse2_scanner = {
+    .name = "sse2",
+    .find_header_end = find_header_end_sse2,
+    .split_request_line = split_request_line_sse2,
+    .path_valid = path_valid_sse2,
+};
+
+__attribute__((target("avx2")))
+static int find_header_end_avx2(const char *buffer, int from, int length) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i carriage_return = _mm256_set1_epi8('\r');
+
+    int i;
+    int end = find_header_end_prologue(buffer, from, length, &i);
+
+    if(end != -1) {
+        return end;
+    }
+
+    for(; i + 32 <= length; i += 32) {
+        __m256i current = _mm256_loadu_si256((const __m256i *) (buffer + i));
+        __m256i previous = _mm256_loadu_si256((const __m256i *) (buffer + i - 1));
+        __m256i before_previous = _mm256_loadu_si256((const __m256i *) (buffer + i - 2));
+
+        __m256i after_newline = _mm256_cmpeq_epi8(previous, newline);
+        __m256i after_crlf = _mm256_and_si256(_mm256_cmpeq_epi8(previous, carriage_return), _mm256_cmpeq_epi8(before_previous, newline));
+        __m256i blank = _mm256_and_si256(_mm256_cmpeq_epi8(current, newline), _mm256_or_si256(after_newline, after_crlf));
+
+        unsigned int mask = _mm256_movemask_epi8(blank);
+
+        if(mask != 0) {
+            return i + __builtin_ctz(mask) + 1;
+        }
+    }
+
+    return find_header_end_16(buffer, i, length);
+}
+
+__attribute__((target("avx2")))
+static int split_request_line_avx2(const char *line, int length, int *first, int *second) {
+    const __m256i space = _mm256_set1_epi8(' ');
+
+    int found = 0;
+    int i = 0;
+
+    for(; i + 32 <= length; i += 32) {
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (line + i)), space));
+
+        for(; mask != 0; mask &= mask - 1) {
+            if(record_space(i + __builtin_ctz(mask), &found, first, second)) {
+                return 0;
+            }
+        }
+    }
+
+    return split_request_line_16(line, i, length, found, first, second);
+}
+
+__attribute__((target("avx2")))
+static int path_valid_avx2(const char *path, int length) {
+    const __m256i last_control = _mm256_set1_epi8(0x1f);
+    const __m256i delete = _mm256_set1_epi8(0x7f);
+    const __m256i dot = _mm256_set1_epi8('.');
+    const __m256i slash = _mm256_set1_epi8('/');
+
+    int i = 0;
+
+    for(; i + 33 <= length; i += 32) {
+        __m256i current = _mm256_loadu_si256((const __m256i *) (path + i));
+        __m256i next = _mm256_loadu_si256((const __m256i *) (path + i + 1));
+
+        __m256i control = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(current, last_control), last_control), _mm256_cmpeq_epi8(current, delete));
+
+        if(_mm256_movemask_epi8(control) != 0) {
+            return 0;
+        }
+
+        unsigned int dots = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(current, dot), _mm256_cmpeq_epi8(next, dot)));
+
+        for(; dots != 0; dots &= dots - 1) {
+            if(dot_segment(path, i + __builtin_ctz(dots), length)) {
+                return 0;
+            }
+        }
+
+        unsigned int slashes = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(current, slash), _mm256_cmpeq_epi8(next, slash)));
+
+        if(slashes != 0 && empty_segment(path, i + __builtin_ctz(slashes))) {
+            return 0;
+        }
+    }
+
+    return path_valid_16(path, i, length);
+}
+
+const struct http_scanner http_avx2_scanner = {
+    .name = "avx2",
+    .find_header_end = find_header_end_avx2,
+    .split_request_line = split_request_line_avx2,
+    .path_valid = path_valid_avx2,
+};
+
+#endif /* HAVE_X86_KERNELS */
+
+const struct http_scanner *http_scanner = &http_scalar_scanner;
+
+int http_scanner_supported(const struct http_scanner *scanner) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+
+    if(scanner == &http_avx2_scanner) {
+        return __builtin_cpu_supports("avx2");
+    }
+
+    if(scanner == &http_sse2_scanner) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+
+    return scanner == &http_scalar_scanner;
+}
+
+__attribute__((constructor))
+static void select_scanner(void) {
+#ifdef HAVE_X86_KERNELS
+    if(http_scanner_supported(&http_avx2_scanner)) {
+        http_scanner = &http_avx2_scanner;
+    }
+    else if(http_scanner_supported(&http_sse2_scanner)) {
+        http_scanner = &http_sse2_scanner;
+    }
+#endif
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+/**
+ * Byte-scanning kernels used by the HTTP parser. Each has a scalar version and, on x86, SSE2 and AVX2 versions;
+ * the best one supported by the CPU is selected at startup.
+ */
+struct http_scanner {
+    const char *name;
+
+    /**
+     * Looks for the blank line ending a request header ("\r\n\r\n", or "\n\n") in the bytes [\p from, \p length)
+     * of \p buffer. The two bytes before \p from are also looked at (if \p from is at least 2), so that a blank
+     * line split across two calls is found.
+     *
+     * @return Offset just past the blank line, or -1 if there is none.
+     */
+    int (*find_header_end)(const char *buffer, int from, int length);
+
+    /**
+     * Finds the first two spaces of the request line \p line (of \p length bytes), which separate the method,
+     * the path and the protocol.
+     *
+     * @return 0 on success, with their offsets in \p first and \p second; -1 if there are fewer than two.
+     */
+    int (*split_request_line)(const char *line, int length, int *first, int *second);
+
+    /**
+     * @return 1 if the \p length bytes of \p path contain no control characters, no ".." segment and no empty
+     *         segment ("//") before the query; 0 otherwise.
+     */
+    int (*path_valid)(const char *path, int length);
+};
+
+extern const struct http_scanner http_scalar_scanner;
+
+#if defined(__x86_64__)
+extern const struct http_scanner http_sse2_scanner;
+extern const struct http_scanner http_avx2_scanner;
+#endif
+
+// The scanner selected for this CPU
+extern const struct http_scanner *http_scanner;
+
+/**
+ * @return 1 if the CPU can run \p scanner; 0 otherwise.
+ */
+int http_scanner_supported(const struct http_scanner *scanner);
+
+#endif /* HTTP_SCAN_H */
@@ -2,10 +2,39 @@
  * Copyright (c) 2017, Hammurabi Mendes.
  * Licence: BSD 2-clause
  */
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
 #include "server_fork.h"
 #include "server_statemachine.h"
+#include "server_epoll.h"
+#include "server_uring.h"
 
 int main(int argc, char **argv) {
+	// Usage: server [options] <port> [select|epoll|uring|fork]
+	int first = parse_config(argc, argv);
+
+	if(first == -1) {
+		return EXIT_FAILURE;
+	}
+
+	// The servers expect the port in argv[1]
+	argc -= first - 1;
+	argv += first - 1;
+
+	if(argc > 2 && strcmp(argv[2], "epoll") == 0) {
+		return server_epoll(argc, argv);
+	}
+
+	if(argc > 2 && strcmp(argv[2], "uring") == 0) {
+		return server_uring(argc, argv);
+	}
+
+	if(argc > 2 && strcmp(argv[2], "fork") == 0) {
+		return server_fork(argc, argv);
+	}
+
 	return server_statemachine(argc, argv);
 
 }
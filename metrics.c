@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Latency histograms, counters and gauges, recorded in per-thread shards and reported on demand.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "metrics.h"
+#include "content_cache.h"
+#include "file_transfer.h"
+#include "thread_pool.h"
+
+// Snapshots are formatted into a buffer of this size (they take a few kilobytes)
+#define SNAPSHOT_BYTES  (16 * 1024)
+
+static _Thread_local struct metrics_shard *thread_shard;
+
+static _Atomic(struct metrics_shard *) shards;
+
+static struct metrics_shard *shared_shards;
+
+static pthread_t dumper;
+static int running;
+
+static const char *phase_names[PHASES] = {"header", "first_byte", "transfer"};
+static const char *outcome_names[OUTCOMES] = {"200", "403", "404", "failed", "503"};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static void publish(struct metrics_shard *shard) {
+    shard->next = atomic_load(&shards);
+
+    while(!atomic_compare_exchange_weak(&shards, &shard->next, shard)) {
+    }
+}
+
+static struct metrics_shard *shard_of_thread(void) {
+    if(thread_shard == NULL) {
+        struct metrics_shard *shard = (struct metrics_shard *) calloc(1, sizeof(struct metrics_shard));
+
+        if(shard == NULL) {
+            return NULL;
+        }
+
+        publish(shard);
+
+        thread_shard = shard;
+    }
+
+    return thread_shard;
+}
+
+/**
+ * Adds \p amount to \p counter, which only the calling thread writes.
+ */
+static inline void add(atomic_ulong *counter, unsigned long amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+static int bucket_of(unsigned long long value) {
+    if(value < (1 << HISTOGRAM_SUB_BITS)) {
+        return (int) value;
+    }
+
+    int exponent = 63 - __builtin_clzll(value);
+    int sub_bucket = (int) (value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+
+    return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub_bucket;
+}
+
+/**
+ * @return The largest value counted in \p bucket.
+ */
+static unsigned long long bucket_limit(int bucket) {
+    if(bucket < (1 << HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+
+    int exponent = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    unsigned long long sub_bucket = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    unsigned long long width = 1ULL << (exponent - HISTOGRAM_SUB_BITS);
+
+    return ((1ULL << HISTOGRAM_SUB_BITS) + sub_bucket) * width + (width - 1);
+}
+
+static void record(int phase, unsigned long long since) {
+    struct metrics_shard *shard = shard_of_thread();
+
+    if(shard == NULL || since == 0) {
+        return;
+    }
+
+    unsigned long long now = metrics_now();
+    unsigned long long latency = (now > since) ? now - since : 0;
+
+    add(&shard->latency[phase][bucket_of(latency)], 1);
+    add(&shard->latency_sum[phase], latency);
+}
+
+unsigned long long metrics_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void metrics_connection_opened(void) {
+    struct metrics_shard *shard = shard_of_thread();
+
+    if(shard != NULL) {
+        add(&shard->opened, 1);
+    }
+}
+
+void metrics_connection_closed(void) {
+    struct metrics_shard *shard = shard_of_thread();
+
+    if(shard != NULL) {
+        add(&shard->closed, 1);
+    }
+}
+
+void metrics_header_received(struct client *client) {
+    record(PHASE_HEADER, client->request_started);
+
+    client->header_received = metrics_now();
+}
+
+void metrics_reply_progress(struct client *client) {
+    if(client->first_byte_sent == 0) {
+        record(PHASE_FIRST_BYTE, client->header_received);
+
+        client->first_byte_sent = metrics_now();
+    }
+}
+
+static void count_outcome(int outcome, unsigned long bytes) {
+    struct metrics_shard *shard = shard_of_thread();
+
+    if(shard != NULL) {
+        add(&shard->replies[outcome], 1);
+        add(&shard->bytes_sent, bytes);
+    }
+}
+
+void metrics_reply_sent(struct client *client) {
+    record(PHASE_TRANSFER, client->first_byte_sent);
+
+    int outcome = (client->status == STATUS_404) ? 2 : (client->status == STATUS_403) ? 1 : (client->status == STATUS_503) ? 4 : 0;
+
+    count_outcome(outcome, reply_length(client));
+}
+
+void metrics_request_failed(void) {
+    count_outcome(3, 0);
+}
+
+/**
+ * Output being formatted, which silently stops growing when full.
+ */
+struct snapshot {
+    char *data;
+    size_t length;
+};
+
+__attribute__((format(printf, 2, 3)))
+static void append(struct snapshot *snapshot, const char *format, ...) {
+    va_list arguments;
+
+    va_start(arguments, format);
+
+    int length = vsnprintf(snapshot->data + snapshot->length, SNAPSHOT_BYTES - snapshot->length, format, arguments);
+
+    va_end(arguments);
+
+    if(length > 0) {
+        snapshot->length += ((size_t) length < SNAPSHOT_BYTES - snapshot->length) ? (size_t) length : SNAPSHOT_BYTES - snapshot->length - 1;
+    }
+}
+
+static void append_latencies(struct snapshot *snapshot, int phase) {
+    static unsigned long buckets[HISTOGRAM_BUCKETS];
+    static pthread_mutex_t buckets_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    unsigned long count = 0;
+    unsigned long long sum = 0;
+    int highest = -1;
+
+    pthread_mutex_lock(&buckets_mutex);
+
+    memset(buckets, 0, sizeof(buckets));
+
+    for(struct metrics_shard *shard = atomic_load(&shards); shard != NULL; shard = shard->next) {
+        for(int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            buckets[i] += atomic_load_explicit(&shard->latency[phase][i], memory_order_relaxed);
+        }
+
+        sum += atomic_load_explicit(&shard->latency_sum[phase], memory_order_relaxed);
+    }
+
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if(buckets[i] > 0) {
+            count += buckets[i];
+            highest = i;
+        }
+    }
+
+    // Each quantile is reported as the largest value of the bucket it falls in
+    int q = 0;
+    unsigned long seen = 0;
+
+    for(int i = 0; i <= highest && q < (int) (sizeof(quantiles) / sizeof(quantiles[0])); i++) {
+        seen += buckets[i];
+
+        while(q < (int) (sizeof(quantiles) / sizeof(quantiles[0])) && seen >= quantiles[q] * count && seen > 0) {
+            append(snapshot, "webserver_latency_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n", phase_names[phase], quantiles[q], bucket_limit(i) / 1e9);
+            q++;
+        }
+    }
+
+    pthread_mutex_unlock(&buckets_mutex);
+
+    append(snapshot, "webserver_latency_seconds_max{phase=\"%s\"} %.9f\n", phase_names[phase], (highest >= 0) ? bucket_limit(highest) / 1e9 : 0.0);
+    append(snapshot, "webserver_latency_seconds_sum{phase=\"%s\"} %.9f\n", phase_names[phase], sum / 1e9);
+    append(snapshot, "webserver_latency_seconds_count{phase=\"%s\"} %lu\n", phase_names[phase], count);
+}
+
+/**
+ * Formats a snapshot of all shards into \p snapshot.
+ */
+static void take_snapshot(struct snapshot *snapshot) {
+    unsigned long replies[OUTCOMES] = {0};
+    unsigned long bytes_sent = 0;
+    unsigned long opened = 0;
+    unsigned long closed = 0;
+
+    for(struct metrics_shard *shard = atomic_load(&shards); shard != NULL; shard = shard->next) {
+        for(int i = 0; i < OUTCOMES; i++) {
+            replies[i] += atomic_load_explicit(&shard->replies[i], memory_order_relaxed);
+        }
+
+        bytes_sent += atomic_load_explicit(&shard->bytes_sent, memory_order_relaxed);
+        opened += atomic_load_explicit(&shard->opened, memory_order_relaxed);
+        closed += atomic_load_explicit(&shard->closed, memory_order_relaxed);
+    }
+
+    append(snapshot, "# TYPE webserver_replies_total counter\n");
+
+    for(int i = 0; i < OUTCOMES; i++) {
+        append(snapshot, "webserver_replies_total{status=\"%s\"} %lu\n", outcome_names[i], replies[i]);
+    }
+
+    append(snapshot, "# TYPE webserver_sent_bytes_total counter\n");
+    append(snapshot, "webserver_sent_bytes_total %lu\n", bytes_sent);
+
+    append(snapshot, "# TYPE webserver_open_connections gauge\n");
+    append(snapshot, "webserver_open_connections %ld\n", (opened > closed) ? (long) (opened - closed) : 0L);
+
+    append(snapshot, "# TYPE webserver_thread_pool_queued gauge\n");
+    append(snapshot, "webserver_thread_pool_queued %ld\n", queued_requests());
+
+    append(snapshot, "# TYPE webserver_latency_seconds summary\n");
+
+    for(int phase = 0; phase < PHASES; phase++) {
+        append_latencies(snapshot, phase);
+    }
+}
+
+void metrics_write(int fd) {
+    struct snapshot snapshot = {.data = (char *) malloc(SNAPSHOT_BYTES), .length = 0};
+
+    if(snapshot.data == NULL) {
+        return;
+    }
+
+    take_snapshot(&snapshot);
+
+    for(size_t written = 0; written < snapshot.length;) {
+        ssize_t result = write(fd, snapshot.data + written, snapshot.length - written);
+
+        if(result == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        written += result;
+    }
+
+    free(snapshot.data);
+}
+
+struct content *metrics_content(char *protocol) {
+    struct snapshot body = {.data = (char *) malloc(SNAPSHOT_BYTES), .length = 0};
+
+    if(body.data == NULL) {
+        return NULL;
+    }
+
+    take_snapshot(&body);
+
+    char header[256];
+    int header_length = snprintf(header, sizeof(header), "%s 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nCache-Control: no-store\r\nContent-Length: %zu\r\n\r\n", protocol, body.length);
+
+    struct content *content = (struct content *) calloc(1, sizeof(struct content));
+
+    if(content == NULL || (content->data = (char *) malloc(header_length + body.length)) == NULL) {
+        free(content);
+        free(body.data);
+        return NULL;
+    }
+
+    memcpy(content->data, header, header_length);
+    memcpy(content->data + header_length, body.data, body.length);
+
+    free(body.data);
+
+    content->length = header_length + body.length;
+    content->header_length = header_length;
+
+    atomic_init(&content->references, 1);
+
+    return content;
+}
+
+static void *dump_loop(void *argument) {
+    sigset_t *signals = (sigset_t *) argument;
+    int signal;
+
+    for(;;) {
+        if(sigwait(signals, &signal) == 0) {
+            metrics_write(STDERR_FILENO);
+        }
+    }
+
+    return NULL;
+}
+
+int metrics_start(void) {
+    static sigset_t signals;
+
+    if(running) {
+        return 0;
+    }
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    // Threads created from now on inherit the mask: only the dumper receives SIGUSR1
+    if(pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        return -1;
+    }
+
+    if(pthread_create(&dumper, NULL, dump_loop, &signals) != 0) {
+        return -1;
+    }
+
+    pthread_detach(dumper);
+
+    running = 1;
+
+    return 0;
+}
+
+int metrics_share(int nprocesses) {
+    void *memory = mmap(NULL, nprocesses * sizeof(struct metrics_shard), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(memory == MAP_FAILED) {
+        return -1;
+    }
+
+    // The mapping is zeroed, and sits at the same address in every process forked from now on
+    shared_shards = (struct metrics_shard *) memory;
+
+    for(int i = 0; i < nprocesses; i++) {
+        publish(&shared_shards[i]);
+    }
+
+    return 0;
+}
+
+void metrics_use_slot(int slot) {
+    // Without shared memory, each process keeps to shards of its own
+    if(shared_shards != NULL) {
+        thread_shard = &shared_shards[slot];
+    }
+}
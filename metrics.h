@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+
+#include "clients_common.h"
+
+// Reserved path answered with a snapshot of the metrics (as a filename, without the leading slash)
+#define METRICS_PATH    "__metrics"
+
+// Phases of a request whose latency is recorded
+#define PHASE_HEADER        0   // From the accept (or the first byte of a later request) to the complete header
+#define PHASE_FIRST_BYTE    1   // From the complete header to the first byte of the reply
+#define PHASE_TRANSFER      2   // From the first to the last byte of the reply
+#define PHASES              3
+
+// Histograms are log-linear, as in HdrHistogram: each power of two is split into 2^HISTOGRAM_SUB_BITS buckets,
+// so a value is known within 1/16 (about 6%) of itself, from nanoseconds to minutes.
+#define HISTOGRAM_SUB_BITS  4
+#define HISTOGRAM_BUCKETS   ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// Replies counted by outcome: STATUS_OK, STATUS_403, STATUS_404, STATUS_BAD and STATUS_503
+#define OUTCOMES            5
+
+/**
+ * Metrics recorded by one thread. Only that thread writes them, so they are updated without atomic
+ * read-modify-write operations; snapshots add up the shards of all threads.
+ */
+struct metrics_shard {
+    atomic_ulong latency[PHASES][HISTOGRAM_BUCKETS];    // Nanoseconds
+    atomic_ulong latency_sum[PHASES];
+
+    atomic_ulong replies[OUTCOMES];
+    atomic_ulong bytes_sent;
+
+    atomic_ulong opened;    // Connections; those open are opened - closed over all shards
+    atomic_ulong closed;
+
+    struct metrics_shard *next;
+};
+
+/**
+ * Starts the thread that writes a snapshot to the standard error on SIGUSR1. Must be called before any other thread
+ * is created, so that they all inherit SIGUSR1 blocked. Does nothing if it is running already.
+ *
+ * @return 0 on success; -1 on failure.
+ */
+int metrics_start(void);
+
+/**
+ * Places the shards of \p nprocesses processes in memory shared with the processes forked afterwards (fork mode),
+ * so that a snapshot taken in any of them covers all of them.
+ *
+ * @return 0 on success; -1 on failure.
+ */
+int metrics_share(int nprocesses);
+
+/**
+ * Makes the calling process (forked after metrics_share()) record its metrics in the shared shard \p slot.
+ */
+void metrics_use_slot(int slot);
+
+/**
+ * @return The current time, in nanoseconds, of the clock used for latencies.
+ */
+unsigned long long metrics_now(void);
+
+void metrics_connection_opened(void);
+void metrics_connection_closed(void);
+
+/**
+ * Takes note that the header of the request of \p client is complete.
+ */
+void metrics_header_received(struct client *client);
+
+/**
+ * Takes note that \p client sent some of its reply (only the first call per reply matters).
+ */
+void metrics_reply_progress(struct client *client);
+
+/**
+ * Takes note that the reply of \p client has been sent completely, counting it with its status and size.
+ */
+void metrics_reply_sent(struct client *client);
+
+/**
+ * Counts a request that failed (STATUS_BAD).
+ */
+void metrics_request_failed(void);
+
+/**
+ * Writes a snapshot of the metrics to \p fd, in the Prometheus text format.
+ */
+void metrics_write(int fd);
+
+struct content;
+
+/**
+ * @return A complete "200 OK" response to a request for METRICS_PATH in \p protocol, holding a snapshot;
+ *         NULL if memory is exhausted. It is not cached: it goes away once its reference is released.
+ */
+struct content *metrics_content(char *protocol);
+
+#endif /* METRICS_H */
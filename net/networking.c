@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2018, Hammurabi Mendes.
+ * License: BSD 2-clause
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "networking.h"
+
+// Connections waiting to be accepted, beyond which the kernel refuses new ones
+#define BACKLOG SOMAXCONN
+
+int create_server(int port) {
+    struct addrinfo hints;
+    struct addrinfo *results;
+    char service[16];
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    snprintf(service, sizeof(service), "%d", port);
+
+    int error = getaddrinfo(NULL, service, &hints, &results);
+
+    if(error != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
+        return -1;
+    }
+
+    int accept_socket = -1;
+
+    // The first address that can be bound is used
+    for(struct addrinfo *result = results; result != NULL; result = result->ai_next) {
+        int one = 1;
+
+        accept_socket = socket(result->ai_family, result->ai_socktype | SOCK_CLOEXEC, result->ai_protocol);
+
+        if(accept_socket == -1) {
+            continue;
+        }
+
+        // A restarted server binds again right away, despite connections of the previous one in TIME_WAIT
+        if(setsockopt(accept_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int)) == 0 && bind(accept_socket, result->ai_addr, result->ai_addrlen) == 0 && listen(accept_socket, BACKLOG) == 0) {
+            break;
+        }
+
+        close(accept_socket);
+        accept_socket = -1;
+    }
+
+    freeaddrinfo(results);
+
+    if(accept_socket == -1) {
+        fprintf(stderr, "Cannot find address to bind.\n");
+    }
+
+    return accept_socket;
+}
+
+int accept_client(int accept_socket) {
+    return accept(accept_socket, NULL, NULL);
+}
+
+void make_nonblocking(int socket, int flag) {
+    int flags = fcntl(socket, F_GETFL);
+
+    if(flags == -1) {
+        perror("fcntl(F_GETFL)");
+        return;
+    }
+
+    flags = flag ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+
+    if(fcntl(socket, F_SETFL, flags) == -1) {
+        perror("fcntl(F_SETFL)");
+    }
+}
+
+int create_client(char *destination, char *port) {
+    struct addrinfo hints;
+    struct addrinfo *results;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if(getaddrinfo(destination, port, &hints, &results) != 0) {
+        return -1;
+    }
+
+    int connected_socket = -1;
+
+    for(struct addrinfo *result = results; result != NULL; result = result->ai_next) {
+        connected_socket = socket(result->ai_family, result->ai_socktype | SOCK_CLOEXEC, result->ai_protocol);
+
+        if(connected_socket == -1) {
+            continue;
+        }
+
+        if(connect(connected_socket, result->ai_addr, result->ai_addrlen) == 0) {
+            break;
+        }
+
+        close(connected_socket);
+        connected_socket = -1;
+    }
+
+    freeaddrinfo(results);
+
+    return connected_socket;
+}
+
+void get_200(char *buffer, char *filename, char *protocol, int filesize) {
+    snprintf(buffer, BUFFER_SIZE, "%s 200 OK\r\nFilename: %s\r\nContent-Length: %d\r\n\r\n", protocol, filename, filesize);
+}
+
+void get_403(char *buffer, char *filename, char *protocol) {
+    snprintf(buffer, BUFFER_SIZE, "%s 403 Forbidden\r\nFilename: %s\r\n\r\n<HTML><HEAD><TITLE>File cannot be opened</TITLE></HEAD><BODY>The file %s cannot be opened.</BODY></HTML>", protocol, filename, filename);
+}
+
+void get_404(char *buffer, char *filename, char *protocol) {
+    snprintf(buffer, BUFFER_SIZE, "%s 404 Not Found\r\nFilename: %s\r\n\r\n<HTML><HEAD><TITLE>File not found</TITLE></HEAD><BODY>The file %s was not found.</BODY></HTML>", protocol, filename, filename);
+}
+
+void get_503(char *buffer, char *protocol) {
+    snprintf(buffer, BUFFER_SIZE, "%s 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n", protocol);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Hands blocking disk operations from the event loops to the thread pool, and their completions back.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "offload.h"
+#include "thread_pool.h"
+
+int init_offload_queue(struct offload_queue *queue) {
+    pthread_mutex_init(&queue->mutex, NULL);
+
+    queue->completed = NULL;
+
+    if((queue->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("eventfd");
+
+        pthread_mutex_destroy(&queue->mutex);
+        return -1;
+    }
+
+    return 0;
+}
+
+void destroy_offload_queue(struct offload_queue *queue) {
+    close(queue->event);
+    pthread_mutex_destroy(&queue->mutex);
+}
+
+void offload(struct client *client, void (*task)(struct client *client)) {
+    client->task = task;
+
+    put_request(client);
+}
+
+void complete_offload(struct client *client) {
+    struct offload_queue *queue = client->offload;
+
+    client->task = NULL;
+
+    pthread_mutex_lock(&queue->mutex);
+
+    int was_empty = (queue->completed == NULL);
+
+    client->next_completed = queue->completed;
+    queue->completed = client;
+
+    pthread_mutex_unlock(&queue->mutex);
+
+    // The event loop may free the client from now on
+
+    if(was_empty) {
+        uint64_t one = 1;
+
+        if(write(queue->event, &one, sizeof(uint64_t)) == -1) {
+            perror("write");
+        }
+    }
+}
+
+struct client *take_completed(struct offload_queue *queue) {
+    uint64_t count;
+
+    // Reset the eventfd before taking the list: a completion racing with us either lands in the
+    // list we take, or finds the list empty and signals the eventfd again
+    ssize_t result = read(queue->event, &count, sizeof(uint64_t));
+
+    (void) result;
+
+    pthread_mutex_lock(&queue->mutex);
+
+    struct client *completed = queue->completed;
+    queue->completed = NULL;
+
+    pthread_mutex_unlock(&queue->mutex);
+
+    return completed;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <pthread.h>
+
+#include "clients_common.h"
+
+/**
+ * Where an event loop collects the clients whose blocking operations have been completed by the
+ * thread pool. The eventfd becomes readable whenever the list is not empty, so the loop can wait
+ * for completions together with its sockets.
+ */
+struct offload_queue {
+    pthread_mutex_t mutex;
+
+    struct client *completed; // Linked through client->next_completed
+
+    int event;
+};
+
+/**
+ * @return 0 on success; -1 if the eventfd cannot be created.
+ */
+int init_offload_queue(struct offload_queue *queue);
+void destroy_offload_queue(struct offload_queue *queue);
+
+/**
+ * Runs \p task on a thread pool worker, after which \p client is queued on client->offload.
+ * Until then, the event loop must not touch the client (it should be in E_WAIT_IO).
+ */
+void offload(struct client *client, void (*task)(struct client *client));
+
+/**
+ * Called by the worker that ran the task of \p client: gives the client back to its event loop.
+ */
+void complete_offload(struct client *client);
+
+/**
+ * Takes every client completed so far, and resets the eventfd.
+ *
+ * @return List of clients linked through client->next_completed.
+ */
+struct client *take_completed(struct offload_queue *queue);
+
+#endif /* OFFLOAD_H */
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Slab allocator with per-thread caches, and the size-classed pool of I/O buffers built on it.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+// Memory is taken from the system in chunks of this size. Pages are only backed once objects are carved from them.
+#define CHUNK_SIZE  (256 * 1024)
+
+// Objects moved between a thread cache and its slab at once; a cache holds at most twice as many
+#define BATCH       32
+
+// Slabs that get thread caches (any further slab always takes its lock)
+#define MAX_SLABS   16
+
+struct free_object {
+    struct free_object *next;
+};
+
+struct thread_cache {
+    struct free_object *objects;
+    int count;
+};
+
+static _Thread_local struct thread_cache thread_caches[MAX_SLABS];
+
+static atomic_int nslabs;
+
+static struct slab buffer_slabs[BUFFER_CLASSES] = {
+    SLAB_INITIALIZER(BUFFER_MIN_SIZE),
+    SLAB_INITIALIZER(BUFFER_MIN_SIZE << 1),
+    SLAB_INITIALIZER(BUFFER_MIN_SIZE << 2),
+    SLAB_INITIALIZER(BUFFER_MIN_SIZE << 3),
+};
+
+/**
+ * @return The cache of \p slab for the calling thread, or NULL if the slab has none.
+ */
+static struct thread_cache *cache_of(struct slab *slab) {
+    int index = atomic_load_explicit(&slab->index, memory_order_relaxed);
+
+    if(index == -1) {
+        // Racing threads may each take a position: only the first one to publish it is used
+        int expected = -1;
+
+        index = atomic_fetch_add(&nslabs, 1);
+
+        if(!atomic_compare_exchange_strong(&slab->index, &expected, index)) {
+            index = expected;
+        }
+    }
+
+    return (index < MAX_SLABS) ? &thread_caches[index] : NULL;
+}
+
+/**
+ * Carves an object out of the last chunk of \p slab, taking a new chunk if it is used up. Called with the lock held.
+ */
+static void *carve(struct slab *slab) {
+    if(slab->fresh == NULL || slab->fresh + slab->object_size > slab->fresh_end) {
+        void *chunk = mmap(NULL, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if(chunk == MAP_FAILED) {
+            return NULL;
+        }
+
+        slab->fresh = (char *) chunk;
+        slab->fresh_end = slab->fresh + CHUNK_SIZE;
+    }
+
+    void *object = slab->fresh;
+
+    slab->fresh += slab->object_size;
+
+    return object;
+}
+
+void *slab_alloc(struct slab *slab) {
+    struct thread_cache *cache = cache_of(slab);
+
+    if(cache != NULL && cache->objects != NULL) {
+        struct free_object *object = cache->objects;
+
+        cache->objects = object->next;
+        cache->count--;
+
+        return object;
+    }
+
+    pthread_mutex_lock(&slab->mutex);
+
+    void *object;
+
+    if(slab->objects != NULL) {
+        object = slab->objects;
+        slab->objects = slab->objects->next;
+
+        // Refill the thread cache, so that the next allocations take no lock
+        for(int i = 0; cache != NULL && i < BATCH && slab->objects != NULL; i++) {
+            struct free_object *moved = slab->objects;
+
+            slab->objects = moved->next;
+            moved->next = cache->objects;
+            cache->objects = moved;
+            cache->count++;
+        }
+    }
+    else {
+        object = carve(slab);
+    }
+
+    pthread_mutex_unlock(&slab->mutex);
+
+    return object;
+}
+
+void slab_free(struct slab *slab, void *object) {
+    struct thread_cache *cache = cache_of(slab);
+    struct free_object *freed = (struct free_object *) object;
+
+    if(cache != NULL && cache->count < 2 * BATCH) {
+        freed->next = cache->objects;
+        cache->objects = freed;
+        cache->count++;
+
+        return;
+    }
+
+    pthread_mutex_lock(&slab->mutex);
+
+    freed->next = slab->objects;
+    slab->objects = freed;
+
+    // The cache is full: hand half of it back, so that objects freed by one thread reach the others
+    for(int i = 0; cache != NULL && i < BATCH; i++) {
+        struct free_object *moved = cache->objects;
+
+        cache->objects = moved->next;
+        cache->count--;
+
+        moved->next = slab->objects;
+        slab->objects = moved;
+    }
+
+    pthread_mutex_unlock(&slab->mutex);
+}
+
+/**
+ * @return The slab of the smallest buffer class holding \p size bytes, or NULL if there is none.
+ */
+static struct slab *buffer_class(size_t size) {
+    size_t class_size = BUFFER_MIN_SIZE;
+
+    for(int i = 0; i < BUFFER_CLASSES; i++, class_size <<= 1) {
+        if(size <= class_size) {
+            return &buffer_slabs[i];
+        }
+    }
+
+    return NULL;
+}
+
+char *buffer_alloc(size_t size) {
+    struct slab *slab = buffer_class(size);
+
+    return (slab != NULL) ? (char *) slab_alloc(slab) : NULL;
+}
+
+void buffer_free(char *buffer, size_t size) {
+    if(buffer != NULL) {
+        slab_free(buffer_class(size), buffer);
+    }
+}
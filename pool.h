@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Objects are aligned to (and their sizes rounded up to) cache lines
+#define SLAB_ALIGNMENT      64
+
+// The buffer size classes are powers of two, from BUFFER_MIN_SIZE to BUFFER_MAX_SIZE bytes
+#define BUFFER_MIN_SIZE     512
+#define BUFFER_MAX_SIZE     4096
+#define BUFFER_CLASSES      4
+
+struct free_object;
+
+/**
+ * Allocator for objects of a single size. Memory is taken from the system in large chunks, carved into objects
+ * as they are needed, and never given back: freed objects are kept for reuse. Each thread keeps a small cache of
+ * free objects, so that most allocations and frees take no lock; the caches exchange objects with the slab in
+ * batches. Objects may be freed by a thread other than the one that allocated them.
+ */
+struct slab {
+    size_t object_size;
+
+    atomic_int index;               // Position of the slab's thread caches, assigned on first use
+
+    pthread_mutex_t mutex;          // Protects the fields below
+
+    struct free_object *objects;    // Objects freed by the thread caches
+    char *fresh;                    // Part of the last chunk not carved into objects yet
+    char *fresh_end;
+};
+
+#define SLAB_INITIALIZER(size) { \
+    .object_size = ((size) + SLAB_ALIGNMENT - 1) / SLAB_ALIGNMENT * SLAB_ALIGNMENT, \
+    .index = -1, \
+    .mutex = PTHREAD_MUTEX_INITIALIZER, \
+}
+
+/**
+ * @return An object of \p slab, with undefined contents; NULL if memory is exhausted.
+ */
+void *slab_alloc(struct slab *slab);
+
+/**
+ * Gives \p object back to \p slab.
+ */
+void slab_free(struct slab *slab, void *object);
+
+/**
+ * @return A buffer of at least \p size bytes (at most BUFFER_MAX_SIZE) from the smallest size class that fits;
+ *         NULL if \p size is too large or memory is exhausted.
+ */
+char *buffer_alloc(size_t size);
+
+/**
+ * Gives back \p buffer, obtained from buffer_alloc() with the same \p size.
+ */
+void buffer_free(char *buffer, size_t size);
+
+#endif /* POOL_H */
@@ -0,0 +1,494 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Edge-triggered epoll(7) backend for the state machine server.
+ * Several independent event loops ("reactors") can run in parallel, one per thread.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include "server_epoll.h"
+
+#include "clients_statemachine.h"
+
+#include "networking.h"
+#include "config.h"
+#include "access_log.h"
+#include "docroot_index.h"
+#include "metrics.h"
+#include "offload.h"
+#include "thread_pool.h"
+
+#define MAX_EVENTS      256
+
+// Upper bound on state machine steps per client per wakeup, so one large reply cannot starve the others
+#define MAX_STEPS       64
+
+/**
+ * One event loop. Reactors share nothing on the hot path: each has its own epoll set, its own
+ * connection table and, when SO_REUSEPORT is available, its own accept socket (the kernel spreads
+ * incoming connections across them).
+ */
+struct reactor {
+    int accept_socket;
+    int epoll_descriptor;
+    int wakeup;             // eventfd used to interrupt epoll_wait() on termination
+
+    int accept_pending;     // Whether connections may be left in the backlog (edge-triggered: no new event comes for them)
+
+    struct client_table table;
+
+    struct offload_queue completions;
+
+    pthread_t thread;
+};
+
+static void setup_signal_handler(int signal, void (*handler)(int));
+static void handle_termination(int signal);
+
+static int create_reuseport_server(char *port);
+static int setup_reactor(struct reactor *reactor, int accept_socket, int shared);
+static void *run_reactor(void *argument);
+
+static int watch_client(int epoll_descriptor, int operation, struct client *client);
+static void accepted_client(struct client *client, void *context);
+static void drive_client(int epoll_descriptor, struct client *client, int state);
+
+// Tags for the descriptors that are not clients in the epoll sets (clients are tagged with their struct client)
+static char accept_tag;
+static char wakeup_tag;
+
+static atomic_int done = 0;
+
+int server_epoll(int argc, char **argv) {
+    if(argc < 2) {
+        fprintf(stderr, "Usage: server <port>\n");
+
+        return EXIT_FAILURE;
+    }
+
+    char *port = argv[1];
+
+    int nreactors = config.reactors;
+
+    if(nreactors == 0) {
+        nreactors = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if(nreactors < 1) {
+        nreactors = 1;
+    }
+
+    struct reactor *reactors = (struct reactor *) calloc(nreactors, sizeof(struct reactor));
+
+    if(reactors == NULL) {
+        perror("calloc");
+
+        return EXIT_FAILURE;
+    }
+
+    // Prefer one accept socket per reactor. Without SO_REUSEPORT, all reactors wait on one shared
+    // accept socket, registered with EPOLLEXCLUSIVE so that a new connection wakes up only one of them.
+    int shared_socket = -1;
+
+    for(int i = 0; i < nreactors; i++) {
+        int accept_socket = (nreactors > 1 && shared_socket == -1) ? create_reuseport_server(port) : -1;
+
+        if(accept_socket == -1) {
+            if(shared_socket == -1) {
+                if(i > 0) {
+                    fprintf(stderr, "Error creating server\n");
+
+                    return EXIT_FAILURE;
+                }
+
+                shared_socket = create_server(atoi(port));
+
+                if(shared_socket == -1) {
+                    fprintf(stderr, "Error creating server\n");
+
+                    return EXIT_FAILURE;
+                }
+
+                make_nonblocking(shared_socket, 1);
+            }
+
+            accept_socket = shared_socket;
+        }
+
+        if(setup_reactor(&reactors[i], accept_socket, nreactors > 1 && accept_socket == shared_socket) == -1) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Treat signals: only the main thread handles SIGTERM, and then wakes the reactors up. It is blocked before any
+    // thread is started, so that every thread inherits it blocked.
+    setup_signal_handler(SIGTERM, handle_termination);
+    setup_signal_handler(SIGPIPE, SIG_IGN);
+
+    sigset_t termination;
+    sigset_t previous;
+
+    sigemptyset(&termination);
+    sigaddset(&termination, SIGTERM);
+
+    pthread_sigmask(SIG_BLOCK, &termination, &previous);
+
+    // Snapshots of the metrics are written on SIGUSR1 by a thread of their own (see metrics.h)
+    if(metrics_start() == -1) {
+        fprintf(stderr, "Cannot start the metrics\n");
+    }
+
+    // Paths are looked up in an index of the document root, kept current with inotify (see docroot_index.h)
+    if(docroot_index_start() == -1) {
+        fprintf(stderr, "Cannot index the document root\n");
+    }
+
+    // Blocking disk operations of all reactors are handed to one thread pool
+    if(config.offload && start_threads() != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    // Requests are logged by a background thread (see access_log.h)
+    if(access_log_start() == -1) {
+        fprintf(stderr, "Cannot start the access log\n");
+    }
+
+    for(int i = 0; i < nreactors; i++) {
+        if(pthread_create(&reactors[i].thread, NULL, run_reactor, &reactors[i]) != 0) {
+            perror("pthread_create");
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    // SIGTERM stays blocked here except while waiting, so it cannot slip in between the check and the wait
+    while(!atomic_load(&done)) {
+        sigsuspend(&previous);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    for(int i = 0; i < nreactors; i++) {
+        uint64_t one = 1;
+
+        if(write(reactors[i].wakeup, &one, sizeof(uint64_t)) == -1) {
+            perror("write");
+        }
+    }
+
+    for(int i = 0; i < nreactors; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+
+    access_log_stop();
+
+    printf("Finishing program cleanly... %ld operations served\n", operations_completed);
+
+    // If we are here, we got a termination signal
+    // Go over all clients and close their sockets (after the workers have stopped using them)
+    if(config.offload) {
+        finish_threads();
+    }
+
+    for(int i = 0; i < nreactors; i++) {
+        destroy(&reactors[i].table);
+
+        if(config.offload) {
+            destroy_offload_queue(&reactors[i].completions);
+        }
+
+        close(reactors[i].epoll_descriptor);
+        close(reactors[i].wakeup);
+
+        if(reactors[i].accept_socket != shared_socket) {
+            close(reactors[i].accept_socket);
+        }
+    }
+
+    if(shared_socket != -1) {
+        close(shared_socket);
+    }
+
+    free(reactors);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Creates a non-blocking accept socket bound with SO_REUSEPORT, so that several of them can listen on \p port.
+ *
+ * @return The server socket, or -1 if SO_REUSEPORT is unavailable or an error is found.
+ */
+static int create_reuseport_server(char *port) {
+    struct addrinfo hints;
+    struct addrinfo *results;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if(getaddrinfo(NULL, port, &hints, &results) != 0) {
+        return -1;
+    }
+
+    int accept_socket = -1;
+
+    for(struct addrinfo *result = results; result != NULL; result = result->ai_next) {
+        int one = 1;
+
+        accept_socket = socket(result->ai_family, result->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, result->ai_protocol);
+
+        if(accept_socket == -1) {
+            continue;
+        }
+
+        if(setsockopt(accept_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int)) == 0 && setsockopt(accept_socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(int)) == 0 && bind(accept_socket, result->ai_addr, result->ai_addrlen) == 0 && listen(accept_socket, SOMAXCONN) == 0) {
+            break;
+        }
+
+        close(accept_socket);
+        accept_socket = -1;
+    }
+
+    freeaddrinfo(results);
+
+    return accept_socket;
+}
+
+/**
+ * Creates the epoll set of \p reactor, and registers its accept socket and wakeup descriptor in it.
+ *
+ * @return 0 on success; -1 if an error is found.
+ */
+static int setup_reactor(struct reactor *reactor, int accept_socket, int shared) {
+    reactor->accept_socket = accept_socket;
+
+    // Start table of clients
+    init(&reactor->table);
+
+    if((reactor->epoll_descriptor = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+
+        return -1;
+    }
+
+    if((reactor->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("eventfd");
+
+        return -1;
+    }
+
+    struct epoll_event event;
+
+    event.events = EPOLLIN | EPOLLET | (shared ? EPOLLEXCLUSIVE : 0);
+    event.data.ptr = &accept_tag;
+
+    if(epoll_ctl(reactor->epoll_descriptor, EPOLL_CTL_ADD, accept_socket, &event) == -1) {
+        perror("epoll_ctl");
+
+        return -1;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &wakeup_tag;
+
+    if(epoll_ctl(reactor->epoll_descriptor, EPOLL_CTL_ADD, reactor->wakeup, &event) == -1) {
+        perror("epoll_ctl");
+
+        return -1;
+    }
+
+    if(config.offload) {
+        if(init_offload_queue(&reactor->completions) == -1) {
+            return -1;
+        }
+
+        // Completions are tagged with the queue itself
+        event.events = EPOLLIN;
+        event.data.ptr = &reactor->completions;
+
+        if(epoll_ctl(reactor->epoll_descriptor, EPOLL_CTL_ADD, reactor->completions.event, &event) == -1) {
+            perror("epoll_ctl");
+
+            return -1;
+        }
+
+        reactor->table.offload = &reactor->completions;
+    }
+
+    return 0;
+}
+
+static void *run_reactor(void *argument) {
+    struct reactor *reactor = (struct reactor *) argument;
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while(!atomic_load(&done)) {
+        // Only descriptors that became ready are returned, so the cost of each wakeup is O(ready).
+        // Without events, the loop wakes up for the next deadline of a client.
+        // Connections left in the backlog are accepted right away if possible, or retried soon if the process is at
+        // its connection limit (the connections that free it may belong to other reactors) or out of descriptors.
+        int timeout = (int) next_deadline(&reactor->table);
+
+        if(reactor->accept_pending) {
+            int retry = (int) accept_backoff();
+
+            if(retry == 0 && connection_slots() <= 0) {
+                retry = ACCEPT_RETRY;
+            }
+
+            timeout = (timeout == -1 || timeout > retry) ? retry : timeout;
+        }
+
+        int nready = epoll_wait(reactor->epoll_descriptor, events, MAX_EVENTS, timeout);
+
+        if(nready == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            perror("epoll_wait");
+            break;
+        }
+
+        for(int i = 0; i < nready; i++) {
+            if(events[i].data.ptr == &accept_tag) {
+                reactor->accept_pending = 1;
+            }
+            else if(events[i].data.ptr == &reactor->completions) {
+                struct client *next;
+
+                for(struct client *client = take_completed(&reactor->completions); client != NULL; client = next) {
+                    next = client->next_completed;
+
+                    complete_task(client);
+                    drive_client(reactor->epoll_descriptor, client, E_WAIT_IO);
+                }
+            }
+            else if(events[i].data.ptr != &wakeup_tag) {
+                struct client *client = (struct client *) events[i].data.ptr;
+
+                drive_client(reactor->epoll_descriptor, client, client->state);
+            }
+        }
+
+        // After the events, so that none of them refers to a client finished here
+        expire_clients(&reactor->table, NULL, NULL);
+
+        // Free the clients that finished in this batch (a later event in the same batch may still point to them)
+        reap_clients(&reactor->table);
+
+        // After the reaping, so that the connections closed here make room for new ones
+        if(reactor->accept_pending && !atomic_load(&done)) {
+            reactor->accept_pending = accept_clients(&reactor->table, reactor->accept_socket, accepted_client, &reactor->epoll_descriptor);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Registers (or re-registers) \p client in the epoll set, watching for readability while the
+ * request is being received and for writability while the reply is being sent.
+ *
+ * @return The result of epoll_ctl(2).
+ */
+static int watch_client(int epoll_descriptor, int operation, struct client *client) {
+    struct epoll_event event;
+
+    // While a worker runs an operation for the client (E_WAIT_IO), neither is watched
+    event.events = EPOLLET | EPOLLRDHUP;
+
+    if(client->state == E_RECV_REQUEST) {
+        event.events |= EPOLLIN;
+    }
+    else if(client->state == E_SEND_REPLY) {
+        event.events |= EPOLLOUT;
+    }
+    event.data.ptr = client;
+
+    return epoll_ctl(epoll_descriptor, operation, client->socket, &event);
+}
+
+/**
+ * Watches a client just accepted (see accept_clients()) in the epoll set \p context points to.
+ */
+static void accepted_client(struct client *client, void *context) {
+    if(watch_client(*(int *) context, EPOLL_CTL_ADD, client) == -1) {
+        perror("epoll_ctl");
+
+        finish_client(client);
+    }
+}
+
+/**
+ * Runs the state machine of \p client until it would block, and updates its interest in the epoll set
+ * if it left \p state (the state the current interest was registered for).
+ */
+static void drive_client(int epoll_descriptor, struct client *client, int state) {
+    int steps = 0;
+
+    // Finished earlier in the same batch (say, by a completion from the thread pool): it is only waiting to be reaped
+    if(client->socket == -1) {
+        return;
+    }
+
+    // Edge-triggered: run the state machine until the socket would block
+    while(handle_client(client)) {
+        if(++steps == MAX_STEPS) {
+            break;
+        }
+    }
+
+    if(client->socket == -1) {
+        // close(2) in finish_client() already removed the descriptor from the epoll set
+        return;
+    }
+
+    // Interest follows the state machine: EPOLLIN while receiving, EPOLLOUT while replying, nothing while waiting.
+    // Re-arming also reports the client again if we stopped early because of MAX_STEPS.
+    if(client->state != state || steps == MAX_STEPS) {
+        if(watch_client(epoll_descriptor, EPOLL_CTL_MOD, client) == -1) {
+            perror("epoll_ctl");
+
+            client->status = STATUS_BAD;
+            finish_client(client);
+        }
+    }
+}
+
+void setup_signal_handler(int signal, void (*handler)(int)) {
+    struct sigaction request;
+
+    memset(&request, 0, sizeof(struct sigaction));
+
+    request.sa_handler = handler;
+
+    if(sigaction(signal, &request, NULL) == -1) {
+        perror("sigaction");
+
+        exit(EXIT_FAILURE);
+    }
+}
+
+void handle_termination(int signal) {
+    atomic_store(&done, 1);
+}
@@ -0,0 +1,10 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef SERVER_EPOLL_H
+#define SERVER_EPOLL_H
+
+int server_epoll(int argc, char **argv);
+
+#endif /* SERVER_EPOLL_H */
@@ -1,16 +1,24 @@
 /*
  * Copyright (c) 2017, Hammurabi Mendes.
- * Licence: BSD 2-clause 
- * 
- * 
+ * Licence: BSD 2-clause
+ *
+ *
  * HW1 implementation: Awais Abid
+ *
+ * Pre-forked server: a fixed set of long-lived worker processes accept on the shared listening
+ * socket and serve one connection at a time. The master only supervises them, respawning any
+ * worker that dies.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <errno.h>
 
 #include "server_fork.h"
@@ -18,14 +26,27 @@
 #include "clients_common.h"
 
 #include "networking.h"
+#include "config.h"
+#include "access_log.h"
+#include "metrics.h"
 
-#include "thread_pool.h"
+// How long a worker blocks in accept() before checking whether it should finish (seconds)
+#define ACCEPT_TIMEOUT 1
 
-static int done = 0;
+static volatile sig_atomic_t done = 0;
+static volatile sig_atomic_t children_changed = 0;
+static volatile sig_atomic_t snapshot_requested = 0;
+
+// Operations served by all workers, in memory shared with the master
+static atomic_ulong *served;
 
 void setupSignalHandler(int signal, void (*handler)(int));
 void childHandler(int signal);
 void termHandler(int signal);
+void snapshotHandler(int signal);
+
+static pid_t spawn_worker(int accept_socket, int slot);
+static void run_worker(int accept_socket, int slot);
 
 int server_fork(int argc, char **argv) {
     if(argc < 2) {
@@ -44,59 +65,206 @@ int server_fork(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    //Setup signal handlers for SIGPIPE, SIGCHLD, and SIGTERM.
+    served = (atomic_ulong *) mmap(NULL, sizeof(atomic_ulong), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(served == MAP_FAILED) {
+        perror("mmap");
+
+        return EXIT_FAILURE;
+    }
+
+    atomic_init(served, 0);
+
+    int nprocesses = (config.processes > 0) ? config.processes : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(nprocesses < 1) {
+        nprocesses = 1;
+    }
+
+    pid_t *workers = (pid_t *) calloc(nprocesses, sizeof(pid_t));
+
+    if(workers == NULL) {
+        perror("calloc");
+
+        return EXIT_FAILURE;
+    }
+
+    // Each worker records its metrics in a slot of shared memory, so that any process can report them all
+    if(metrics_share(nprocesses) == -1) {
+        perror("mmap");
+    }
+
+    //Setup signal handlers for SIGPIPE, SIGCHLD, and SIGTERM (and SIGUSR1, which asks for a snapshot of the metrics).
 
     setupSignalHandler(SIGCHLD, childHandler);
     setupSignalHandler(SIGTERM, termHandler);
     setupSignalHandler(SIGPIPE, SIG_IGN);
+    setupSignalHandler(SIGUSR1, snapshotHandler);
+
+    // The master only wakes up for these signals, and never misses one between checking the flags and sleeping
+    sigset_t blocked, original;
+
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &blocked, &original);
+
+    for(int i = 0; i < nprocesses; i++) {
+        workers[i] = spawn_worker(accept_socket, i);
+    }
 
     while(!done) {
-        char host[1024];
-        int port;
-        int child_ID;
-        int client_socket;
+        sigsuspend(&original);
 
-        //Wait for new connections, but ignore interrupted accept_client calls because of SIGCHLD
-        if((client_socket = accept_client(accept_socket)) == -1) {
-            if(errno == EINTR) {
-                continue;
-            }
+        if(snapshot_requested) {
+            snapshot_requested = 0;
+
+            metrics_write(STDERR_FILENO);
         }
 
-        get_peer_information(client_socket, host, 1024, &port);
-        printf("New connection from %s, port %d\n", host, port); 
-        
-        //Fork a different process to handle each client
-        child_ID = fork();
+        if(!children_changed) {
+            continue;
+        }
 
-        if(child_ID == 0) {
-            struct client *client = make_client(client_socket);
-            if(read_request(client)) {
-                write_reply(client);
+        children_changed = 0;
+
+        // Collect every worker that died, and replace it
+        pid_t pid;
+        int status;
+
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for(int i = 0; i < nprocesses; i++) {
+                if(workers[i] != pid) {
+                    continue;
+                }
+
+                if(WIFSIGNALED(status)) {
+                    fprintf(stderr, "Worker %d killed by signal %d, respawning\n", pid, WTERMSIG(status));
+                }
+                else {
+                    fprintf(stderr, "Worker %d exited with status %d, respawning\n", pid, WEXITSTATUS(status));
+                }
+
+                workers[i] = done ? -1 : spawn_worker(accept_socket, i);
             }
+        }
+    }
 
-            exit(client->status);
+    // Workers finish the connection they are serving, and notice the request within ACCEPT_TIMEOUT
+    for(int i = 0; i < nprocesses; i++) {
+        if(workers[i] > 0) {
+            kill(workers[i], SIGTERM);
         }
-        else if(child_ID < 0) {
-            printf("\nfork failed\n");
-            exit(1);
+    }
+
+    for(int i = 0; i < nprocesses; i++) {
+        if(workers[i] > 0) {
+            waitpid(workers[i], NULL, 0);
         }
-        //parent closes client's socket
-        else {
-            close(client_socket);
-        } 
     }
 
+    operations_completed = atomic_load(served);
+
+    free(workers);
+    munmap(served, sizeof(atomic_ulong));
+    close(accept_socket);
+
     printf("Finishing program cleanly... %ld operations served\n", operations_completed);
 
     return EXIT_SUCCESS;
 }
 
+/**
+ * Forks a worker process serving connections from \p accept_socket, recording its metrics in \p slot.
+ *
+ * @return The process ID of the worker, or -1 if it could not be created.
+ */
+static pid_t spawn_worker(int accept_socket, int slot) {
+    pid_t child_ID = fork();
+
+    if(child_ID == 0) {
+        run_worker(accept_socket, slot);
+        exit(EXIT_SUCCESS);
+    }
+    else if(child_ID < 0) {
+        perror("fork");
+    }
+
+    return child_ID;
+}
+
+/**
+ * Worker loop: accepts and serves one connection at a time until the master asks it to finish.
+ */
+static void run_worker(int accept_socket, int slot) {
+    // The master's handlers and signal mask are inherited: restore what a worker needs
+    setupSignalHandler(SIGCHLD, SIG_DFL);
+    setupSignalHandler(SIGUSR1, SIG_IGN);
+
+    metrics_use_slot(slot);
+
+    sigset_t unblocked;
+
+    sigemptyset(&unblocked);
+    sigprocmask(SIG_SETMASK, &unblocked, NULL);
+
+    // accept() honours SO_RCVTIMEO, so a worker blocked in it still checks done periodically
+    struct timeval timeout = {.tv_sec = ACCEPT_TIMEOUT, .tv_usec = 0};
+
+    if(setsockopt(accept_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        perror("setsockopt");
+    }
+
+    // Threads do not survive fork(): each worker writes its own log
+    if(access_log_start() == -1) {
+        fprintf(stderr, "Cannot start the access log\n");
+    }
+
+    while(!done) {
+        int client_socket;
+
+        // Only one blocked worker is woken up per incoming connection
+        if((client_socket = accept_client(accept_socket)) == -1) {
+            continue;
+        }
+
+        // A worker serves one connection at a time, so a slow client must not hold it: reads and writes time out
+        struct timeval header_timeout = {.tv_sec = config.header_timeout, .tv_usec = 0};
+        struct timeval send_timeout = {.tv_sec = config.send_timeout, .tv_usec = 0};
+
+        if(setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &header_timeout, sizeof(header_timeout)) == -1 ||
+           setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout)) == -1) {
+            perror("setsockopt");
+        }
+
+        struct client *client = make_client(client_socket);
+
+        if(client == NULL) {
+            close(client_socket);
+            continue;
+        }
+
+        log_connection(client, 1);
+
+        if(read_request(client)) {
+            write_reply(client);
+        }
+
+        if(client->status == STATUS_OK) {
+            atomic_fetch_add(served, 1);
+        }
+
+        free_client(client);
+    }
+
+    access_log_stop();
+}
+
 // Step 6: Create a function to setup signal handlers, and three handlers:
 //  - The handler for SIGPIPE should ignore the signal.
 //  - The handler for SIGTERM should set the done flag to 1
-//  - The handler for SIGCHLD should collect the exit status of the child, and if it was STATUS_OK (as defined in clients_common.h),
-//    you should only then increase the operations_completed variable.
+//  - The handler for SIGCHLD should tell the master to collect (and replace) the workers that died.
 void setupSignalHandler(int signal, void (*handler)(int)) {
     struct sigaction options;
 
@@ -112,17 +280,13 @@ void setupSignalHandler(int signal, void (*handler)(int)) {
 }
 
 void childHandler(int signal) {
-    int status;
-
-    while(waitpid(-1, &status, WNOHANG) != -1) {
-        if(WIFEXITED(status)) {
-            if(WEXITSTATUS(status) == STATUS_OK) {
-                operations_completed++;
-            }
-        }
-    }
+    children_changed = 1;
 }
 
 void termHandler(int signal) {
     done = 1;
 }
+
+void snapshotHandler(int signal) {
+    snapshot_requested = 1;
+}
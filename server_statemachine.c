@@ -12,13 +12,21 @@
 #include <unistd.h>
 #include <sys/select.h>
 #include <signal.h>
+#include <pthread.h>
 #include <errno.h>
+#include <time.h>
 
 #include "server_statemachine.h"
 
 #include "clients_statemachine.h"
 
 #include "networking.h"
+#include "config.h"
+#include "access_log.h"
+#include "docroot_index.h"
+#include "metrics.h"
+#include "offload.h"
+#include "thread_pool.h"
 
 //#include "thread_pool.h"
 
@@ -52,8 +60,50 @@ int server_statemachine(int argc, char **argv) {
     setup_signal_handler(SIGTERM, handle_termination);
     setup_signal_handler(SIGPIPE, SIG_IGN);
 
-    // Start linked list of clients
-    init();
+    // Start table of clients
+    struct client_table table;
+
+    init(&table);
+
+    // Only this thread takes SIGTERM, so that it interrupts select(): the threads started from here on inherit it blocked
+    sigset_t termination;
+    sigset_t previous;
+
+    sigemptyset(&termination);
+    sigaddset(&termination, SIGTERM);
+
+    pthread_sigmask(SIG_BLOCK, &termination, &previous);
+
+    // Snapshots of the metrics are written on SIGUSR1 by a thread of their own (see metrics.h)
+    if(metrics_start() == -1) {
+        fprintf(stderr, "Cannot start the metrics\n");
+    }
+
+    // Paths are looked up in an index of the document root, kept current with inotify (see docroot_index.h)
+    if(docroot_index_start() == -1) {
+        fprintf(stderr, "Cannot index the document root\n");
+    }
+
+    // Blocking disk operations are handed to the thread pool, and their completions come back through an eventfd
+    struct offload_queue completions;
+
+    if(config.offload) {
+        if(init_offload_queue(&completions) == -1 || start_threads() != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+
+        table.offload = &completions;
+    }
+
+    // Requests are logged by a background thread (see access_log.h)
+    if(access_log_start() == -1) {
+        fprintf(stderr, "Cannot start the access log\n");
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    // select() only watches descriptors below FD_SETSIZE: the clients share them with cached files and those opened so far
+    limit_descriptors(FD_SETSIZE);
 
     struct client *current;
 
@@ -62,21 +112,41 @@ int server_statemachine(int argc, char **argv) {
     fd_set set_read;
     fd_set set_write;
 
+    // The wait ends at the next deadline of a client, if any
+    struct timeval timeout;
+
     while(!done) {
         // Zero read and write sets
         FD_ZERO(&set_read);
         FD_ZERO(&set_write);
 
-        // Add the accept socket into the read set
-        FD_SET(accept_socket, &set_read);
+        // Add the accept socket into the read set, unless the connection limit has been reached: new connections
+        // then wait in the backlog until some of ours close. After running out of descriptors, it is left out for a
+        // while (it stays readable, so watching it would only spin).
         maximum_descriptor = accept_socket;
 
+        long backoff = accept_backoff();
+
+        if(connection_slots() > 0 && backoff == 0) {
+            FD_SET(accept_socket, &set_read);
+        }
+
+        if(table.offload != NULL) {
+            FD_SET(completions.event, &set_read);
+
+            if(completions.event > maximum_descriptor) {
+                maximum_descriptor = completions.event;
+            }
+        }
+
         //Iterate over all currently accepted clients, and:
         //  - If a client's state is E_RECV_REQUEST, add the client to the read set
         //  - If a client's state is E_SEND_REPLY, add the client to the write set
         // calculate the maximum descriptor number among the acceptance socket,
         // and all the client sockets in the loop.
-        for(current = head; current != NULL; current = current->next) {
+        for(int i = 0; i < table.size; i++) {
+            current = table.clients[i];
+
             if(current->state == E_RECV_REQUEST) {
                 FD_SET(current->socket, &set_read);
             }
@@ -93,43 +163,78 @@ int server_statemachine(int argc, char **argv) {
         // If new data comes from an accepted client, its socket is marked as readable;
         // If new data can be written to an accepted client without blocking, its socket is marked as writeable.
         
-        result = select(maximum_descriptor + 1, &set_read, &set_write, NULL, NULL);
+        long wait = next_deadline(&table);
+
+        if(backoff > 0 && (wait == -1 || wait > backoff)) {
+            wait = backoff;
+        }
+
+        timeout.tv_sec = wait / 1000;
+        timeout.tv_usec = (wait % 1000) * 1000;
+
+        result = select(maximum_descriptor + 1, &set_read, &set_write, NULL, (wait >= 0) ? &timeout : NULL);
+
+        if(result == -1) {
+            // Interrupted by a signal: the sets are not meaningful
+            continue;
+        }
+
 
         // If you are here, some socket is ready to be written or to be read from.
-        // Test if accept socket has been flagged ready for reading and insert client
+        // Test if accept socket has been flagged ready for reading and insert clients, a batch at a time (the socket
+        // is level-triggered, so the rest of a storm is accepted in the next rounds)
         if(FD_ISSET(accept_socket, &set_read)) {
-            char host[1024];
-            int port;
-
-            int client_socket = accept_client(accept_socket);
+            accept_clients(&table, accept_socket, NULL, NULL);
+        }
 
-            get_peer_information(client_socket, host, 1024, &port);
-            printf("New connection from %s, port %d\n", host, port);
+        // Resume the clients whose offloaded operations have completed
+        if(table.offload != NULL && FD_ISSET(completions.event, &set_read)) {
+            struct client *next;
 
-            make_nonblocking(client_socket, 1);
+            for(current = take_completed(&completions); current != NULL; current = next) {
+                next = current->next_completed;
 
-            //Inserts the client into the list
-            insert_client(client_socket);
+                complete_task(current);
+                handle_client(current);
+            }
         }
 
         // Iterate over all currently accepted clients [an example of iteration if given below]
         //     If the client is ready for reading OR ready for writing then call handle_client(client), passing the client pointer.
-        for(current = head; current != NULL; current = current->next) {
+        // (clients finished during this pass are only queued for reaping, so the table stays put while we iterate)
+        for(int i = 0; i < table.size; i++) {
+            current = table.clients[i];
+
+            if(current->socket == -1) {
+                continue;
+            }
+
             if(FD_ISSET(current->socket, &set_read) || FD_ISSET(current->socket, &set_write)) {
                 handle_client(current);
             }
         }
 
+        // Close the clients whose deadline has passed
+        expire_clients(&table, NULL, NULL);
+
         // Remove dead clients after we process them above
-        while(remove_client(-1)) {};
+        reap_clients(&table);
     }
 
+    access_log_stop();
+
     printf("Finishing program cleanly... %ld operations served\n", operations_completed);
 
     // If we are here, we got a termination signal
-    // Go over all clients and close their sockets
-    for(current = head; current != NULL; current = current->next) {
-        close(current->socket);
+    // Go over all clients and close their sockets (after the workers have stopped using them)
+    if(config.offload) {
+        finish_threads();
+    }
+
+    destroy(&table);
+
+    if(config.offload) {
+        destroy_offload_queue(&completions);
     }
 
     return EXIT_SUCCESS;
@@ -0,0 +1,811 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * io_uring(7) backend for the state machine server. Instead of waiting for readiness and then making one
+ * system call per operation, the loop queues accepts, receives, sends and file reads in a submission ring,
+ * and hands all of them to the kernel with a single io_uring_enter(2), which also collects their completions.
+ * Client sockets are registered as fixed files, and file data is read into registered buffers.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "server_uring.h"
+#include "server_epoll.h"
+
+#include "clients_statemachine.h"
+#include "file_transfer.h"
+
+#include "networking.h"
+#include "config.h"
+#include "access_log.h"
+#include "docroot_index.h"
+#include "metrics.h"
+#include "offload.h"
+#include "thread_pool.h"
+#include "uring.h"
+
+#define RING_ENTRIES        1024
+
+// Accept operations kept in flight, so that a burst of connections is accepted in one batch
+#define ACCEPTS             16
+
+// Sockets with descriptors below this are registered as fixed files
+#define FIXED_FILES         4096
+
+// Registered buffers that file data is read into before being sent
+#define FIXED_BUFFERS       64
+#define FIXED_BUFFER_SIZE   (64 * 1024)
+
+// Operations are identified by the low bits of their user data; the other bits hold the client, if any
+#define OP_ACCEPT           1
+#define OP_WAKEUP           2
+#define OP_COMPLETIONS      3
+#define OP_CANCEL           4
+#define OP_RECV             5
+#define OP_SEND             6
+#define OP_READ             7
+#define OP_POLL             8
+#define OP_FILES            9
+
+// Clients are aligned to cache lines (see pool.h), which leaves these bits free
+#define OP_MASK             15
+
+struct uring_server {
+    struct uring ring;
+
+    int accept_socket;
+    int accepts;                        // Accept operations in flight
+
+    struct client_table table;
+
+    struct offload_queue completions;
+
+    int fixed_files;                    // Whether sockets are registered as fixed files
+    int *descriptors;                   // FIXED_FILES entries of the table, read by the updates queued
+
+    char *buffers;                      // FIXED_BUFFERS registered buffers of FIXED_BUFFER_SIZE bytes
+    int free_buffers[FIXED_BUFFERS];
+    int nfree_buffers;
+
+    struct client *waiting_first;       // Clients waiting for a registered buffer, linked through next_waiting
+    struct client *waiting_last;
+
+    struct __kernel_timespec wakeup;    // Timeout queued for the next deadline of a client
+    unsigned long long wakeup_at;       // When it expires (see timer_clock()); 0 if none is queued
+};
+
+static void setup_signal_handler(int signal, void (*handler)(int));
+static void handle_termination(int signal);
+
+static int setup_buffers(struct uring_server *server);
+static void setup_fixed_files(struct uring_server *server);
+
+static void queue_accepts(struct uring_server *server);
+static void queue_wakeup(struct uring_server *server);
+static void queue_completions(struct uring_server *server);
+
+static void handle_completion(struct uring_server *server, uint64_t data, int result);
+static void expire_client(struct client *client, void *context);
+static void advance(struct uring_server *server, struct client *client);
+
+static atomic_int done = 0;
+
+// The loop wakes up at least this often (milliseconds), to notice termination
+#define MAX_WAIT            1000
+
+int server_uring(int argc, char **argv) {
+    if(argc < 2) {
+        fprintf(stderr, "Usage: server <port>\n");
+
+        return EXIT_FAILURE;
+    }
+
+    char *port = argv[1];
+
+    static const int operations[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG, IORING_OP_READ_FIXED, IORING_OP_TIMEOUT, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_FILES_UPDATE};
+
+    struct uring_server server;
+
+    memset(&server, 0, sizeof(struct uring_server));
+
+    if(uring_init(&server.ring, RING_ENTRIES, operations, sizeof(operations) / sizeof(int)) == -1) {
+        fprintf(stderr, "io_uring is not available (%s): falling back to epoll\n", strerror(errno));
+
+        return server_epoll(argc, argv);
+    }
+
+    if(setup_buffers(&server) == -1) {
+        fprintf(stderr, "Cannot register io_uring buffers (%s): falling back to epoll\n", strerror(errno));
+
+        uring_exit(&server.ring);
+        return server_epoll(argc, argv);
+    }
+
+    setup_fixed_files(&server);
+
+    server.accept_socket = create_server(atoi(port));
+
+    if(server.accept_socket == -1) {
+        fprintf(stderr, "Error creating server\n");
+
+        return EXIT_FAILURE;
+    }
+
+    make_nonblocking(server.accept_socket, 1);
+
+    // Start table of clients
+    init(&server.table);
+
+    // Treat signals
+    setup_signal_handler(SIGTERM, handle_termination);
+    setup_signal_handler(SIGPIPE, SIG_IGN);
+
+    // Only this thread takes SIGTERM, so that it interrupts the wait for completions: the threads started from here
+    // on inherit it blocked
+    sigset_t termination;
+    sigset_t previous;
+
+    sigemptyset(&termination);
+    sigaddset(&termination, SIGTERM);
+
+    pthread_sigmask(SIG_BLOCK, &termination, &previous);
+
+    // Snapshots of the metrics are written on SIGUSR1 by a thread of their own (see metrics.h)
+    if(metrics_start() == -1) {
+        fprintf(stderr, "Cannot start the metrics\n");
+    }
+
+    // Paths are looked up in an index of the document root, kept current with inotify (see docroot_index.h)
+    if(docroot_index_start() == -1) {
+        fprintf(stderr, "Cannot index the document root\n");
+    }
+
+    // Blocking disk operations (resolving files that are not cached) are handed to the thread pool
+    if(config.offload) {
+        if(init_offload_queue(&server.completions) == -1 || start_threads() != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+
+        server.table.offload = &server.completions;
+
+        queue_completions(&server);
+    }
+
+    // Requests are logged by a background thread (see access_log.h)
+    if(access_log_start() == -1) {
+        fprintf(stderr, "Cannot start the access log\n");
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    while(!atomic_load(&done)) {
+        queue_accepts(&server);
+        queue_wakeup(&server);
+
+        // One system call submits everything queued since the last iteration and waits for completions
+        if(uring_submit(&server.ring, 1) == -1) {
+            if(errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+
+            perror("io_uring_enter");
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+
+        while((cqe = uring_peek_cqe(&server.ring)) != NULL) {
+            uint64_t data = cqe->user_data;
+            int result = cqe->res;
+
+            uring_cqe_seen(&server.ring);
+
+            handle_completion(&server, data, result);
+        }
+
+        // Clients whose deadline has passed are finished once their operation is cancelled
+        expire_clients(&server.table, expire_client, &server);
+
+        // Free the clients that finished in this batch
+        reap_clients(&server.table);
+    }
+
+    access_log_stop();
+
+    printf("Finishing program cleanly... %ld operations served\n", operations_completed);
+
+    // If we are here, we got a termination signal
+    // Tearing down the ring cancels the operations in flight, then the clients can be closed
+    if(config.offload) {
+        finish_threads();
+    }
+
+    uring_exit(&server.ring);
+
+    destroy(&server.table);
+
+    if(config.offload) {
+        destroy_offload_queue(&server.completions);
+    }
+
+    close(server.accept_socket);
+    free(server.buffers);
+    free(server.descriptors);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Allocates and registers the buffers used to read files.
+ *
+ * @return 0 on success; -1 on error.
+ */
+static int setup_buffers(struct uring_server *server) {
+    struct iovec vectors[FIXED_BUFFERS];
+
+    server->buffers = (char *) aligned_alloc(4096, FIXED_BUFFERS * FIXED_BUFFER_SIZE);
+
+    if(server->buffers == NULL) {
+        return -1;
+    }
+
+    for(int i = 0; i < FIXED_BUFFERS; i++) {
+        vectors[i].iov_base = server->buffers + i * FIXED_BUFFER_SIZE;
+        vectors[i].iov_len = FIXED_BUFFER_SIZE;
+
+        server->free_buffers[i] = i;
+    }
+
+    server->nfree_buffers = FIXED_BUFFERS;
+
+    if(uring_register(&server->ring, IORING_REGISTER_BUFFERS, vectors, FIXED_BUFFERS) == -1) {
+        free(server->buffers);
+        server->buffers = NULL;
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Registers an empty table of fixed files, filled as clients are accepted. Without it, plain descriptors are used.
+ */
+static void setup_fixed_files(struct uring_server *server) {
+    int *descriptors = (int *) malloc(FIXED_FILES * sizeof(int));
+
+    if(descriptors == NULL) {
+        return;
+    }
+
+    for(int i = 0; i < FIXED_FILES; i++) {
+        descriptors[i] = -1;
+    }
+
+    server->fixed_files = uring_register(&server->ring, IORING_REGISTER_FILES, descriptors, FIXED_FILES) == 0;
+
+    if(server->fixed_files) {
+        server->descriptors = descriptors;
+    }
+    else {
+        free(descriptors);
+    }
+}
+
+static uint64_t user_data(struct client *client, int operation) {
+    return (uint64_t) (uintptr_t) client | operation;
+}
+
+/**
+ * Queues pointing the fixed file \p slot to \p descriptor (-1 to empty it), so that the update goes in the same
+ * submission as the operations of the client, instead of costing a system call of its own. The kernel reads the
+ * descriptor from the table when the entry is submitted; updates of one slot queued in the same batch therefore all
+ * carry its latest value.
+ */
+static void update_fixed_file(struct uring_server *server, int slot, int descriptor) {
+    if(!server->fixed_files || slot >= FIXED_FILES) {
+        return;
+    }
+
+    server->descriptors[slot] = descriptor;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) &server->descriptors[slot];
+    sqe->len = 1;
+    sqe->off = slot;
+    sqe->user_data = user_data(NULL, OP_FILES);
+
+    // Only failures need a completion; otherwise each update would end the wait for completions early
+    if(server->ring.features & IORING_FEAT_CQE_SKIP) {
+        sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+    }
+}
+
+/**
+ * Sets the socket of \p client in \p sqe, as a fixed file if it has been registered.
+ */
+static void set_socket(struct uring_server *server, struct io_uring_sqe *sqe, struct client *client) {
+    if(server->fixed_files && client->key < FIXED_FILES) {
+        sqe->fd = client->key;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    else {
+        sqe->fd = client->socket;
+    }
+}
+
+/**
+ * Keeps ACCEPTS accept operations in flight, as long as the connection limit allows: each of them may complete
+ * with a connection, so while the process is at the limit, new connections are left in the backlog.
+ */
+static void queue_accepts(struct uring_server *server) {
+    // Out of descriptors: leave the connections in the backlog for a while (see accept_failed())
+    if(accept_backoff() > 0) {
+        return;
+    }
+
+    while(server->accepts < ACCEPTS && server->accepts < connection_slots()) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = server->accept_socket;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = user_data(NULL, OP_ACCEPT);
+
+        server->accepts++;
+    }
+}
+
+/**
+ * Makes sure that a timeout wakes the loop up for the next deadline of a client (or after MAX_WAIT).
+ */
+static void queue_wakeup(struct uring_server *server) {
+    long wait = next_deadline(&server->table);
+    long backoff = accept_backoff();
+
+    if(wait == -1 || wait > MAX_WAIT) {
+        wait = MAX_WAIT;
+    }
+
+    // Accepting resumes when the backoff is over
+    if(backoff > 0 && wait > backoff) {
+        wait = backoff;
+    }
+
+    unsigned long long at = timer_clock() + wait;
+
+    // The timeout queued already comes first (the kernel copies the time when the operation is submitted)
+    if(server->wakeup_at != 0 && server->wakeup_at <= at) {
+        return;
+    }
+
+    server->wakeup.tv_sec = wait / 1000;
+    server->wakeup.tv_nsec = (wait % 1000) * 1000000;
+    server->wakeup_at = at;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t) &server->wakeup;
+    sqe->len = 1;
+    sqe->user_data = user_data(NULL, OP_WAKEUP);
+}
+
+static void queue_completions(struct uring_server *server) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = server->completions.event;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data(NULL, OP_COMPLETIONS);
+}
+
+static void queue_recv(struct uring_server *server, struct client *client) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+
+    sqe->opcode = IORING_OP_RECV;
+    set_socket(server, sqe, client);
+    sqe->addr = (uintptr_t) (client->buffer + client->nread);
+    sqe->len = BUFFER_SIZE - 1 - client->nread;
+    sqe->user_data = user_data(client, OP_RECV);
+}
+
+/**
+ * Waits for \p client to send something, without holding a buffer meanwhile: idle persistent connections only
+ * take a request buffer once the next request arrives.
+ */
+static void queue_poll(struct uring_server *server, struct client *client) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    set_socket(server, sqe, client);
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data(client, OP_POLL);
+}
+
+static void queue_send(struct uring_server *server, struct client *client, const char *data, size_t length) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+
+    sqe->opcode = IORING_OP_SEND;
+    set_socket(server, sqe, client);
+    sqe->addr = (uintptr_t) data;
+    sqe->len = length;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data(client, OP_SEND);
+}
+
+/**
+ * Sends what is left of the reply header of \p client together with the part of the file in its registered buffer,
+ * in a single sendmsg(2), so that small files go out in as few segments as possible.
+ */
+static void queue_send_reply(struct uring_server *server, struct client *client) {
+    struct iovec *segments = client->ring_segments;
+    int nsegments = 0;
+
+    if(client->ntowrite > 0) {
+        segments[nsegments].iov_base = (void *) (client->header + client->nwritten);
+        segments[nsegments].iov_len = client->ntowrite;
+        nsegments++;
+    }
+
+    if(client->nbuffered > 0) {
+        segments[nsegments].iov_base = server->buffers + client->ring_buffer * FIXED_BUFFER_SIZE + client->nbuffer_sent;
+        segments[nsegments].iov_len = client->nbuffered - client->nbuffer_sent;
+        nsegments++;
+    }
+
+    if(nsegments == 1) {
+        queue_send(server, client, segments[0].iov_base, segments[0].iov_len);
+        return;
+    }
+
+    // The message must stay valid until the operation completes
+    memset(&client->ring_message, 0, sizeof(struct msghdr));
+
+    client->ring_message.msg_iov = segments;
+    client->ring_message.msg_iovlen = nsegments;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    set_socket(server, sqe, client);
+    sqe->addr = (uintptr_t) &client->ring_message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data(client, OP_SEND);
+}
+
+static void queue_read(struct uring_server *server, struct client *client) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+    off_t remaining = client->file_end - client->file_offset;
+
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = client->file;
+    sqe->off = client->file_offset;
+    sqe->addr = (uintptr_t) (server->buffers + client->ring_buffer * FIXED_BUFFER_SIZE);
+    sqe->len = (remaining < FIXED_BUFFER_SIZE) ? (size_t) remaining : FIXED_BUFFER_SIZE;
+    sqe->buf_index = client->ring_buffer;
+    sqe->user_data = user_data(client, OP_READ);
+}
+
+/**
+ * Cancels the poll, receive or send operation of \p client, which then completes with -ECANCELED.
+ */
+static void queue_cancel(struct uring_server *server, struct client *client) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->ring);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data(client, (client->state == E_SEND_REPLY) ? OP_SEND : (client->buffer == NULL) ? OP_POLL : OP_RECV);
+    sqe->user_data = user_data(NULL, OP_CANCEL);
+}
+
+/**
+ * The deadline of \p client has passed (see expire_clients()): cancelling its operation in flight finishes it, after
+ * a 408 reply if part of a request header was received, as in the other backends.
+ */
+static void expire_client(struct client *client, void *context) {
+    queue_cancel((struct uring_server *) context, client);
+
+    // A file read cannot be cancelled: try again shortly
+    timer_arm(client->timers, &client->deadline, timer_clock() + 1000);
+}
+
+/**
+ * Gives a registered buffer to \p client or, if none is free, queues it until one is released.
+ *
+ * @return 1 if the client got a buffer; 0 if it is waiting.
+ */
+static int acquire_buffer(struct uring_server *server, struct client *client) {
+    if(server->nfree_buffers > 0) {
+        client->ring_buffer = server->free_buffers[--server->nfree_buffers];
+
+        return 1;
+    }
+
+    client->next_waiting = NULL;
+
+    if(server->waiting_last != NULL) {
+        server->waiting_last->next_waiting = client;
+    }
+    else {
+        server->waiting_first = client;
+    }
+
+    server->waiting_last = client;
+
+    return 0;
+}
+
+/**
+ * Releases the registered buffer of \p client, if any, handing it to the first waiting client.
+ */
+static void release_buffer(struct uring_server *server, struct client *client) {
+    int buffer = client->ring_buffer;
+
+    if(buffer == -1) {
+        return;
+    }
+
+    client->ring_buffer = -1;
+    client->nbuffered = 0;
+    client->nbuffer_sent = 0;
+
+    struct client *waiting = server->waiting_first;
+
+    if(waiting == NULL) {
+        server->free_buffers[server->nfree_buffers++] = buffer;
+
+        return;
+    }
+
+    server->waiting_first = waiting->next_waiting;
+
+    if(server->waiting_first == NULL) {
+        server->waiting_last = NULL;
+    }
+
+    waiting->next_waiting = NULL;
+    waiting->ring_buffer = buffer;
+
+    advance(server, waiting);
+}
+
+static void accept_connection(struct uring_server *server, int client_socket) {
+    struct client *client = insert_client(&server->table, client_socket);
+
+    if(client == NULL) {
+        close(client_socket);
+        return;
+    }
+
+    log_connection(client, 1);
+
+    update_fixed_file(server, client_socket, client_socket);
+
+    advance(server, client);
+}
+
+/**
+ * Accounts \p result bytes sent by \p client: part of the reply header, then of the in-memory response, or of the
+ * registered buffer holding the next part of the file.
+ */
+static void account_sent(struct client *client, int result) {
+    if(result <= 0) {
+        client->status = STATUS_BAD;
+        finish_client(client);
+
+        return;
+    }
+
+    reply_progressed(client);
+
+    if(client->ntowrite > 0) {
+        int header = (result < client->ntowrite) ? result : client->ntowrite;
+
+        client->nwritten += header;
+        client->ntowrite -= header;
+
+        if((result -= header) == 0) {
+            return;
+        }
+    }
+
+    if(client->content != NULL) {
+        client->file_offset += result;
+    }
+    else {
+        client->nbuffer_sent += result;
+
+        if(client->nbuffer_sent == client->nbuffered) {
+            client->file_offset += client->nbuffered;
+
+            client->nbuffered = 0;
+            client->nbuffer_sent = 0;
+        }
+    }
+}
+
+static void handle_completion(struct uring_server *server, uint64_t data, int result) {
+    struct client *client = (struct client *) (uintptr_t) (data & ~(uint64_t) OP_MASK);
+
+    switch(data & OP_MASK) {
+    case OP_ACCEPT:
+        // Queued again by the loop, once the clients of this batch are reaped
+        server->accepts--;
+
+        if(result >= 0) {
+            accept_connection(server, result);
+        }
+        else if(result != -EAGAIN && result != -ECANCELED) {
+            accept_failed(-result);
+        }
+        break;
+    case OP_WAKEUP:
+        // The deadlines are checked after every batch of completions
+        server->wakeup_at = 0;
+        break;
+    case OP_COMPLETIONS: {
+        struct client *next;
+
+        for(struct client *completed = take_completed(&server->completions); completed != NULL; completed = next) {
+            next = completed->next_completed;
+
+            complete_task(completed);
+            advance(server, completed);
+        }
+
+        queue_completions(server);
+        break;
+    }
+    case OP_CANCEL:
+        break;
+    case OP_FILES:
+        // Operations queued after a failed update still name the slot, and fail: later ones use plain descriptors
+        if(result < 0) {
+            fprintf(stderr, "Cannot update io_uring fixed files (%s): using plain descriptors\n", strerror(-result));
+
+            server->fixed_files = 0;
+        }
+        break;
+    case OP_POLL:
+        if(result < 0) {
+            finish_client(client);
+        }
+        else if(!acquire_request_buffer(client)) {
+            client->status = STATUS_BAD;
+            finish_client(client);
+        }
+
+        advance(server, client);
+        break;
+    case OP_RECV:
+        // Cancelled by expire_client(): part of a request header may have arrived, which deserves a 408
+        if(result == -ECANCELED && client->nread > 0) {
+            reject_request(client, 408);
+        }
+        else if(result == -ECANCELED) {
+            finish_client(client);
+        }
+        else {
+            request_received(client, result);
+        }
+
+        advance(server, client);
+        break;
+    case OP_SEND:
+        account_sent(client, result);
+        advance(server, client);
+        break;
+    case OP_READ:
+        if(result <= 0) {
+            // An error, or the file shrank after the header announced its length
+            client->status = STATUS_BAD;
+            finish_client(client);
+        }
+        else {
+            client->nbuffered = result;
+            client->nbuffer_sent = 0;
+        }
+
+        advance(server, client);
+        break;
+    }
+}
+
+/**
+ * Queues the next operation of \p client, according to its state. Each client has at most one operation in flight.
+ */
+static void advance(struct uring_server *server, struct client *client) {
+    for(;;) {
+        if(client->socket == -1) {
+            // Finished: the descriptor has been closed, so the fixed file must not keep the socket open
+            release_buffer(server, client);
+            update_fixed_file(server, client->key, -1);
+
+            return;
+        }
+
+        if(client->state == E_RECV_REQUEST) {
+            if(client->buffer == NULL) {
+                queue_poll(server, client);
+            }
+            else {
+                queue_recv(server, client);
+            }
+
+            return;
+        }
+
+        // Clients in E_WAIT_IO belong to a worker until complete_task()
+        if(client->state != E_SEND_REPLY) {
+            return;
+        }
+
+        // The first part of the file is read before the header is sent, so that both go out together
+        if(client->content == NULL && client->file != -1 && client->file_offset < client->file_end && client->nbuffered == 0) {
+            if(client->ring_buffer != -1 || acquire_buffer(server, client)) {
+                queue_read(server, client);
+            }
+
+            return;
+        }
+
+        if(client->ntowrite > 0 || client->nbuffered > 0) {
+            queue_send_reply(server, client);
+            return;
+        }
+
+        if(client->content != NULL && client->file_offset < client->file_end) {
+            off_t remaining = client->file_end - client->file_offset;
+
+            queue_send(server, client, client->content->data + client->file_offset, (remaining < TRANSFER_CHUNK) ? (size_t) remaining : TRANSFER_CHUNK);
+            return;
+        }
+
+        // The next part of a multipart reply has its own header
+        if(next_range(client)) {
+            continue;
+        }
+
+        // The whole reply has been sent
+        release_buffer(server, client);
+        reply_sent(client);
+    }
+}
+
+static void setup_signal_handler(int signal, void (*handler)(int)) {
+    struct sigaction request;
+
+    memset(&request, 0, sizeof(struct sigaction));
+
+    request.sa_handler = handler;
+
+    if(sigaction(signal, &request, NULL) == -1) {
+        perror("sigaction");
+
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void handle_termination(int signal) {
+    atomic_store(&done, 1);
+}
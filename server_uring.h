@@ -0,0 +1,13 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef SERVER_URING_H
+#define SERVER_URING_H
+
+/**
+ * Runs the io_uring backend, or the epoll backend if the kernel does not support io_uring.
+ */
+int server_uring(int argc, char **argv);
+
+#endif /* SERVER_URING_H */
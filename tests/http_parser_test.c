@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Tests of the request header parser (see http_parser.h): the request line and header field edge cases, with every
+ * header scanning kernel the CPU supports, and with the header given all at once or a few bytes per call.
+ *
+ * Usage: http_parser_test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http_parser.h"
+#include "http_scan.h"
+
+#define MAX_REQUEST 8192
+
+static const struct {
+    const char *request;
+    int result;
+    int error;
+} cases[] = {
+    {"GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n", HTTP_PARSE_DONE, 0},
+    {"HEAD / HTTP/1.0\r\n\r\n", HTTP_PARSE_DONE, 0},
+    {"GET / HTTP/1.1\n\n", HTTP_PARSE_DONE, 0},
+    {"\r\n\r\nGET / HTTP/1.1\r\n\r\n", HTTP_PARSE_DONE, 0},
+    {"GET /a?b=c HTTP/1.1\r\nHost:x\r\nAccept: */*\r\n\r\n", HTTP_PARSE_DONE, 0},
+
+    // The header is not complete yet
+    {"GET / HTTP/1.1", HTTP_PARSE_INCOMPLETE, 0},
+    {"GET / HTTP/1.1\r\nHost: localhost\r\n", HTTP_PARSE_INCOMPLETE, 0},
+    {"GET / HTTP/1.1\r\nHost: localhost\r\n\r", HTTP_PARSE_INCOMPLETE, 0},
+
+    // Malformed request lines fail as soon as they are complete
+    {"GARBAGE\r\n", HTTP_PARSE_ERROR, 400},
+    {"GET /\r\n\r\n", HTTP_PARSE_ERROR, 400},
+    {"get / HTTP/1.1\r\n", HTTP_PARSE_ERROR, 400},
+    {"GET  / HTTP/1.1\r\n", HTTP_PARSE_ERROR, 400},
+    {" GET / HTTP/1.1\r\n", HTTP_PARSE_ERROR, 400},
+    {"GET index.html HTTP/1.1\r\n", HTTP_PARSE_ERROR, 400},
+    {"GET / HTTP/1.10\r\n", HTTP_PARSE_ERROR, 400},
+    {"GET / HTTP/11\r\n", HTTP_PARSE_ERROR, 400},
+    {"GET / FTP/1.1\r\n", HTTP_PARSE_ERROR, 400},
+    {"GET / HTTP/1.1 \r\n", HTTP_PARSE_ERROR, 400},
+    {"GETTINGLONGERTHANX / HTTP/1.1\r\n", HTTP_PARSE_ERROR, 400},
+    {"GET /../etc/passwd HTTP/1.1\r\n", HTTP_PARSE_ERROR, 400},
+    {"GET //etc/passwd HTTP/1.1\r\n", HTTP_PARSE_ERROR, 400},
+    {"GET /a\tb HTTP/1.1\r\n", HTTP_PARSE_ERROR, 400},
+
+    // Only GET and HEAD are served
+    {"POST / HTTP/1.1\r\n", HTTP_PARSE_ERROR, 501},
+    {"OPTIONS / HTTP/1.1\r\nHost: localhost\r\n\r\n", HTTP_PARSE_ERROR, 501},
+    {"HEADER / HTTP/1.1\r\n", HTTP_PARSE_ERROR, 501},
+
+    // Malformed header fields are only found once the header is complete
+    {"GET / HTTP/1.1\r\nHost localhost\r\n", HTTP_PARSE_INCOMPLETE, 0},
+    {"GET / HTTP/1.1\r\nHost localhost\r\n\r\n", HTTP_PARSE_ERROR, 400},
+    {"GET / HTTP/1.1\r\n: localhost\r\n\r\n", HTTP_PARSE_ERROR, 400},
+    {"GET / HTTP/1.1\r\nHo st: localhost\r\n\r\n", HTTP_PARSE_ERROR, 400},
+    {"GET / HTTP/1.1\r\n Host: localhost\r\n\r\n", HTTP_PARSE_ERROR, 400},
+};
+
+/**
+ * Parses \p request, all at once if \p step is 0, or giving the parser \p step more bytes per call.
+ *
+ * @return The result of the last call; \p parser and \p buffer (of MAX_REQUEST bytes) hold what the parser left.
+ */
+static int parse(struct http_parser *parser, char *buffer, const char *request, int step) {
+    int length = strlen(request);
+    int received = 0;
+    int result;
+
+    memcpy(buffer, request, length + 1);
+    http_parser_init(parser);
+
+    do {
+        received = (step == 0 || received + step > length) ? length : received + step;
+        result = http_parse(parser, buffer, received);
+    } while(result == HTTP_PARSE_INCOMPLETE && received < length);
+
+    return result;
+}
+
+static int check_cases(int step) {
+    struct http_parser parser;
+    char buffer[MAX_REQUEST];
+    int failed = 0;
+
+    for(int i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+        int result = parse(&parser, buffer, cases[i].request, step);
+
+        if(result != cases[i].result || (result == HTTP_PARSE_ERROR && parser.error != cases[i].error)) {
+            fprintf(stderr, "%s, step %d: \"%s\" gave %d (error %d), expected %d (error %d)\n", http_scanner->name, step, cases[i].request, result, parser.error, cases[i].result, cases[i].error);
+            failed++;
+        }
+    }
+
+    return failed;
+}
+
+#define CHECK(condition) \
+    do { \
+        if(!(condition)) { \
+            fprintf(stderr, "%s, step %d: %s failed (line %d)\n", http_scanner->name, step, #condition, __LINE__); \
+            failed++; \
+        } \
+    } while(0)
+
+/**
+ * Checks the views and flags set by the parser on complete headers.
+ */
+static int check_fields(int step) {
+    struct http_parser parser;
+    char buffer[MAX_REQUEST];
+    int failed = 0;
+
+    const char *request = "GET /images/a.jpeg?size=2 HTTP/1.1\r\nHost: localhost\r\nRange:  bytes=0-9 \r\nIf-None-Match: \"x\"\r\nAccept-Encoding: gzip\r\n\r\nGET /next HTTP/1.1\r\n";
+
+    CHECK(parse(&parser, buffer, request, step) == HTTP_PARSE_DONE);
+    CHECK(strcmp(parser.method.data, "GET") == 0 && strcmp(parser.path.data, "/images/a.jpeg?size=2") == 0 && strcmp(parser.protocol.data, "HTTP/1.1") == 0);
+    CHECK(parser.header_length == (int) (strstr(request, "\r\n\r\n") + 4 - request));
+    CHECK(!parser.head && !parser.close);
+    CHECK(parser.range.length == 9 && strncmp(parser.range.data, "bytes=0-9", 9) == 0);
+    CHECK(parser.if_none_match.length == 3 && parser.if_range.data == NULL && parser.if_modified_since.data == NULL);
+    CHECK(http_encodings(&parser) == HTTP_ENCODING_GZIP);
+    CHECK(strcmp(http_filename(&parser), "images/a.jpeg") == 0);
+
+    // Ranges are not defined for HEAD
+    CHECK(parse(&parser, buffer, "HEAD / HTTP/1.1\r\nRange: bytes=0-9\r\n\r\n", step) == HTTP_PARSE_DONE);
+    CHECK(parser.head && parser.range.data == NULL);
+    CHECK(strcmp(http_filename(&parser), "index.html") == 0);
+
+    CHECK(parse(&parser, buffer, "GET / HTTP/1.1\r\nconnection: Keep-Alive, CLOSE\r\n\r\n", step) == HTTP_PARSE_DONE);
+    CHECK(parser.close);
+
+    CHECK(parse(&parser, buffer, "GET / HTTP/1.1\r\nX-Connection: close\r\n\r\n", step) == HTTP_PARSE_DONE);
+    CHECK(!parser.close);
+
+    // As many fields as allowed, then one more
+    char fields[MAX_REQUEST];
+    int length = snprintf(fields, MAX_REQUEST, "GET / HTTP/1.1\r\n");
+
+    for(int i = 0; i < HTTP_MAX_HEADERS; i++) {
+        length += snprintf(fields + length, MAX_REQUEST - length, "X-Field-%d: %d\r\n", i, i);
+    }
+
+    snprintf(fields + length, MAX_REQUEST - length, "\r\n");
+    CHECK(parse(&parser, buffer, fields, step) == HTTP_PARSE_DONE);
+
+    snprintf(fields + length, MAX_REQUEST - length, "X-Field: x\r\n\r\n");
+    CHECK(parse(&parser, buffer, fields, step) == HTTP_PARSE_ERROR && parser.error == 431);
+
+    return failed;
+}
+
+int main(void) {
+    const struct http_scanner *scanners[] = {
+        &http_scalar_scanner,
+#if defined(__x86_64__)
+        &http_sse2_scanner,
+        &http_avx2_scanner,
+#endif
+    };
+
+    // Whole header, one byte per call, and a blank line split between calls
+    static const int steps[] = {0, 1, 3};
+
+    int failed = 0;
+
+    for(int i = 0; i < (int) (sizeof(scanners) / sizeof(scanners[0])); i++) {
+        if(!http_scanner_supported(scanners[i])) {
+            printf("%s: not supported by this CPU, skipped\n", scanners[i]->name);
+            continue;
+        }
+
+        http_scanner = scanners[i];
+
+        for(int j = 0; j < (int) (sizeof(steps) / sizeof(steps[0])); j++) {
+            failed += check_cases(steps[j]);
+            failed += check_fields(steps[j]);
+        }
+    }
+
+    printf("http_parser_test: %s\n", (failed == 0) ? "passed" : "FAILED");
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
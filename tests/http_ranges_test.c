@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Tests of the interpretation of the Range and If-Range fields (see http_ranges() and http_range_applies()).
+ *
+ * Usage: http_ranges_test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http_parser.h"
+
+#define MAX_REQUEST 8192
+
+// Ranges expected are written as "first-last" separated by commas
+static const struct {
+    const char *range;
+    off_t size;
+    int result;
+    const char *ranges;
+} cases[] = {
+    {NULL, 100, 0, ""},
+    {"bytes=0-9", 100, 1, "0-9"},
+    {"BYTES=0-9", 100, 1, "0-9"},
+    {"bytes=90-", 100, 1, "90-99"},
+    {"bytes=90-200", 100, 1, "90-99"},
+    {"bytes=0-9,20-29", 100, 2, "0-9,20-29"},
+    {"bytes= 0-9 , ,20-29,", 100, 2, "0-9,20-29"},
+
+    // Suffixes: the last bytes of the file, or the whole file if it is shorter
+    {"bytes=-10", 100, 1, "90-99"},
+    {"bytes=-200", 100, 1, "0-99"},
+    {"bytes=-0", 100, -1, ""},
+    {"bytes=-5", 0, -1, ""},
+
+    // Unsatisfiable ranges are left out; if none is left, the reply is a 416
+    {"bytes=100-", 100, -1, ""},
+    {"bytes=100-200", 100, -1, ""},
+    {"bytes=0-", 0, -1, ""},
+    {"bytes=0-9,200-300", 100, 1, "0-9"},
+
+    // Overlapping ranges are served, unless they add up to more than the file
+    {"bytes=0-9,5-14", 100, 2, "0-9,5-14"},
+    {"bytes=0-59,40-99", 100, 0, ""},
+    {"bytes=0-,0-", 100, 0, ""},
+    {"bytes=-60,0-59", 100, 0, ""},
+
+    // Anything else sends the whole file
+    {"bytes=9-0", 100, 0, ""},
+    {"bytes=", 100, 0, ""},
+    {"bytes=,", 100, 0, ""},
+    {"bytes=a-b", 100, 0, ""},
+    {"bytes=0-9;", 100, 0, ""},
+    {"bytes=--5", 100, 0, ""},
+    {"items=0-9", 100, 0, ""},
+    {"bytes=0-99999999999999999999", 100, 0, ""},
+    {"bytes=0-0,1-1,2-2,3-3,4-4,5-5,6-6,7-7,8-8,9-9,10-10,11-11,12-12,13-13,14-14,15-15", 100, 16, "0-0,1-1,2-2,3-3,4-4,5-5,6-6,7-7,8-8,9-9,10-10,11-11,12-12,13-13,14-14,15-15"},
+    {"bytes=0-0,1-1,2-2,3-3,4-4,5-5,6-6,7-7,8-8,9-9,10-10,11-11,12-12,13-13,14-14,15-15,16-16", 100, 0, ""},
+};
+
+// Validators of the file in the If-Range cases: Sun, 06 Nov 1994 08:49:37 GMT
+#define ETAG        "\"5f-2a\""
+#define MODIFIED    784111777
+
+static const struct {
+    const char *if_range;
+    int applies;
+} conditions[] = {
+    {NULL, 1},
+    {ETAG, 1},
+    {"\"5f-2b\"", 0},
+    {"W/" ETAG, 0},
+    {"\"5f-2a", 0},
+    {"Sun, 06 Nov 1994 08:49:37 GMT", 1},
+    {"Sunday, 06-Nov-94 08:49:37 GMT", 1},
+    {"Sun Nov  6 08:49:37 1994", 1},
+    {"Sun, 06 Nov 1994 08:49:36 GMT", 0},
+    {"Sun, 06 Nov 1994 08:49:38 GMT", 0},
+    {"yesterday", 0},
+};
+
+/**
+ * Parses a request for "/" with the Range field \p range and the If-Range field \p if_range (neither if NULL).
+ *
+ * @return 1 if the request was parsed; 0 otherwise.
+ */
+static int parse(struct http_parser *parser, char *buffer, const char *range, const char *if_range) {
+    int length = snprintf(buffer, MAX_REQUEST, "GET / HTTP/1.1\r\nHost: localhost\r\n");
+
+    if(range != NULL) {
+        length += snprintf(buffer + length, MAX_REQUEST - length, "Range: %s\r\n", range);
+    }
+
+    if(if_range != NULL) {
+        length += snprintf(buffer + length, MAX_REQUEST - length, "If-Range: %s\r\n", if_range);
+    }
+
+    length += snprintf(buffer + length, MAX_REQUEST - length, "\r\n");
+
+    http_parser_init(parser);
+
+    return http_parse(parser, buffer, length) == HTTP_PARSE_DONE;
+}
+
+static int check_ranges(void) {
+    struct http_parser parser;
+    char buffer[MAX_REQUEST];
+    int failed = 0;
+
+    for(int i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+        struct http_range ranges[HTTP_MAX_RANGES];
+        char found[MAX_REQUEST] = "";
+
+        if(!parse(&parser, buffer, cases[i].range, NULL)) {
+            fprintf(stderr, "Range: %s: request not parsed\n", cases[i].range);
+            failed++;
+            continue;
+        }
+
+        int result = http_ranges(&parser, cases[i].size, ranges);
+
+        for(int j = 0, length = 0; j < result; j++) {
+            length += snprintf(found + length, MAX_REQUEST - length, "%s%lld-%lld", (j > 0) ? "," : "", (long long) ranges[j].first, (long long) ranges[j].last);
+        }
+
+        if(result != cases[i].result || strcmp(found, cases[i].ranges) != 0) {
+            fprintf(stderr, "Range: %s (%lld bytes) gave %d \"%s\", expected %d \"%s\"\n", cases[i].range, (long long) cases[i].size, result, found, cases[i].result, cases[i].ranges);
+            failed++;
+        }
+    }
+
+    return failed;
+}
+
+static int check_conditions(void) {
+    struct http_parser parser;
+    char buffer[MAX_REQUEST];
+    int failed = 0;
+
+    for(int i = 0; i < (int) (sizeof(conditions) / sizeof(conditions[0])); i++) {
+        if(!parse(&parser, buffer, "bytes=0-9", conditions[i].if_range)) {
+            fprintf(stderr, "If-Range: %s: request not parsed\n", conditions[i].if_range);
+            failed++;
+            continue;
+        }
+
+        int applies = http_range_applies(&parser, ETAG, MODIFIED);
+
+        if(applies != conditions[i].applies) {
+            fprintf(stderr, "If-Range: %s gave %d, expected %d\n", conditions[i].if_range, applies, conditions[i].applies);
+            failed++;
+        }
+    }
+
+    return failed;
+}
+
+int main(void) {
+    int failed = check_ranges() + check_conditions();
+
+    printf("http_ranges_test: %s\n", (failed == 0) ? "passed" : "FAILED");
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Tests of the hierarchical timing wheel (see timer_wheel.h): timers that cascade through every level, cancelling
+ * and re-arming in any position of a slot, and a random mix of operations checked against a plain list of expiries.
+ *
+ * Usage: timer_wheel_test [seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer_wheel.h"
+
+// The wheel starts at a fixed time, not aligned to any level, so that the tests do not depend on the clock
+#define START       1000003ULL
+
+#define NTIMERS     2000
+#define OPERATIONS  200000
+
+#define CHECK(condition) \
+    do { \
+        if(!(condition)) { \
+            fprintf(stderr, "%s failed (line %d)\n", #condition, __LINE__); \
+            failed++; \
+        } \
+    } while(0)
+
+static void start(struct timer_wheel *wheel) {
+    timer_wheel_init(wheel);
+
+    wheel->now = START;
+}
+
+/**
+ * @return Number of timers in the list \p timers.
+ */
+static int length(struct timer *timers) {
+    int count = 0;
+
+    for(; timers != NULL; timers = timers->next) {
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * A timer per level (and one beyond the wheel) expires exactly at its time, after moving down to the finest level.
+ */
+static int check_cascade(void) {
+    static const unsigned long long delays[] = {1, 63, 64, 65, 4095, 4096, 4097, 262143, 262144, 262145, 16777215, 16777216, 16777217, 40000000, 50331653, 100000000};
+
+    int failed = 0;
+
+    for(int i = 0; i < (int) (sizeof(delays) / sizeof(delays[0])); i++) {
+        struct timer_wheel wheel;
+        struct timer timer;
+
+        memset(&timer, 0, sizeof(struct timer));
+        start(&wheel);
+
+        timer_arm(&wheel, &timer, START + delays[i]);
+
+        // Never later than the expiry, so that an event loop sleeping that long does not miss it
+        long timeout = timer_wheel_timeout(&wheel, START);
+
+        CHECK(timeout >= 0 && (unsigned long long) timeout <= delays[i]);
+
+        // In steps of varied length, to cross the level boundaries at different points of a round
+        unsigned long long now = START;
+
+        for(unsigned long long step = 1; now + step < START + delays[i]; step = step * 3 + 1) {
+            now += step;
+
+            CHECK(timer_wheel_advance(&wheel, now) == NULL);
+            CHECK(timer_armed(&timer) && wheel.count == 1);
+        }
+
+        CHECK(timer_wheel_advance(&wheel, START + delays[i] - 1) == NULL);
+        CHECK(timer_wheel_advance(&wheel, START + delays[i]) == &timer);
+        CHECK(!timer_armed(&timer) && wheel.count == 0);
+        CHECK(timer_wheel_timeout(&wheel, START + delays[i]) == -1);
+
+        if(failed > 0) {
+            fprintf(stderr, "  (timer %llu ms away)\n", delays[i]);
+            return failed;
+        }
+    }
+
+    return failed;
+}
+
+/**
+ * Timers sharing a slot are cancelled first, in the middle and last in it, before and after moving to a finer level.
+ */
+static int check_cancel(void) {
+    struct timer_wheel wheel;
+    struct timer timers[5];
+
+    int failed = 0;
+
+    memset(timers, 0, sizeof(timers));
+    start(&wheel);
+
+    // An unarmed timer is left alone
+    timer_cancel(&wheel, &timers[0]);
+    CHECK(wheel.count == 0 && !timer_armed(&timers[0]));
+
+    // All in the same slot of the second level
+    for(int i = 0; i < 5; i++) {
+        timer_arm(&wheel, &timers[i], START + 1000 + i);
+    }
+
+    CHECK(wheel.count == 5);
+
+    timer_cancel(&wheel, &timers[4]);   // First in the slot (timers are linked at its head)
+    timer_cancel(&wheel, &timers[2]);
+    timer_cancel(&wheel, &timers[0]);   // Last in the slot
+    timer_cancel(&wheel, &timers[0]);
+
+    CHECK(wheel.count == 2 && !timer_armed(&timers[0]) && timer_armed(&timers[1]));
+
+    // Down to the finest level: cancel one there, and move the other one later
+    CHECK(timer_wheel_advance(&wheel, START + 990) == NULL);
+
+    timer_cancel(&wheel, &timers[1]);
+    timer_arm(&wheel, &timers[3], START + 5000);
+
+    CHECK(wheel.count == 1);
+    CHECK(timer_wheel_advance(&wheel, START + 4999) == NULL);
+    CHECK(timer_wheel_advance(&wheel, START + 5000) == &timers[3] && timers[3].next == NULL);
+
+    // A wheel emptied by cancelling has no timeout, even with a slot of a coarser level still to come around
+    timer_arm(&wheel, &timers[0], START + 100000);
+    timer_cancel(&wheel, &timers[0]);
+
+    CHECK(wheel.count == 0 && timer_wheel_timeout(&wheel, START + 5000) == -1);
+
+    for(int level = 0; level < WHEEL_LEVELS; level++) {
+        CHECK(wheel.occupied[level] == 0);
+    }
+
+    // Timers armed in the past expire in the next millisecond the wheel processes
+    timer_arm(&wheel, &timers[1], START);
+    timer_arm(&wheel, &timers[2], START + 5000);
+
+    CHECK(timer_wheel_timeout(&wheel, START + 5001) == 0);
+    CHECK(length(timer_wheel_advance(&wheel, START + 5001)) == 2 && wheel.count == 0);
+
+    return failed;
+}
+
+/**
+ * Random arms, cancels and advances, checked against the expiries kept on the side: every timer expires in the
+ * first advance that reaches its time and never before, and the timeout never sleeps past the next expiry.
+ */
+static int check_random(unsigned int seed) {
+    static struct timer timers[NTIMERS];
+    static unsigned long long expiries[NTIMERS];
+    static int armed[NTIMERS];
+
+    struct timer_wheel wheel;
+    unsigned long long now = START;
+
+    memset(timers, 0, sizeof(timers));
+    memset(armed, 0, sizeof(armed));
+
+    start(&wheel);
+    srand(seed);
+
+    for(int operation = 0; operation < OPERATIONS; operation++) {
+        int choice = rand() % 10;
+        int i = rand() % NTIMERS;
+
+        if(choice < 4) {
+            // Mostly within the first levels, like the deadlines of the server; sometimes hours away
+            unsigned long long delay = (rand() % 4 == 0) ? (unsigned long long) rand() % 30000000 : (unsigned long long) rand() % 20000;
+
+            timer_arm(&wheel, &timers[i], now + delay);
+
+            expiries[i] = now + delay;
+            armed[i] = 1;
+        }
+        else if(choice < 5) {
+            timer_cancel(&wheel, &timers[i]);
+
+            armed[i] = 0;
+        }
+        else {
+            long timeout = timer_wheel_timeout(&wheel, now);
+            unsigned long long target = now + ((rand() % 3 == 0) ? ((timeout < 0) ? 1000 : (unsigned long long) timeout) : (unsigned long long) (rand() % 500));
+
+            for(struct timer *timer = timer_wheel_advance(&wheel, target); timer != NULL; timer = timer->next) {
+                int k = timer - timers;
+
+                if(!armed[k] || expiries[k] > target || (timeout >= 0 && expiries[k] > now && expiries[k] < now + timeout)) {
+                    fprintf(stderr, "seed %u: timer %d (armed %d, expiry %llu) expired advancing from %llu to %llu, timeout %ld\n", seed, k, armed[k], expiries[k], now, target, timeout);
+                    return 1;
+                }
+
+                armed[k] = 0;
+            }
+
+            now = target;
+
+            int count = 0;
+
+            for(int k = 0; k < NTIMERS; k++) {
+                if(armed[k] && expiries[k] <= now) {
+                    fprintf(stderr, "seed %u: timer %d (expiry %llu) missed at %llu\n", seed, k, expiries[k], now);
+                    return 1;
+                }
+
+                count += armed[k];
+            }
+
+            if(count != wheel.count) {
+                fprintf(stderr, "seed %u: %d timers armed, the wheel counts %d\n", seed, count, wheel.count);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned int seed = (argc > 1) ? (unsigned int) atoi(argv[1]) : 1;
+
+    int failed = check_cascade() + check_cancel() + check_random(seed);
+
+    printf("timer_wheel_test: %s\n", (failed == 0) ? "passed" : "FAILED");
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ * 
+ * 
+ * 
+ * HW1 implementation: Awais Abid
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "thread_pool.h"
+#include "offload.h"
+#include "config.h"
+
+// Attempts to find work before a worker parks
+#define SPIN_ATTEMPTS 64
+
+// Requests a worker moves from the request queue at once (it runs the first, and others may steal the rest)
+#define BATCH 8
+
+struct worker *workers;
+int nworkers;
+atomic_bool threads_done;
+struct request_queue *request_queue;
+
+// The worker running on the calling thread, if any
+static _Thread_local struct worker *current_worker;
+
+static void futex_wait(atomic_uint *address, unsigned int expected) {
+    syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *address, int count) {
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void initialize_request_queue() {
+    request_queue = (struct request_queue *) aligned_alloc(CACHE_LINE, sizeof(struct request_queue));
+
+    for(size_t i = 0; i < QUEUE_CAPACITY; i++) {
+        atomic_init(&request_queue->cells[i].sequence, i);
+        request_queue->cells[i].client = NULL;
+    }
+
+    atomic_init(&request_queue->enqueue_position, 0);
+    atomic_init(&request_queue->dequeue_position, 0);
+
+    atomic_init(&request_queue->wakeups, 0);
+    atomic_init(&request_queue->sleepers, 0);
+}
+
+/**
+ * @return 1 if \p client was enqueued; 0 if the queue is full.
+ */
+static int enqueue(struct client *client) {
+    size_t position = atomic_load_explicit(&request_queue->enqueue_position, memory_order_relaxed);
+
+    while(1) {
+        struct cell *cell = &request_queue->cells[position & (QUEUE_CAPACITY - 1)];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+
+        if(difference == 0) {
+            // The cell is free at this position: claim it
+            if(atomic_compare_exchange_weak_explicit(&request_queue->enqueue_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                cell->client = client;
+                atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+
+                return 1;
+            }
+        }
+        else if(difference < 0) {
+            // The cell still holds the element from one lap ago
+            return 0;
+        }
+        else {
+            position = atomic_load_explicit(&request_queue->enqueue_position, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @return The client at the head of the queue, or NULL if the queue is empty.
+ */
+static struct client *dequeue(void) {
+    size_t position = atomic_load_explicit(&request_queue->dequeue_position, memory_order_relaxed);
+
+    while(1) {
+        struct cell *cell = &request_queue->cells[position & (QUEUE_CAPACITY - 1)];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) (position + 1);
+
+        if(difference == 0) {
+            // The cell has been published at this position: claim it
+            if(atomic_compare_exchange_weak_explicit(&request_queue->dequeue_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                struct client *client = cell->client;
+
+                // Make the cell available to the producers of the next lap
+                atomic_store_explicit(&cell->sequence, position + QUEUE_CAPACITY, memory_order_release);
+
+                return client;
+            }
+        }
+        else if(difference < 0) {
+            return NULL;
+        }
+        else {
+            position = atomic_load_explicit(&request_queue->dequeue_position, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Pushes \p client at the bottom of \p deque. Only called by the deque's worker.
+ *
+ * @return 1 on success; 0 if the deque is full.
+ */
+static int push(struct deque *deque, struct client *client) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    if(bottom - top >= DEQUE_CAPACITY) {
+        return 0;
+    }
+
+    atomic_store_explicit(&deque->clients[bottom & (DEQUE_CAPACITY - 1)], client, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+
+    return 1;
+}
+
+/**
+ * Takes the client at the bottom of \p deque. Only called by the deque's worker.
+ *
+ * @return The client, or NULL if the deque is empty.
+ */
+static struct client *take(struct deque *deque) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    struct client *client = NULL;
+
+    if(top <= bottom) {
+        client = atomic_load_explicit(&deque->clients[bottom & (DEQUE_CAPACITY - 1)], memory_order_relaxed);
+
+        if(top == bottom) {
+            // Last client: race against the thieves for it
+            if(!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+                client = NULL;
+            }
+
+            atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        }
+    }
+    else {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+
+    return client;
+}
+
+/**
+ * Steals the client at the top (the oldest) of another worker's \p deque.
+ *
+ * @return The client, or NULL if the deque is empty or another thread won the race.
+ */
+static struct client *steal(struct deque *deque) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if(top >= bottom) {
+        return NULL;
+    }
+
+    struct client *client = atomic_load_explicit(&deque->clients[top & (DEQUE_CAPACITY - 1)], memory_order_relaxed);
+
+    if(!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+
+    return client;
+}
+
+/**
+ * Wakes up one parked worker, if any. Called after making work visible.
+ */
+static void wake_worker(void) {
+    // Pairs with the fence in wait_request(): either we see the worker announced as a sleeper,
+    // or the worker sees the new work when it looks for it again before parking
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if(atomic_load(&request_queue->sleepers) > 0) {
+        atomic_fetch_add(&request_queue->wakeups, 1);
+        futex_wake(&request_queue->wakeups, 1);
+    }
+}
+
+int start_threads(void) {
+    initialize_request_queue();
+    atomic_init(&threads_done, false);
+
+    nworkers = (config.threads > 0) ? config.threads : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(nworkers < 1) {
+        nworkers = 1;
+    }
+
+    workers = (struct worker *) aligned_alloc(CACHE_LINE, nworkers * sizeof(struct worker));
+
+    if(workers == NULL) {
+        perror("aligned_alloc");
+        return EXIT_FAILURE;
+    }
+
+    for(int i = 0; i < nworkers; i++) {
+        workers[i].id = i;
+        workers[i].seed = i + 1;
+
+        atomic_init(&workers[i].deque.top, 0);
+        atomic_init(&workers[i].deque.bottom, 0);
+    }
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_JOINABLE);
+
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // Launches all threads -- they are automatically started
+    for(int i = 0; i < nworkers; i++) {
+        if(pthread_create(&workers[i].thread, &attributes, execute_request, &workers[i]) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+
+        // Keep each worker (and the connections it handles) on one core
+        if(config.pin_threads && ncpus > 0) {
+            cpu_set_t cpus;
+
+            CPU_ZERO(&cpus);
+            CPU_SET(i % ncpus, &cpus);
+
+            if(pthread_setaffinity_np(workers[i].thread, sizeof(cpu_set_t), &cpus) != 0) {
+                fprintf(stderr, "Cannot pin worker %d to CPU %ld\n", i, i % ncpus);
+            }
+        }
+    }
+
+    pthread_attr_destroy(&attributes);
+
+    return EXIT_SUCCESS;
+}
+
+long queued_requests(void) {
+    if(request_queue == NULL) {
+        return 0;
+    }
+
+    long queued = (long) (atomic_load(&request_queue->enqueue_position) - atomic_load(&request_queue->dequeue_position));
+
+    for(int i = 0; workers != NULL && i < nworkers; i++) {
+        long size = atomic_load(&workers[i].deque.bottom) - atomic_load(&workers[i].deque.top);
+
+        if(size > 0) {
+            queued += size;
+        }
+    }
+
+    return (queued > 0) ? queued : 0;
+}
+
+void put_request(struct client *client) {
+    // A worker keeps the requests it creates in its own deque (unless it is full)
+    if(current_worker == NULL || !push(&current_worker->deque, client)) {
+        // No allocation per request: the client pointer goes straight into the ring
+        while(!enqueue(client)) {
+            sched_yield();
+        }
+    }
+
+    wake_worker();
+}
+
+/**
+ * Looks for a request: in the worker's own deque, then in the request queue, then in the deques of other workers.
+ *
+ * @return The client, or NULL if no work was found.
+ */
+static struct client *find_request(struct worker *worker) {
+    struct client *client;
+
+    if((client = take(&worker->deque)) != NULL) {
+        return client;
+    }
+
+    if((client = dequeue()) != NULL) {
+        // Move a few more requests into our deque, oldest at the bottom so that we take them in order.
+        // If we get stuck on a long reply, the other workers steal them.
+        struct client *batch[BATCH - 1];
+        int nbatch = 0;
+
+        while(nbatch < BATCH - 1 && (batch[nbatch] = dequeue()) != NULL) {
+            nbatch++;
+        }
+
+        for(int i = nbatch - 1; i >= 0; i--) {
+            // Our deque was empty, so this only fails if BATCH exceeds DEQUE_CAPACITY
+            while(!push(&worker->deque, batch[i]) && !enqueue(batch[i])) {
+                sched_yield();
+            }
+        }
+
+        if(nbatch > 0) {
+            wake_worker();
+        }
+
+        return client;
+    }
+
+    // Steal, starting from a random victim
+    int start = rand_r(&worker->seed) % nworkers;
+
+    for(int i = 0; i < nworkers; i++) {
+        struct worker *victim = &workers[(start + i) % nworkers];
+
+        if(victim != worker && (client = steal(&victim->deque)) != NULL) {
+            return client;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Finds the next client for \p worker, parking it while there is none.
+ *
+ * @return The client, or NULL if the pool is finishing.
+ */
+static struct client *wait_request(struct worker *worker) {
+    struct client *client;
+
+    while(!atomic_load(&threads_done)) {
+        for(int i = 0; i < SPIN_ATTEMPTS; i++) {
+            if((client = find_request(worker)) != NULL) {
+                return client;
+            }
+        }
+
+        unsigned int wakeups = atomic_load(&request_queue->wakeups);
+
+        atomic_fetch_add(&request_queue->sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if((client = find_request(worker)) != NULL || atomic_load(&threads_done)) {
+            atomic_fetch_sub(&request_queue->sleepers, 1);
+
+            if(client != NULL) {
+                return client;
+            }
+
+            break;
+        }
+
+        // Returns immediately if a wakeup happened since we read the counter
+        futex_wait(&request_queue->wakeups, wakeups);
+
+        atomic_fetch_sub(&request_queue->sleepers, 1);
+    }
+
+    return NULL;
+}
+
+void *execute_request(void *arg) {
+    struct worker *worker = (struct worker *) arg;
+    struct client *client;
+
+    current_worker = worker;
+
+    // block if there 's no request
+    while((client = wait_request(worker)) != NULL) {
+        // Blocking operation offloaded by an event loop: the loop keeps ownership of the client
+        client->task(client);
+        complete_offload(client);
+    }
+
+    pthread_exit(NULL);
+}
+
+int finish_threads(void) {
+    //update threads_done and wake up all parked threads for termination
+    atomic_store(&threads_done, true);
+
+    atomic_fetch_add(&request_queue->wakeups, 1);
+    futex_wake(&request_queue->wakeups, INT_MAX);
+
+    // Blocks main thread until all others return
+    for(int i = 0; i < nworkers; i++) {
+        if(pthread_join(workers[i].thread, NULL) != 0) {
+            fprintf(stderr, "Error joning threads\n");
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    free(workers);
+    free(request_queue);
+
+    return EXIT_SUCCESS;
+}
@@ -8,146 +8,84 @@
  */
 #include "clients_common.h"
 #include <stdatomic.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <stdbool.h>
 
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
-#define NUM_THREADS 16
+// Capacity of the request queue (a power of two); put_request() waits while it is full
+#define QUEUE_CAPACITY 4096
 
-struct request {
+// Capacity of each worker's deque (a power of two)
+#define DEQUE_CAPACITY 256
+
+#define CACHE_LINE 64
+
+struct cell {
+    atomic_size_t sequence;
     struct client *client;
+};
+
+// Bounded lock-free multi-producer/multi-consumer queue of clients, for FIFO request execution
+// (D. Vyukov's array-based queue). Each cell's sequence number tells whether it is ready to be
+// written or read at a given position, so producers and consumers only contend on their own index.
+// Requests from outside the pool (the event loops) enter the pool here.
+struct request_queue {
+    struct cell cells[QUEUE_CAPACITY];
+
+    _Alignas(CACHE_LINE) atomic_size_t enqueue_position;
+    _Alignas(CACHE_LINE) atomic_size_t dequeue_position;
+
+    // Idle workers park on a futex: wakeups counts signals, sleepers the workers about to park
+    _Alignas(CACHE_LINE) atomic_uint wakeups;
+    atomic_int sleepers;
+};
 
-    struct request *next;
+// Work-stealing deque (Chase-Lev, in the C11 formulation of Le et al.). Only its worker pushes and
+// takes at the bottom; other workers steal the oldest requests from the top.
+struct deque {
+    _Alignas(CACHE_LINE) atomic_long top;
+    _Alignas(CACHE_LINE) atomic_long bottom;
+
+    _Atomic(struct client *) clients[DEQUE_CAPACITY];
 };
 
-//requests list implementation for FIFO request execution
-struct request_list {
-    int size;
-    struct request *head;
-    struct request *tail;
-    pthread_mutex_t mutex;
-    pthread_cond_t empty;
+struct worker {
+    pthread_t thread;
+    int id;
+
+    unsigned int seed; // For choosing steal victims
+
+    struct deque deque;
 };
 
-void initialize_request_list();
+void initialize_request_queue();
 
+/**
+ * Starts the pool with config.threads workers (one per online CPU if 0), pinned to CPUs if config.pin_threads is set.
+ */
 int start_threads(void);
 int finish_threads(void);
 
+/**
+ * Hands \p client to a worker, which runs its task (see offload()).
+ */
 void put_request(struct client *client);
 
-//consumer thread function
+/**
+ * @return Requests waiting in the pool, in the request queue or in the workers' deques (a snapshot that may be
+ *         slightly off while they change).
+ */
+long queued_requests(void);
+
+//consumer thread function (the argument is its struct worker)
 void *execute_request(void *);
 
-pthread_t threadNumber[NUM_THREADS];
-atomic_bool threads_done;
-struct request_list *request_list;
-
-void initialize_request_list() {
-    request_list = (struct request_list *) malloc(sizeof(struct request_list));
-    request_list->head = NULL;
-    request_list->tail = NULL;
-    request_list->size = 0;
-    pthread_mutex_init(&request_list->mutex, NULL);
-    pthread_cond_init(&request_list->empty, NULL);
-}
-
-int start_threads(void) {
-    initialize_request_list();
-    atomic_init(&threads_done, false);
-
-    pthread_attr_t config;
-    pthread_attr_init(&config);
-    pthread_attr_setdetachstate(&config, PTHREAD_CREATE_JOINABLE);
-
-    // Launches all threads -- they are automatically started
-    for(int i = 0; i < NUM_THREADS; i++) {
-        if(pthread_create(&threadNumber[i], &config, execute_request, NULL) != 0) {
-            perror("pthread_create");
-            return EXIT_FAILURE;
-        }
-    }
-
-    return EXIT_SUCCESS;
-}
-
-void put_request(struct client *client) {
-    struct request *request = (struct request *) malloc(sizeof(struct request *));
-    request->client = client;
-    request->next = NULL;
-    pthread_mutex_lock(&request_list->mutex);
-
-    if(request_list->size == 0) {
-        request_list->head = request;
-    }
-    else {
-        request_list->tail->next = request;
-    }
-
-    request_list->tail = request;
-    request_list->size++;
-    pthread_cond_signal(&request_list->empty);
-    pthread_mutex_unlock(&request_list->mutex);
-}
-
-void *execute_request(void *arg) {
-    struct request *request;
-
-    // block if there 's no request
-    while(1) {
-        pthread_mutex_lock(&request_list->mutex);
-        while(request_list->size == 0 && !atomic_load(&threads_done)) {
-            pthread_cond_wait(&request_list->empty, &request_list->mutex);
-        }
-
-        //if termination flag has been set, stops waiting for requests
-        if(atomic_load(&threads_done)) {
-            pthread_mutex_unlock(&request_list->mutex);
-            break;
-        }
-        request = request_list->head;
-        request_list->head = request_list->head->next;
-        request_list->size -= 1;
-        pthread_mutex_unlock(&request_list->mutex);
-
-        struct client *client = request->client;
-        if(read_request(client)) {
-            write_reply(client);
-        }
-
-        if(client->status == STATUS_OK) {
-            // Increment the number of operations
-            atomic_fetch_add(&operations_completed, 1);
-        }
-
-        //free () allocated memory to avoid leaks
-        free(client);
-        free(request);
-    }
-
-    pthread_exit(NULL);
-}
-
-int finish_threads(void) {
-    //update threads_done and broadcast to wakeup all threads for termination
-    atomic_store(&threads_done, true);
-    pthread_cond_broadcast(&request_list->empty);
-
-    // Blocks main thread until all others return
-    for(int i = 0; i < NUM_THREADS; i++) {
-        if(pthread_join(threadNumber[i], NULL) != 0) {
-            fprintf(stderr, "Error joning threads\n");
-
-            return EXIT_FAILURE;
-        }
-    }
-    pthread_mutex_destroy(&request_list->mutex);
-    pthread_cond_destroy(&request_list->empty);
-    free(request_list);
-
-    return EXIT_SUCCESS;
-}
+extern struct worker *workers;
+extern int nworkers;
+extern atomic_bool threads_done;
+extern struct request_queue *request_queue;
 
 #endif /* THREAD_POOL_H */
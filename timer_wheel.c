@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Hierarchical timing wheel for the deadlines of the event loops.
+ */
+#include <string.h>
+#include <time.h>
+
+#include "timer_wheel.h"
+
+#define SLOT_MASK   (WHEEL_SLOTS - 1)
+
+// Bits of a time that select the slot of each level, and of all levels together
+#define SHIFT(level)    (WHEEL_BITS * (level))
+#define SPAN_BITS       SHIFT(WHEEL_LEVELS)
+
+unsigned long long timer_clock(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(struct timer_wheel *wheel) {
+    memset(wheel, 0, sizeof(struct timer_wheel));
+
+    wheel->now = timer_clock();
+}
+
+static void link_timer(struct timer_wheel *wheel, int level, int slot, struct timer *timer) {
+    struct timer **head = &wheel->slots[level][slot];
+
+    timer->next = *head;
+    timer->previous = head;
+
+    if(*head != NULL) {
+        (*head)->previous = &timer->next;
+    }
+
+    *head = timer;
+
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+/**
+ * Links \p timer into the slot where it waits for its expiry, relative to wheel->now.
+ */
+static void place(struct timer_wheel *wheel, struct timer *timer) {
+    unsigned long long expiry = (timer->expiry > wheel->now) ? timer->expiry : wheel->now;
+
+    // The level is given by the highest bit where the expiry differs from the current time
+    unsigned long long difference = expiry ^ wheel->now;
+
+    if(difference >> SPAN_BITS) {
+        // In the next round of the last level, its slot comes around once; further away, wait in the slot that comes
+        // around last, and be placed again then
+        int slot = (expiry - wheel->now < (1ULL << SPAN_BITS)) ? (int) (expiry >> SHIFT(WHEEL_LEVELS - 1)) : (int) (wheel->now >> SHIFT(WHEEL_LEVELS - 1)) - 1;
+
+        link_timer(wheel, WHEEL_LEVELS - 1, slot & SLOT_MASK, timer);
+        return;
+    }
+
+    int level = 0;
+
+    while(level < WHEEL_LEVELS - 1 && (difference >> SHIFT(level + 1)) != 0) {
+        level++;
+    }
+
+    link_timer(wheel, level, (expiry >> SHIFT(level)) & SLOT_MASK, timer);
+}
+
+/**
+ * Takes all the timers out of a slot.
+ *
+ * @return The timers, linked through their next field.
+ */
+static struct timer *take_slot(struct timer_wheel *wheel, int level, int slot) {
+    struct timer *timers = wheel->slots[level][slot];
+
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ULL << slot);
+
+    for(struct timer *timer = timers; timer != NULL; timer = timer->next) {
+        timer->previous = NULL;
+    }
+
+    return timers;
+}
+
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, unsigned long long expiry) {
+    if(timer_armed(timer)) {
+        timer_cancel(wheel, timer);
+    }
+
+    timer->expiry = expiry;
+
+    place(wheel, timer);
+
+    wheel->count++;
+}
+
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer) {
+    if(!timer_armed(timer)) {
+        return;
+    }
+
+    *timer->previous = timer->next;
+
+    if(timer->next != NULL) {
+        timer->next->previous = timer->previous;
+    }
+
+    // A timer first in its slot was linked from the head of the slot, which may be empty now
+    for(int level = 0; level < WHEEL_LEVELS; level++) {
+        struct timer **slots = wheel->slots[level];
+
+        if(timer->previous >= &slots[0] && timer->previous < &slots[WHEEL_SLOTS] && *timer->previous == NULL) {
+            wheel->occupied[level] &= ~(1ULL << (timer->previous - slots));
+            break;
+        }
+    }
+
+    timer->next = NULL;
+    timer->previous = NULL;
+
+    wheel->count--;
+}
+
+/**
+ * Moves the timers of the coarser levels whose slot starts at wheel->now (a multiple of WHEEL_SLOTS) to finer levels.
+ */
+static void cascade(struct timer_wheel *wheel) {
+    int top = 1;
+
+    while(top < WHEEL_LEVELS - 1 && (wheel->now & ((1ULL << SHIFT(top + 1)) - 1)) == 0) {
+        top++;
+    }
+
+    for(int level = top; level >= 1; level--) {
+        struct timer *next;
+
+        for(struct timer *timer = take_slot(wheel, level, (wheel->now >> SHIFT(level)) & SLOT_MASK); timer != NULL; timer = next) {
+            next = timer->next;
+            place(wheel, timer);
+        }
+    }
+}
+
+struct timer *timer_wheel_advance(struct timer_wheel *wheel, unsigned long long now) {
+    struct timer *expired = NULL;
+
+    while(wheel->now <= now) {
+        // The next slot of the finest level that has timers, if any is left in its current round
+        unsigned long long pending = wheel->occupied[0] >> (wheel->now & SLOT_MASK);
+
+        if(pending != 0 && wheel->now + __builtin_ctzll(pending) <= now) {
+            wheel->now += __builtin_ctzll(pending);
+
+            struct timer *next;
+
+            for(struct timer *timer = take_slot(wheel, 0, wheel->now & SLOT_MASK); timer != NULL; timer = next) {
+                next = timer->next;
+
+                // Timers from beyond the wheel may still be early
+                if(timer->expiry > wheel->now) {
+                    place(wheel, timer);
+                    continue;
+                }
+
+                timer->next = expired;
+                expired = timer;
+
+                wheel->count--;
+            }
+
+            wheel->now++;
+        }
+        else {
+            // Nothing expires in the rest of this round: skip to its end
+            unsigned long long round_end = (wheel->now | SLOT_MASK) + 1;
+
+            wheel->now = (round_end <= now + 1) ? round_end : now + 1;
+        }
+
+        if((wheel->now & SLOT_MASK) == 0) {
+            cascade(wheel);
+        }
+    }
+
+    return expired;
+}
+
+long timer_wheel_timeout(struct timer_wheel *wheel, unsigned long long now) {
+    if(wheel->count == 0) {
+        return -1;
+    }
+
+    unsigned long long next = 0;
+
+    for(int level = 0; level < WHEEL_LEVELS && next == 0; level++) {
+        unsigned long long occupied = wheel->occupied[level];
+        int current = (wheel->now >> SHIFT(level)) & SLOT_MASK;
+
+        if(occupied == 0) {
+            continue;
+        }
+
+        // The finest level is processed from the current slot on; the others from the next one (the current one has
+        // been moved to a finer level already), wrapping around to the next round of the level above
+        int first = (level == 0) ? current : current + 1;
+        unsigned long long ahead = (first < WHEEL_SLOTS) ? occupied >> first : 0;
+        unsigned long long round = (wheel->now >> SHIFT(level + 1)) << SHIFT(level + 1);
+
+        if(ahead != 0) {
+            next = round + ((unsigned long long) (first + __builtin_ctzll(ahead)) << SHIFT(level));
+        }
+        else if(level > 0) {
+            next = round + (1ULL << SHIFT(level + 1)) + ((unsigned long long) __builtin_ctzll(occupied) << SHIFT(level));
+        }
+    }
+
+    return (next > now) ? (long) (next - now) : 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+// Each level has 2^WHEEL_BITS slots; a slot of level L spans 2^(WHEEL_BITS * L) milliseconds
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_LEVELS    4
+
+/**
+ * Timer embedded in the object it belongs to. A timer is in at most one slot of one wheel at a time.
+ */
+struct timer {
+    struct timer *next;
+    struct timer **previous;        // Link that points to this timer; NULL if the timer is not armed
+
+    unsigned long long expiry;      // Milliseconds (see timer_clock())
+};
+
+/**
+ * Hierarchical timing wheel (as in Varghese and Lauck): arming and cancelling are O(1), and a timer is only moved
+ * to a finer level when its time gets close, at most once per level. Timers expire with millisecond resolution;
+ * those more than about four hours away wait in the last level, and are placed again when it comes around.
+ *
+ * A wheel belongs to one thread (an event loop).
+ */
+struct timer_wheel {
+    unsigned long long now;         // Next millisecond to be processed
+
+    struct timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    unsigned long long occupied[WHEEL_LEVELS];      // Bit i is set if slot i of the level has timers
+
+    int count;                      // Timers armed
+};
+
+/**
+ * @return The current time in milliseconds, from a coarse monotonic clock that does not enter the kernel.
+ */
+unsigned long long timer_clock(void);
+
+void timer_wheel_init(struct timer_wheel *wheel);
+
+/**
+ * Arms \p timer to expire at \p expiry (see timer_clock()), moving it if it is armed already.
+ */
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, unsigned long long expiry);
+
+/**
+ * Disarms \p timer, if it is armed.
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+static inline int timer_armed(struct timer *timer) {
+    return timer->previous != NULL;
+}
+
+/**
+ * Advances \p wheel to \p now, disarming the timers that expire by then.
+ *
+ * @return The expired timers, linked through their next field.
+ */
+struct timer *timer_wheel_advance(struct timer_wheel *wheel, unsigned long long now);
+
+/**
+ * @return Milliseconds from \p now until the wheel must be advanced again (it may be early, when timers only need to
+ *         move to a finer level), or -1 if no timer is armed.
+ */
+long timer_wheel_timeout(struct timer_wheel *wheel, unsigned long long now);
+
+#endif /* TIMER_WHEEL_H */
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ *
+ *
+ * Minimal io_uring(7) support over the raw system calls: ring setup, submission and completion.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_register(struct uring *ring, unsigned int opcode, void *argument, unsigned int nargs) {
+    return (int) syscall(__NR_io_uring_register, ring->fd, opcode, argument, nargs);
+}
+
+/**
+ * @return 1 if the kernel supports every operation in \p opcodes; 0 otherwise.
+ */
+static int supports(struct uring *ring, const int *opcodes, int nopcodes) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, size);
+
+    if(probe == NULL) {
+        return 0;
+    }
+
+    // Probing itself is only available since the kernel gained most of the operations we need
+    int supported = uring_register(ring, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for(int i = 0; supported && i < nopcodes; i++) {
+        supported = opcodes[i] <= probe->last_op && (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+
+    return supported;
+}
+
+int uring_init(struct uring *ring, unsigned int entries, const int *opcodes, int nopcodes) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(struct uring));
+    memset(&params, 0, sizeof(struct io_uring_params));
+
+    if((ring->fd = io_uring_setup(entries, &params)) == -1) {
+        return -1;
+    }
+
+    ring->features = params.features;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Both rings may live in a single mapping
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if(ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_exit(ring);
+
+        return -1;
+    }
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+        if(ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            uring_exit(ring);
+
+            return -1;
+        }
+    }
+
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if(ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_exit(ring);
+
+        return -1;
+    }
+
+    char *sq = (char *) ring->sq_ring;
+    char *cq = (char *) ring->cq_ring;
+
+    ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+
+    ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    if(!supports(ring, opcodes, nopcodes)) {
+        uring_exit(ring);
+
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return 0;
+}
+
+void uring_exit(struct uring *ring) {
+    if(ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    if(ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+
+    if(ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+
+    close(ring->fd);
+
+    memset(ring, 0, sizeof(struct uring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    unsigned int tail = *ring->sq_tail;
+
+    // The kernel consumes entries (advancing the head) when they are submitted
+    while(tail - atomic_load_explicit((_Atomic unsigned int *) ring->sq_head, memory_order_acquire) >= ring->sq_entries) {
+        if(uring_submit(ring, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    ring->sq_array[index] = index;
+
+    // Without SQPOLL, the kernel only reads entries in io_uring_enter(2): the caller fills this one before submitting
+    atomic_store_explicit((_Atomic unsigned int *) ring->sq_tail, tail + 1, memory_order_release);
+    ring->sq_queued++;
+
+    return sqe;
+}
+
+int uring_submit(struct uring *ring, int wait) {
+    int result = io_uring_enter(ring->fd, ring->sq_queued, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+
+    if(result > 0) {
+        ring->sq_queued -= result;
+    }
+
+    return result;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    unsigned int head = *ring->cq_head;
+
+    if(head == atomic_load_explicit((_Atomic unsigned int *) ring->cq_tail, memory_order_acquire)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+    atomic_store_explicit((_Atomic unsigned int *) ring->cq_head, *ring->cq_head + 1, memory_order_release);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2017, Hammurabi Mendes.
+ * Licence: BSD 2-clause
+ */
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+/**
+ * An io_uring(7) instance, driven directly through its system calls and shared rings.
+ * Submission queue entries are only handed to the kernel by uring_submit().
+ */
+struct uring {
+    int fd;
+    unsigned int features;          // IORING_FEAT_* flags of the kernel
+
+    // Submission queue
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+
+    struct io_uring_sqe *sqes;
+    unsigned int sq_queued;         // Entries filled since the last submission
+
+    // Completion queue
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+
+    struct io_uring_cqe *cqes;
+
+    // Mappings
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/**
+ * Creates \p ring with (at least) \p entries submission queue entries, and checks that the kernel
+ * supports every operation in \p opcodes (an array of \p nopcodes IORING_OP_* values).
+ *
+ * @return 0 on success; -1 (with errno set) if io_uring, or one of the operations, is not available.
+ */
+int uring_init(struct uring *ring, unsigned int entries, const int *opcodes, int nopcodes);
+void uring_exit(struct uring *ring);
+
+/**
+ * @return A zeroed submission queue entry. If the queue is full, the queued entries are submitted first.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/**
+ * Submits the queued entries and, if \p wait is not zero, waits until at least one completion is available.
+ *
+ * @return Number of entries submitted, or -1 on error (errno is EINTR if a signal interrupted the wait).
+ */
+int uring_submit(struct uring *ring, int wait);
+
+/**
+ * @return The oldest completion not consumed yet, or NULL if there is none.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+/**
+ * Consumes the completion returned by uring_peek_cqe().
+ */
+void uring_cqe_seen(struct uring *ring);
+
+/**
+ * Wrapper of io_uring_register(2).
+ *
+ * @return The result of the call, or -1 (with errno set) on error.
+ */
+int uring_register(struct uring *ring, unsigned int opcode, void *argument, unsigned int nargs);
+
+#endif /* URING_H */